@@ -0,0 +1,180 @@
+/** @file This file contains the code for windowed aggregation of mesh sensor readings
+ *
+ * Copyright Ambient Sensors 2017
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "aggregate.h"
+
+
+static agg_series_t *agg_find_series(agg_t *agg, uint8_t board, uint8_t metric, int create)
+{
+    uint8_t i;
+
+    for (i = 0; i < agg->used; i++)
+    {
+        if (agg->series[i].board == board && agg->series[i].metric == metric)
+        {
+            return &agg->series[i];
+        }
+    }
+    if (!create || agg->used == AGG_MAX_SERIES)
+    {
+        return NULL;
+    }
+    memset(&agg->series[agg->used], 0, sizeof(agg->series[0]));
+    agg->series[agg->used].board = board;
+    agg->series[agg->used].metric = metric;
+    return &agg->series[agg->used++];
+}
+
+static const agg_threshold_t *agg_find_threshold(const agg_t *agg, uint8_t metric)
+{
+    uint8_t i;
+
+    for (i = 0; i < AGG_MAX_THRESHOLDS; i++)
+    {
+        if (agg->thresholds[i].in_use && agg->thresholds[i].metric == metric)
+        {
+            return &agg->thresholds[i];
+        }
+    }
+    return NULL;
+}
+
+void agg_init(agg_t *agg)
+{
+    memset(agg, 0, sizeof(*agg));
+}
+
+int agg_add(agg_t *agg, uint8_t board, uint8_t metric, int16_t value)
+{
+    agg_series_t *series = agg_find_series(agg, board, metric, 1);
+    const agg_threshold_t *threshold = agg_find_threshold(agg, metric);
+    int known, crossed = 0;
+
+    agg->readings += 1;
+    if (series == NULL)
+    {
+        /// without a series there is no last value to see an edge against, and
+        /// flagging every reading past the threshold would pass them all through
+        agg->dropped += 1;
+        return 0;
+    }
+
+    /// a series seen before remembers its last value across windows
+    known = (series->count > 0 || series->carried_over);
+    if (threshold != NULL)
+    {
+        if (value > threshold->high)
+        {
+            crossed = !known || series->last <= threshold->high;
+        }
+        else if (value < threshold->low)
+        {
+            crossed = !known || series->last >= threshold->low;
+        }
+    }
+
+    if (series->count == 0)
+    {
+        series->min = value;
+        series->max = value;
+    }
+    else if (value < series->min)
+    {
+        series->min = value;
+    }
+    else if (value > series->max)
+    {
+        series->max = value;
+    }
+    if (series->count < 0xFFFF)
+    {
+        /// 65535 readings of at most 32767 still fit the total
+        series->count += 1;
+        series->total += value;
+    }
+    series->last = value;
+    return crossed;
+}
+
+int agg_set_threshold(agg_t *agg, uint8_t metric, int16_t low, int16_t high)
+{
+    agg_threshold_t *threshold = (agg_threshold_t*)agg_find_threshold(agg, metric);
+    uint8_t i;
+
+    for (i = 0; threshold == NULL && i < AGG_MAX_THRESHOLDS; i++)
+    {
+        if (!agg->thresholds[i].in_use)
+        {
+            threshold = &agg->thresholds[i];
+        }
+    }
+    if (threshold == NULL)
+    {
+        return -1;
+    }
+    threshold->in_use = (low <= high);
+    threshold->metric = metric;
+    threshold->low = low;
+    threshold->high = high;
+    return 0;
+}
+
+uint32_t agg_format_summary(const agg_t *agg, uint32_t window_s, char *buffer, uint32_t size)
+{
+    uint32_t length;
+    uint8_t i, first = 1;
+
+    if (agg->readings == 0)
+    {
+        return 0;
+    }
+    length = snprintf(buffer, size, "{\"window_s\":%u,\"readings\":%u,\"dropped\":%u,\"series\":[",
+                      (unsigned)window_s, (unsigned)agg->readings, (unsigned)agg->dropped);
+    for (i = 0; i < agg->used && length < size; i++)
+    {
+        const agg_series_t *series = &agg->series[i];
+
+        if (series->count == 0)
+        {
+            continue;
+        }
+        length += snprintf(&buffer[length], size - length,
+                           "%s{\"board\":%u,\"metric\":%u,\"count\":%u,\"min\":%d,\"max\":%d,\"mean\":%d,\"last\":%d}",
+                           first ? "" : ",", series->board, series->metric, series->count, series->min,
+                           series->max, (int)(series->total / series->count), series->last);
+        first = 0;
+    }
+    if (length < size)
+    {
+        length += snprintf(&buffer[length], size - length, "]}");
+    }
+    /// snprintf returns what it would have written, don't hand back more than the buffer
+    return (length < size) ? length : 0;
+}
+
+void agg_next_window(agg_t *agg)
+{
+    uint8_t i = 0;
+
+    while (i < agg->used)
+    {
+        agg_series_t *series = &agg->series[i];
+
+        if (series->count == 0)
+        {
+            /// nothing for a whole window, make room (order doesn't matter)
+            *series = agg->series[--agg->used];
+            continue;
+        }
+        series->count = 0;
+        series->total = 0;
+        series->carried_over = 1;
+        i++;
+    }
+    agg->readings = 0;
+    agg->dropped = 0;
+}
@@ -0,0 +1,82 @@
+/** @file This file contains the api for windowed aggregation of mesh sensor readings
+ *
+ * Readings are folded per (board, metric) series into count, min, max,
+ * mean and last over a window, in a fixed table of AGG_MAX_SERIES entries:
+ * a reading for a new series when the table is full is counted as dropped.
+ * A series that saw no reading for a whole window gives its slot back.
+ *
+ * A reading that crosses a threshold configured for its metric (goes above
+ * 'high' or below 'low' from the other side, or starts out there) is
+ * flagged so the caller can pass it through raw on top of the summary.
+ * Only readings of a series in the table are flagged, a dropped one has no
+ * last value to tell a crossing from a reading that stays out there.
+ *
+ * Plain C without ZentriOS dependencies so it can be built and exercised
+ * on a host (tools/agg_test.c), the app side lives in telemetry.c.
+ *
+ * Copyright Ambient Sensors 2017
+ */
+#ifndef _AGGREGATE_H_
+#define _AGGREGATE_H_
+
+#include <stdint.h>
+
+#define AGG_MAX_SERIES              32
+#define AGG_MAX_THRESHOLDS          8
+/// longest JSON one series formats to, plus the summary's own framing
+#define AGG_SERIES_JSON_SIZE        100
+#define AGG_SUMMARY_SIZE            (64 + AGG_MAX_SERIES * AGG_SERIES_JSON_SIZE)
+
+typedef struct
+{
+    uint8_t board;
+    uint8_t metric;
+    uint16_t count;             /// readings this window
+    uint8_t carried_over;       /// had readings last window, so 'last' is from there
+    int16_t min;
+    int16_t max;
+    int16_t last;
+    int32_t total;
+} agg_series_t;
+
+typedef struct
+{
+    uint8_t metric;
+    uint8_t in_use;
+    int16_t low;
+    int16_t high;
+} agg_threshold_t;
+
+typedef struct
+{
+    agg_series_t series[AGG_MAX_SERIES];
+    uint8_t used;
+    agg_threshold_t thresholds[AGG_MAX_THRESHOLDS];
+    uint32_t readings;          /// this window
+    uint32_t dropped;           /// this window, no free series
+} agg_t;
+
+/** @brief Clear the series, the window counters and the thresholds
+ */
+void agg_init(agg_t *agg);
+
+/** @brief Fold a reading into its series, returns 1 if it crossed a threshold and should be passed through
+ */
+int agg_add(agg_t *agg, uint8_t board, uint8_t metric, int16_t value);
+
+/** @brief Set (or with low > high, clear) the thresholds of a metric, returns 0 or -1 if the table is full
+ */
+int agg_set_threshold(agg_t *agg, uint8_t metric, int16_t low, int16_t high);
+
+/** @brief Format the window as JSON, returns the length (0 when nothing was read this window)
+ *
+ *  {"window_s":60,"readings":12,"dropped":0,"series":[{"board":1,"metric":2,
+ *   "count":6,"min":-3,"max":40,"mean":17,"last":21},...]}
+ */
+uint32_t agg_format_summary(const agg_t *agg, uint32_t window_s, char *buffer, uint32_t size);
+
+/** @brief Start a new window, series idle for a whole window are freed
+ */
+void agg_next_window(agg_t *agg);
+
+#endif
@@ -0,0 +1,141 @@
+/** @file This file contains the code for the app's memory and its instrumentation
+ *
+ * Copyright Ambient Sensors 2017
+ */
+
+#include "zos.h"
+#include "common.h"
+#include "publish.h"
+#include "gateway.h"
+#include "lz_compress.h"
+#include "app_memory.h"
+
+#ifdef APP_STATIC_MEMORY
+typedef struct
+{
+    mqtt_connection_t mqtt_connection;
+    mqtt_connection_t gateway_connections[GATEWAY_MAX_IDENTITIES];
+    uint8_t scratch[APP_SCRATCH_SIZE];
+    uint8_t gather[APP_GATHER_SIZE];
+    uint32_t compress[APP_COMPRESS_SIZE / sizeof(uint32_t)];
+} app_arena_t;
+
+/// if the build fails here the arena has outgrown its budget
+APP_STATIC_ASSERT(sizeof(app_arena_t) <= APP_ARENA_BUDGET, arena_fits_budget);
+
+static app_arena_t arena;
+#endif
+
+/// the biggest publish has to fit the network buffer together with its topic and MQTT/TLS framing
+APP_STATIC_ASSERT(MAX_PUBLISH_PAYLOAD_SIZE + MAX_TOPIC_STRING_SIZE + 512 <= NETWORK_BUFFER_SIZE, publish_fits_network_buffer);
+
+static uint32_t sizes[APP_MEM_TAG_COUNT][APP_MEM_MAX_INSTANCES];
+static app_mem_usage_t usage[APP_MEM_TAG_COUNT];
+static app_mem_usage_t total;
+static uint32_t network_peak_tx;
+static uint32_t network_peak_rx;
+
+
+static void app_mem_account(app_mem_tag_t tag, int32_t delta)
+{
+    usage[tag].current += delta;
+    if (usage[tag].current > usage[tag].peak)
+    {
+        usage[tag].peak = usage[tag].current;
+    }
+    total.current += delta;
+    if (total.current > total.peak)
+    {
+        total.peak = total.current;
+    }
+}
+
+void *app_mem_alloc(app_mem_tag_t tag, uint8_t index, uint32_t size)
+{
+    uint8_t *block = NULL;
+
+    if (tag >= APP_MEM_TAG_COUNT || index >= APP_MEM_MAX_INSTANCES || sizes[tag][index] != 0)
+    {
+        return NULL;
+    }
+
+#ifdef APP_STATIC_MEMORY
+    switch (tag)
+    {
+        case APP_MEM_MQTT_CONNECTION:
+            block = (size <= sizeof(arena.mqtt_connection)) ? (uint8_t*)&arena.mqtt_connection : NULL;
+            break;
+        case APP_MEM_GATEWAY_CONNECTION:
+            block = (index < GATEWAY_MAX_IDENTITIES && size <= sizeof(arena.gateway_connections[0])) ?
+                    (uint8_t*)&arena.gateway_connections[index] : NULL;
+            break;
+        case APP_MEM_SCRATCH:
+            block = (size <= sizeof(arena.scratch)) ? arena.scratch : NULL;
+            break;
+        case APP_MEM_GATHER:
+            block = (size <= sizeof(arena.gather)) ? arena.gather : NULL;
+            break;
+        case APP_MEM_COMPRESS:
+            block = (size <= sizeof(arena.compress)) ? (uint8_t*)arena.compress : NULL;
+            break;
+        default:
+            break;
+    }
+#else
+    zn_malloc(&block, size);
+#endif
+
+    if (block == NULL)
+    {
+        usage[tag].failures += 1;
+        total.failures += 1;
+        ZOS_LOG("ERROR, %s no memory for %u bytes (use %u)", __func__, size, tag);
+        return NULL;
+    }
+    sizes[tag][index] = size;
+    app_mem_account(tag, size);
+    return block;
+}
+
+void app_mem_free(app_mem_tag_t tag, uint8_t index, void *block)
+{
+    if (block == NULL || tag >= APP_MEM_TAG_COUNT || index >= APP_MEM_MAX_INSTANCES)
+    {
+        return;
+    }
+#ifndef APP_STATIC_MEMORY
+    zn_free(block);
+#endif
+    app_mem_account(tag, -(int32_t)sizes[tag][index]);
+    sizes[tag][index] = 0;
+}
+
+void app_mem_get_usage(app_mem_tag_t tag, app_mem_usage_t *out)
+{
+    *out = (tag < APP_MEM_TAG_COUNT) ? usage[tag] : total;
+}
+
+uint32_t app_mem_arena_size(void)
+{
+#ifdef APP_STATIC_MEMORY
+    return sizeof(app_arena_t);
+#else
+    return 0;
+#endif
+}
+
+void app_mem_network_packet(zos_bool_t transmit, uint32_t size)
+{
+    uint32_t *peak = transmit ? &network_peak_tx : &network_peak_rx;
+
+    if (size > *peak)
+    {
+        *peak = size;
+    }
+}
+
+void app_mem_get_network_peaks(uint32_t *transmit, uint32_t *receive)
+{
+    *transmit = network_peak_tx;
+    *receive = network_peak_rx;
+}
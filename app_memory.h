@@ -0,0 +1,75 @@
+/** @file This file contains the api for the app's memory and its instrumentation
+ *
+ * Everything the app would otherwise zn_malloc() goes through app_mem_alloc().
+ * Built with APP_STATIC_MEMORY defined (add it to $(NAME)_DEFINES in
+ * azure_iot_token.mk) the blocks come from one statically sized arena whose
+ * size is checked at compile time against APP_ARENA_BUDGET, so the app can't
+ * run out of heap at runtime.  Without it the heap is used, and the current
+ * and peak bytes held are tracked per use.
+ *
+ * Either way the peaks can be read back (mqtt.memory) together with the
+ * deepest stack sampled per handler (a lower bound, see scheduler.h) and
+ * the largest packets through the network buffer, to size the budgets
+ * from real traffic.
+ *
+ * Copyright Ambient Sensors 2017
+ */
+#ifndef _APP_MEMORY_H_
+#define _APP_MEMORY_H_
+
+#define APP_ARENA_BUDGET            (48*1024)
+/// cmd_batch -f reads its file into it
+#define APP_SCRATCH_SIZE            MAX_BATCH_FILE_SIZE
+/// publish_segments() gathers into it and holds it until the publish completes, the largest publish has to fit
+#define APP_GATHER_SIZE             MAX_PUBLISH_PAYLOAD_SIZE
+/// lz hash table plus room for the largest publish, so whatever shrinks fits (needs lz_compress.h)
+#define APP_COMPRESS_SIZE           (sizeof(lz_state_t) + MAX_PUBLISH_PAYLOAD_SIZE)
+#define APP_MEM_MAX_INSTANCES       GATEWAY_MAX_IDENTITIES
+
+/// compile time check, fails the build with a negative array size
+#define APP_STATIC_ASSERT(condition, name)  typedef char app_static_assert_##name[(condition) ? 1 : -1]
+
+typedef enum
+{
+    APP_MEM_MQTT_CONNECTION,
+    APP_MEM_GATEWAY_CONNECTION,     /// one instance per gateway identity
+    APP_MEM_SCRATCH,
+    APP_MEM_GATHER,
+    APP_MEM_COMPRESS,
+    APP_MEM_TAG_COUNT
+} app_mem_tag_t;
+
+typedef struct
+{
+    uint32_t current;
+    uint32_t peak;
+    uint32_t failures;
+} app_mem_usage_t;
+
+/** @brief Get the block for a use of memory, NULL if it doesn't fit
+ *
+ *  index picks the instance for uses with more than one (gateway connections).
+ */
+void *app_mem_alloc(app_mem_tag_t tag, uint8_t index, uint32_t size);
+
+/** @brief Give the block back
+ */
+void app_mem_free(app_mem_tag_t tag, uint8_t index, void *block);
+
+/** @brief Bytes held for a use (or all uses, tag APP_MEM_TAG_COUNT), now and at peak
+ */
+void app_mem_get_usage(app_mem_tag_t tag, app_mem_usage_t *usage);
+
+/** @brief Size of the static arena, 0 when built for the heap
+ */
+uint32_t app_mem_arena_size(void);
+
+/** @brief Note the size of a packet going through the network buffer
+ */
+void app_mem_network_packet(zos_bool_t transmit, uint32_t size);
+
+/** @brief Largest packet sent and received so far
+ */
+void app_mem_get_network_peaks(uint32_t *transmit, uint32_t *receive);
+
+#endif
@@ -20,7 +20,21 @@ $(NAME)_AUTO_SOURCES :=
 # List of files to include in the project build. Paths relative to the project's directory
 $(NAME)_SOURCES := main.c \
                    commands.c \
-                   mesh_control.c
+                   mesh_control.c \
+                   mesh_protocol.c \
+                   traffic_trace.c \
+                   publish.c \
+                   latency.c \
+                   scheduler.c \
+                   gateway.c \
+                   keepalive.c \
+                   app_memory.c \
+                   lz_compress.c \
+                   subscriptions.c \
+                   aggregate.c \
+                   telemetry.c \
+                   power_policy.c \
+                   power.c
 
 # List of regular expressions to use for including source files into the build
 $(NAME)_AUTO_INCLUDE := 
@@ -35,6 +49,8 @@ $(NAME)_COMPONENTS := ZENTRIOS_SDK_ROOT/libraries/cloud/protocols/mqtt
 $(NAME)_LIBRARAY_PATHS := 
 
 # Pre-processor symbols for this project component only (not referenced libraries)
+# Add APP_STATIC_MEMORY to take all of the app's memory from one static arena instead of the heap
+# Add MESH_BRIDGE_COUNT=2 when a second Nordic mesh bridge is wired to UART 2
 $(NAME)_DEFINES := 
 
 # Pre-processor symbols for the entire build (this project and all referenced libraries)
@@ -10,6 +10,58 @@
 #include "zos.h"
 #include "common.h"
 #include "mesh_control.h"
+#include "traffic_trace.h"
+#include "latency.h"
+#include "scheduler.h"
+#include "publish.h"
+#include "gateway.h"
+#include "keepalive.h"
+#include "app_memory.h"
+#include "subscriptions.h"
+#include "telemetry.h"
+#include "power.h"
+
+/// how a changed setting takes effect on mqtt_commit
+typedef enum
+{
+    SETTING_APPLY_HOT,          /// right away, on the open connection
+    SETTING_APPLY_RECONNECT,    /// the connections are dropped and reopened
+    SETTING_APPLY_NEXT_CONNECT, /// the current connection stays up, the next one uses it
+} setting_apply_t;
+
+typedef struct
+{
+    const char *name;
+    uint16_t offset;
+    uint16_t size;
+    setting_apply_t apply;
+} setting_field_t;
+
+#define SETTING_FIELD(field, apply) \
+    { "mqtt." #field, offsetof(mqtt_settings_t, field), sizeof(((mqtt_settings_t*)0)->field), apply }
+
+static const setting_field_t setting_fields[] =
+{
+    SETTING_FIELD(host,               SETTING_APPLY_RECONNECT),
+    SETTING_FIELD(port,               SETTING_APPLY_RECONNECT),
+    SETTING_FIELD(security,           SETTING_APPLY_RECONNECT),
+    SETTING_FIELD(device,             SETTING_APPLY_RECONNECT),
+    /// a SAS token is only checked at CONNECT, the one in use stays valid until it expires
+    SETTING_FIELD(token_expiry,       SETTING_APPLY_NEXT_CONNECT),
+    SETTING_FIELD(token_sig,          SETTING_APPLY_NEXT_CONNECT),
+    SETTING_FIELD(qos,                SETTING_APPLY_HOT),
+    /// probing follows right away, a lower maximum reconnects, a higher one is used from the next connect
+    SETTING_FIELD(keepalive,          SETTING_APPLY_HOT),
+    SETTING_FIELD(keepalive_min,      SETTING_APPLY_HOT),
+    SETTING_FIELD(latency_interval,   SETTING_APPLY_HOT),
+    SETTING_FIELD(compress_threshold, SETTING_APPLY_HOT),
+    SETTING_FIELD(agg_window,         SETTING_APPLY_HOT),
+    SETTING_FIELD(power_save,         SETTING_APPLY_HOT),
+};
+
+/// setters write here, mqtt_commit moves it to NVM in one go
+static mqtt_settings_t staged_settings;
+static zos_bool_t settings_staged;
 
 
 /*************************************************
@@ -32,6 +84,11 @@ RO_MEM mqtt_settings_t default_settings =
         .qos            = MQTT_QOS,
         .security       = MQTT_SECURITY,
         .keepalive      = MQTT_KEEPALIVE,
+        .keepalive_min  = MQTT_KEEPALIVE_MIN,
+        .latency_interval = LATENCY_INTERVAL,
+        .compress_threshold = COMPRESS_THRESHOLD,
+        .agg_window     = AGG_WINDOW,
+        .power_save     = POWER_SAVE,
 };
 
 /*************************************************************************************************
@@ -46,6 +103,22 @@ ZOS_GETTERS_START(mqtt)
     ZOS_ADD_GETTER("mqtt.qos",          mqtt_qos),
     ZOS_ADD_GETTER("mqtt.security",     mqtt_security),
     ZOS_ADD_GETTER("mqtt.keepalive",    mqtt_keepalive),
+    ZOS_ADD_GETTER("mqtt.keepalive_min", mqtt_keepalive_min),
+    ZOS_ADD_GETTER("mqtt.keepalive_stats", mqtt_keepalive_stats),
+    ZOS_ADD_GETTER("mqtt.latency_interval", mqtt_latency_interval),
+    ZOS_ADD_GETTER("mqtt.latency",      mqtt_latency),
+    ZOS_ADD_GETTER("mqtt.sched",        mqtt_sched),
+    ZOS_ADD_GETTER("mqtt.gateway",      mqtt_gateway),
+    ZOS_ADD_GETTER("mqtt.mesh",         mqtt_mesh),
+    ZOS_ADD_GETTER("mqtt.memory",       mqtt_memory),
+    ZOS_ADD_GETTER("mqtt.compress_threshold", mqtt_compress_threshold),
+    ZOS_ADD_GETTER("mqtt.compression",  mqtt_compression),
+    ZOS_ADD_GETTER("mqtt.agg_window",   mqtt_agg_window),
+    ZOS_ADD_GETTER("mqtt.agg",          mqtt_agg),
+    ZOS_ADD_GETTER("mqtt.power_save",   mqtt_power_save),
+    ZOS_ADD_GETTER("mqtt.power",        mqtt_power),
+    ZOS_ADD_GETTER("mqtt.pending",      mqtt_pending),
+    ZOS_ADD_GETTER("mqtt.subscriptions", mqtt_subscriptions),
 ZOS_GETTERS_END
 
 /*************************************************************************************************
@@ -60,6 +133,11 @@ ZOS_SETTERS_START(mqtt)
     ZOS_ADD_SETTER("mqtt.qos",          mqtt_qos),
     ZOS_ADD_SETTER("mqtt.security",     mqtt_security),
     ZOS_ADD_SETTER("mqtt.keepalive",    mqtt_keepalive),
+    ZOS_ADD_SETTER("mqtt.keepalive_min", mqtt_keepalive_min),
+    ZOS_ADD_SETTER("mqtt.latency_interval", mqtt_latency_interval),
+    ZOS_ADD_SETTER("mqtt.compress_threshold", mqtt_compress_threshold),
+    ZOS_ADD_SETTER("mqtt.agg_window",   mqtt_agg_window),
+    ZOS_ADD_SETTER("mqtt.power_save",   mqtt_power_save),
 ZOS_SETTERS_END
 
 /*************************************************************************************************
@@ -69,9 +147,19 @@ ZOS_COMMANDS_START(mqtt)
     ZOS_ADD_COMMAND("mqtt_connect", 0, 0, ZOS_FALSE, mqtt_connect),
     ZOS_ADD_COMMAND("mqtt_disconnect", 0, 0, ZOS_FALSE, mqtt_disconnect),
     ZOS_ADD_COMMAND("mqtt_publish", 2, 2, ZOS_FALSE, mqtt_publish),
-    ZOS_ADD_COMMAND("mqtt_subscribe", 1, 1, ZOS_FALSE, mqtt_subscribe),
-    ZOS_ADD_COMMAND("mqtt_unsubscribe", 1, 1, ZOS_FALSE, mqtt_unsubscribe)
+    ZOS_ADD_COMMAND("mqtt_subscribe", 1, 2, ZOS_FALSE, mqtt_subscribe),
+    ZOS_ADD_COMMAND("mqtt_unsubscribe", 1, 1, ZOS_FALSE, mqtt_unsubscribe),
     ZOS_ADD_COMMAND("cmd", 2, 2, ZOS_FALSE, send_a_command),
+    ZOS_ADD_COMMAND("cmd_batch", 1, 2, ZOS_FALSE, send_a_batch),
+    ZOS_ADD_COMMAND("mesh_route", 2, 2, ZOS_FALSE, mesh_route),
+    ZOS_ADD_COMMAND("agg_threshold", 3, 3, ZOS_FALSE, agg_threshold),
+    ZOS_ADD_COMMAND("gw_add", 4, 4, ZOS_FALSE, gw_add),
+    ZOS_ADD_COMMAND("gw_remove", 1, 1, ZOS_FALSE, gw_remove),
+    ZOS_ADD_COMMAND("trace_start", 1, 1, ZOS_FALSE, trace_start),
+    ZOS_ADD_COMMAND("trace_stop", 0, 0, ZOS_FALSE, trace_stop),
+    ZOS_ADD_COMMAND("trace_replay", 1, 2, ZOS_FALSE, trace_replay),
+    ZOS_ADD_COMMAND("mqtt_commit", 0, 0, ZOS_FALSE, mqtt_commit),
+    ZOS_ADD_COMMAND("mqtt_abort", 0, 0, ZOS_FALSE, mqtt_abort),
 
 ZOS_COMMANDS_END
 
@@ -109,6 +197,124 @@ void commands_deinit(void)
     ZOS_CMD_UNREGISTER_COMMANDS(mqtt);
 }
 
+/*************************************************************************************************
+ * Staged settings
+ *************************************************************************************************/
+/// the copy the setters write to, started from the NVM settings by the first set after a commit or abort
+static mqtt_settings_t *settings_stage(void)
+{
+    mqtt_settings_t *settings;
+
+    if (!settings_staged)
+    {
+        ZOS_NVM_GET_REF(settings);
+        memcpy(&staged_settings, settings, sizeof(staged_settings));
+        settings_staged = ZOS_TRUE;
+    }
+    return &staged_settings;
+}
+
+static zos_bool_t settings_field_changed(const setting_field_t *field, const mqtt_settings_t *settings)
+{
+    return memcmp((const uint8_t*)settings + field->offset, (const uint8_t*)&staged_settings + field->offset,
+                  field->size) != 0;
+}
+
+/// check the staged set as a whole, NULL if it can be committed
+static const char *settings_validate(const mqtt_settings_t *staged)
+{
+    if (staged->host[0] == 0)
+    {
+        return "mqtt.host is empty";
+    }
+    if (staged->device[0] == 0)
+    {
+        return "mqtt.device is empty";
+    }
+    if (staged->port == 0)
+    {
+        return "mqtt.port is 0";
+    }
+    if (staged->qos > MQTT_QOS_DELIVER_AT_LEAST_ONCE)
+    {
+        return "IoT Hub doesn't support mqtt.qos 2";
+    }
+    if (staged->keepalive != 0 && staged->keepalive_min > staged->keepalive)
+    {
+        return "mqtt.keepalive_min is above mqtt.keepalive";
+    }
+    return NULL;
+}
+
+static zos_result_t settings_commit(void)
+{
+    mqtt_settings_t *settings;
+    zos_bool_t reconnect = ZOS_FALSE;
+    const char *error;
+    uint8_t i;
+
+    if (!settings_staged)
+    {
+        ZOS_LOG("Nothing to commit");
+        return ZOS_SUCCESS;
+    }
+    if ((error = settings_validate(&staged_settings)) != NULL)
+    {
+        ZOS_LOG("Failed (%s), nothing changed", error);
+        return ZOS_ERROR;
+    }
+
+    ZOS_NVM_GET_REF(settings);
+    for (i = 0; i < sizeof(setting_fields) / sizeof(setting_fields[0]); i++)
+    {
+        if (settings_field_changed(&setting_fields[i], settings))
+        {
+            ZOS_LOG("%s changed%s", setting_fields[i].name,
+                    (setting_fields[i].apply == SETTING_APPLY_RECONNECT) ? ", reconnecting" :
+                    (setting_fields[i].apply == SETTING_APPLY_NEXT_CONNECT) ? ", used from the next connect" : "");
+            reconnect |= (setting_fields[i].apply == SETTING_APPLY_RECONNECT);
+        }
+    }
+    if (settings->latency_interval != staged_settings.latency_interval)
+    {
+        latency_summary_start(staged_settings.latency_interval);
+    }
+    if (settings->agg_window != staged_settings.agg_window)
+    {
+        telemetry_start(staged_settings.agg_window);
+    }
+
+    /// everything else reads the settings when it uses them, qos included
+    memcpy(settings, &staged_settings, sizeof(staged_settings));
+    settings_staged = ZOS_FALSE;
+    if (zn_settings_save(NULL) != ZOS_SUCCESS)
+    {
+        ZOS_LOG("Failed to save settings to flash, applied until reboot");
+    }
+
+    keepalive_set_bounds(settings->keepalive_min, settings->keepalive);
+    publish_set_compress_threshold(settings->compress_threshold);
+    power_set_enabled(settings->power_save);
+    if (reconnect)
+    {
+        if ((mqtt_connection != NULL) && (mqtt_connection->net_init_ok == ZOS_TRUE))
+        {
+            keepalive_reconnect();
+        }
+        gateway_reconnect_all();
+    }
+    return ZOS_SUCCESS;
+}
+
+static void settings_abort(void)
+{
+    if (settings_staged)
+    {
+        ZOS_LOG("Staged settings discarded");
+    }
+    settings_staged = ZOS_FALSE;
+}
+
 /*************************************************************************************************
  * Commands
  *************************************************************************************************/
@@ -124,7 +330,7 @@ ZOS_DEFINE_COMMAND(mqtt_connect)
         }
         else
         {
-            zn_event_issue(mqtt_app_connect, NULL, 0);
+            SCHED_ISSUE(mqtt_app_connect, NULL, SCHED_PRIORITY_LOW, SCHED_NO_DEADLINE);
         }
     }
     else if(mqtt_connection->net_init_ok == ZOS_TRUE)
@@ -133,7 +339,7 @@ ZOS_DEFINE_COMMAND(mqtt_connect)
     }
     else
     {
-        zn_event_issue(mqtt_app_connect, NULL, 0);
+        SCHED_ISSUE(mqtt_app_connect, NULL, SCHED_PRIORITY_LOW, SCHED_NO_DEADLINE);
     }
     return CMD_EXECUTE_AOK;
 }
@@ -144,11 +350,11 @@ ZOS_DEFINE_COMMAND(mqtt_disconnect)
     if((mqtt_connection == NULL) || (mqtt_connection->net_init_ok != ZOS_TRUE))
     {
         ZOS_LOG("Connection not opened. Cannot disconnect! but trying anyway");
-        zn_event_issue(mqtt_app_disconnect, NULL, 0);
+        SCHED_ISSUE(mqtt_app_disconnect, NULL, SCHED_PRIORITY_NORMAL, SCHED_NO_DEADLINE);
     }
     else
     {
-        zn_event_issue(mqtt_app_disconnect, NULL, 0);
+        SCHED_ISSUE(mqtt_app_disconnect, NULL, SCHED_PRIORITY_NORMAL, SCHED_NO_DEADLINE);
     }
     return CMD_EXECUTE_AOK;
 }
@@ -174,7 +380,7 @@ ZOS_DEFINE_COMMAND(mqtt_publish)
     {
         strncpy(topic, argv[0], MAX_TOPIC_STRING_SIZE);
         strncpy(message, argv[1], MAX_MESSAGE_STRING_SIZE);
-        zn_event_issue(mqtt_app_publish, NULL, 0);
+        SCHED_ISSUE(mqtt_app_publish, NULL, SCHED_PRIORITY_NORMAL, SCHED_NO_DEADLINE);
     }
     return CMD_EXECUTE_AOK;
 }
@@ -182,21 +388,20 @@ ZOS_DEFINE_COMMAND(mqtt_publish)
 /*************************************************************************************************/
 ZOS_DEFINE_COMMAND(mqtt_subscribe)
 {
-    if((mqtt_connection == NULL) || (mqtt_connection->net_init_ok != ZOS_TRUE))
-    {
-        ZOS_LOG("Not connected. Connect first using command 'mqtt_connect'");
-    }
-    else if(strlen(argv[0]) > MAX_TOPIC_STRING_SIZE)
+    mqtt_settings_t *settings;
+    zos_bool_t save = (argc > 1 && strcmp(argv[1], "save") == 0);
+
+    ZOS_NVM_GET_REF(settings);
+    if(argc > 1 && !save)
     {
-        ZOS_LOG("Failed (maximum topic length is %u)", MAX_TOPIC_STRING_SIZE);
         return CMD_BAD_ARGS;
     }
-    else
+    if((mqtt_connection == NULL) || (mqtt_connection->net_init_ok != ZOS_TRUE))
     {
-        strncpy(topic, argv[0], MAX_TOPIC_STRING_SIZE);
-        zn_event_issue(mqtt_app_subscribe, NULL, 0);
+        ZOS_LOG("Not connected, subscribing once connected");
     }
-    return CMD_EXECUTE_AOK;
+    /// the table subscribes now if connected, and again after every reconnect
+    return (subs_add(argv[0], settings->qos, save) == ZOS_SUCCESS) ? CMD_EXECUTE_AOK : CMD_FAILED;
 }
 
 /*************************************************************************************************/
@@ -206,47 +411,218 @@ ZOS_DEFINE_COMMAND(mqtt_unsubscribe)
     {
         ZOS_LOG("Not connected. Connect first using command 'mqtt_connect' - mqtt_connection = %d, net_init_ok = %d", mqtt_connection, mqtt_connection->net_init_ok);
     }
-    else if(strlen(argv[0]) > MAX_TOPIC_STRING_SIZE)
+    /// dropped from the table either way, so it isn't restored on the next connect
+    return (subs_remove(argv[0]) == ZOS_SUCCESS) ? CMD_EXECUTE_AOK : CMD_FAILED;
+}
+
+/*************************************************************************************************/
+ZOS_DEFINE_COMMAND(send_a_command)
+{
+    char *end;
+    unsigned long cmd, arg;
+
+    if (argv[0][0] == '-')
+    {
+        ZOS_LOG("usage: cmd <cmd> <board#> - 0=off, 1=on, 2=toggle, 3=sparkle, 4=dazzle");
+        ZOS_LOG("   or: cmd 6 <ABCD> to set order of boards to ABCD (replace with board numbers");
+        return CMD_EXECUTE_AOK;
+    }
+
+    cmd = strtoul(argv[0], &end, 10);
+    if (*end != '\0' || cmd > 0xFF)
     {
-        ZOS_LOG("Failed (maximum topic length is %u)", MAX_TOPIC_STRING_SIZE);
         return CMD_BAD_ARGS;
     }
-    else
+    // the "order" command takes the order as hex, everything else a board number
+    arg = strtoul(argv[1], &end, (cmd == MESH_CMD_ORDER) ? 16 : 10);
+    if (*end != '\0' || arg > 0xFFFF)
     {
-        strncpy(topic, argv[0], MAX_TOPIC_STRING_SIZE);
-        zn_event_issue(mqtt_app_unsubscribe, NULL, 0);
+        return CMD_BAD_ARGS;
     }
-    return CMD_EXECUTE_AOK;
+    ZOS_LOG("Sending cmd %lu arg %s to BLE client", cmd, argv[1]);
+    return (mesh_send_command(cmd, arg, cmd == MESH_CMD_ORDER) == 0) ? CMD_EXECUTE_AOK : CMD_FAILED;
 }
 
 /*************************************************************************************************/
-ZOS_DEFINE_COMMAND(send_a_command)
+ZOS_DEFINE_COMMAND(send_a_batch)
 {
-    char send_string[10] = "";
-    char cmd;
+    uint8_t *file_data = NULL;
+    uint32_t handle, bytes_read, more;
+    uint8_t probe;
+    int count;
 
-    if (argv[0][0] == '-')
+    if (argv[0][0] == '-' && argv[0][1] != 'f')
     {
-        ZOS_LOG("usage: cmd <cmd> <board#> - 0=off, 1=on, 2=toggle, 3=sparkle, 4=dazzle");
-        ZOS_LOG("   or: cmd 6 <ABCD> to set order of boards to ABCD (replace with board numbers");
+        ZOS_LOG("usage: cmd_batch <cmd>:<arg>,<cmd>:<arg>,... - same <cmd> and <arg> as the cmd command");
+        ZOS_LOG("   or: cmd_batch -f <file> to send the commands listed in a file");
         return CMD_EXECUTE_AOK;
     }
 
-    cmd = argv[0][0];  // grab the 1st character of the cmd
-    if (cmd == '6')
+    mesh_batch_begin();
+    if (argv[0][0] == '-')
     {
-        // This command is the "order" command - we send an "O" not a "B"
-        sprintf(send_string, "C%sO%s", argv[0], argv[1]);
+        if (argc < 2 || zn_file_open(argv[1], &handle) != ZOS_SUCCESS)
+        {
+            ZOS_LOG("Failed to open command file");
+            return CMD_FAILED;
+        }
+        file_data = app_mem_alloc(APP_MEM_SCRATCH, 0, MAX_BATCH_FILE_SIZE);
+        if (file_data == NULL)
+        {
+            zn_file_close(handle);
+            return CMD_FAILED;
+        }
+        if (zn_file_read(handle, file_data, MAX_BATCH_FILE_SIZE, &bytes_read) != ZOS_SUCCESS)
+        {
+            bytes_read = 0;
+        }
+        /// a longer file would be cut off mid entry, send none of it rather than part
+        if (bytes_read == MAX_BATCH_FILE_SIZE && zn_file_read(handle, &probe, 1, &more) == ZOS_SUCCESS && more > 0)
+        {
+            zn_file_close(handle);
+            app_mem_free(APP_MEM_SCRATCH, 0, file_data);
+            ZOS_LOG("Failed (command files are limited to %u bytes)", MAX_BATCH_FILE_SIZE);
+            return CMD_FAILED;
+        }
+        zn_file_close(handle);
+        count = mesh_batch_parse_list((const char*)file_data, bytes_read);
+        app_mem_free(APP_MEM_SCRATCH, 0, file_data);
     }
     else
     {
-        sprintf(send_string, "C%sB%s", argv[0], argv[1]);
+        count = mesh_batch_parse_list(argv[0], strlen(argv[0]));
+    }
+
+    if (count < 0 || mesh_batch_send() != 0)
+    {
+        return CMD_FAILED;
+    }
+    ZOS_LOG("Sent %d commands to BLE client", count);
+    return CMD_EXECUTE_AOK;
+}
+
+/*************************************************************************************************/
+ZOS_DEFINE_COMMAND(mesh_route)
+{
+    unsigned int first, last;
+    char *end;
+    unsigned long bridge;
+    int parsed;
+
+    parsed = sscanf(argv[0], "%u-%u", &first, &last);
+    if (parsed == 1)
+    {
+        last = first;
+    }
+    bridge = strtoul(argv[1], &end, 10);
+    if (parsed < 1 || first > last || last > 0xFF || *end != '\0' || bridge >= MESH_BRIDGE_COUNT)
+    {
+        ZOS_LOG("usage: mesh_route <board>[-<last board>] <bridge> - bridge 0..%u, 0 removes the route", MESH_BRIDGE_COUNT - 1);
+        return CMD_BAD_ARGS;
+    }
+    return (mesh_set_route(first, last, bridge) == ZOS_SUCCESS) ? CMD_EXECUTE_AOK : CMD_FAILED;
+}
+
+/*************************************************************************************************/
+ZOS_DEFINE_COMMAND(agg_threshold)
+{
+    char *end_metric, *end_low, *end_high;
+    unsigned long metric = strtoul(argv[0], &end_metric, 10);
+    long low = strtol(argv[1], &end_low, 10);
+    long high = strtol(argv[2], &end_high, 10);
+
+    if (*end_metric != '\0' || *end_low != '\0' || *end_high != '\0' || metric > 0xFF ||
+        low < -32768 || low > 32767 || high < -32768 || high > 32767)
+    {
+        ZOS_LOG("usage: agg_threshold <metric> <low> <high> - readings outside low..high are uploaded raw,");
+        ZOS_LOG("       low above high clears the metric's thresholds");
+        return CMD_BAD_ARGS;
+    }
+    return (telemetry_set_threshold(metric, low, high) == ZOS_SUCCESS) ? CMD_EXECUTE_AOK : CMD_FAILED;
+}
+
+/*************************************************************************************************/
+ZOS_DEFINE_COMMAND(gw_add)
+{
+    gateway_identity_config_t config;
+    unsigned int first, last;
+    int parsed;
+
+    memset(&config, 0, sizeof(config));
+    parsed = sscanf(argv[0], "%u-%u", &first, &last);
+    if (parsed == 1)
+    {
+        last = first;
+    }
+    if (parsed < 1 || first > last || last > 0xFF)
+    {
+        ZOS_LOG("usage: gw_add <board>[-<last board>] <device> <token_expiry> <token_sig>");
+        return CMD_BAD_ARGS;
+    }
+    if(strlen(argv[1]) >= sizeof(config.device) || strlen(argv[2]) >= sizeof(config.token_expiry) ||
+       strlen(argv[3]) >= sizeof(config.token_sig))
+    {
+        ZOS_LOG("Failed (device, token_expiry or token_sig too long)");
+        return CMD_BAD_ARGS;
+    }
+    config.first_board = first;
+    config.last_board = last;
+    strcpy(config.device, argv[1]);
+    strcpy(config.token_expiry, argv[2]);
+    strcpy(config.token_sig, argv[3]);
+    return (gateway_add_identity(&config) == ZOS_SUCCESS) ? CMD_EXECUTE_AOK : CMD_FAILED;
+}
+
+/*************************************************************************************************/
+ZOS_DEFINE_COMMAND(gw_remove)
+{
+    return (gateway_remove_identity(argv[0]) == ZOS_SUCCESS) ? CMD_EXECUTE_AOK : CMD_FAILED;
+}
+
+/*************************************************************************************************/
+ZOS_DEFINE_COMMAND(trace_start)
+{
+    if(strlen(argv[0]) >= TRACE_MAX_FILENAME_SIZE)
+    {
+        ZOS_LOG("Failed (maximum file name length is %u)", TRACE_MAX_FILENAME_SIZE - 1);
+        return CMD_BAD_ARGS;
     }
-    ZOS_LOG("Sending %s to BLE client", send_string);
-    parse_received_request(send_string, strlen(send_string));
+    return (trace_capture_start(argv[0]) == ZOS_SUCCESS) ? CMD_EXECUTE_AOK : CMD_FAILED;
+}
+
+/*************************************************************************************************/
+ZOS_DEFINE_COMMAND(trace_stop)
+{
+    trace_capture_stop();
+    trace_replay_stop();
+    return CMD_EXECUTE_AOK;
+}
+
+/*************************************************************************************************/
+ZOS_DEFINE_COMMAND(mqtt_commit)
+{
+    return (settings_commit() == ZOS_SUCCESS) ? CMD_EXECUTE_AOK : CMD_FAILED;
+}
+
+/*************************************************************************************************/
+ZOS_DEFINE_COMMAND(mqtt_abort)
+{
+    settings_abort();
     return CMD_EXECUTE_AOK;
 }
 
+/*************************************************************************************************/
+ZOS_DEFINE_COMMAND(trace_replay)
+{
+    uint32_t speedup = 1;
+
+    if(argc > 1)
+    {
+        ZOS_CMD_PARSE_INT_ARG_WITH_VAR(uint32_t, speedup, argv[1], 0, 1000);
+    }
+    return (trace_replay_start(argv[0], speedup) == ZOS_SUCCESS) ? CMD_EXECUTE_AOK : CMD_FAILED;
+}
+
 
 /*************************************************************************************************
  * Getters
@@ -277,6 +653,277 @@ ZOS_DEFINE_GETTER(mqtt_keepalive)
     return CMD_SUCCESS;
 }
 
+/*************************************************************************************************/
+ZOS_DEFINE_GETTER(mqtt_keepalive_min)
+{
+    mqtt_settings_t *settings;
+    ZOS_NVM_GET_REF(settings);
+    zn_cmd_format_response(CMD_SUCCESS, "%u", settings->keepalive_min);
+    return CMD_SUCCESS;
+}
+
+/*************************************************************************************************/
+ZOS_DEFINE_GETTER(mqtt_keepalive_stats)
+{
+    char response[170 + KEEPALIVE_HISTORY * 16];
+    keepalive_stats_t stats;
+    uint32_t length;
+    uint8_t i;
+
+    keepalive_get_stats(&stats);
+    length = snprintf(response, sizeof(response),
+                      "interval=%us ceiling=%us survived=%us connect=%us probes=%u missed=%u reconnects=%u\r\n"
+                      "rtt last=%ums min=%ums avg=%ums max=%ums\r\nhistory(interval:rtt)=",
+                      stats.interval_s, stats.ceiling_s, stats.survived_s, stats.connect_s, stats.probes, stats.missed,
+                      stats.reconnects, stats.rtt_last_ms, stats.rtt_min_ms, stats.rtt_avg_ms, stats.rtt_max_ms);
+    for (i = 0; i < stats.history_count && length < sizeof(response); i++)
+    {
+        /// a missed probe shows as rtt '-'
+        if (stats.history[i].rtt_ms == 0)
+        {
+            length += snprintf(&response[length], sizeof(response) - length, " %u:-", stats.history[i].interval_s);
+        }
+        else
+        {
+            length += snprintf(&response[length], sizeof(response) - length, " %u:%u",
+                               stats.history[i].interval_s, stats.history[i].rtt_ms);
+        }
+    }
+    zn_cmd_format_response(CMD_SUCCESS, "%s", response);
+    return CMD_SUCCESS;
+}
+
+/*************************************************************************************************/
+ZOS_DEFINE_GETTER(mqtt_latency_interval)
+{
+    mqtt_settings_t *settings;
+    ZOS_NVM_GET_REF(settings);
+    zn_cmd_format_response(CMD_SUCCESS, "%u", settings->latency_interval);
+    return CMD_SUCCESS;
+}
+
+/*************************************************************************************************/
+ZOS_DEFINE_GETTER(mqtt_latency)
+{
+    char summary[LATENCY_SUMMARY_SIZE];
+
+    if(latency_format_summary(summary, sizeof(summary)) == 0)
+    {
+        return CMD_FAILED;
+    }
+    zn_cmd_format_response(CMD_SUCCESS, "%s", summary);
+    return CMD_SUCCESS;
+}
+
+/*************************************************************************************************/
+ZOS_DEFINE_GETTER(mqtt_sched)
+{
+    char response[SCHED_MAX_HANDLERS * 80];
+    sched_stats_t stats;
+    uint32_t length = 0;
+    uint8_t i;
+
+    for (i = 0; sched_get_stats(i, &stats) == ZOS_SUCCESS && length < sizeof(response); i++)
+    {
+        length += snprintf(&response[length], sizeof(response) - length,
+                           "%s%s: runs=%u avg=%ums max=%ums late=%u max_late=%ums stack>=%u", (i > 0) ? "\r\n" : "",
+                           stats.name, stats.runs, (stats.runs > 0) ? stats.total_ms / stats.runs : 0,
+                           stats.max_ms, stats.late, stats.max_late_ms, stats.max_stack);
+    }
+    zn_cmd_format_response(CMD_SUCCESS, "%s", (length > 0) ? response : "no handlers run yet");
+    return CMD_SUCCESS;
+}
+
+/*************************************************************************************************/
+ZOS_DEFINE_GETTER(mqtt_memory)
+{
+    static const char * const tag_names[APP_MEM_TAG_COUNT] = { "mqtt_connection", "gateway_connections", "scratch", "gather", "compress" };
+    char response[350];
+    app_mem_usage_t usage;
+    uint32_t length, peak_tx, peak_rx, buffer_size = 0;
+    uint8_t tag;
+
+    zn_settings_get_uint32("network.buffer.size", &buffer_size);
+    app_mem_get_network_peaks(&peak_tx, &peak_rx);
+    app_mem_get_usage(APP_MEM_TAG_COUNT, &usage);
+    length = snprintf(response, sizeof(response), "%s arena=%u total: now=%u peak=%u failed=%u",
+                      (app_mem_arena_size() > 0) ? "static" : "heap", app_mem_arena_size(),
+                      usage.current, usage.peak, usage.failures);
+    for (tag = 0; tag < APP_MEM_TAG_COUNT && length < sizeof(response); tag++)
+    {
+        app_mem_get_usage(tag, &usage);
+        length += snprintf(&response[length], sizeof(response) - length, "\r\n%s: now=%u peak=%u failed=%u",
+                           tag_names[tag], usage.current, usage.peak, usage.failures);
+    }
+    if (length < sizeof(response))
+    {
+        snprintf(&response[length], sizeof(response) - length,
+                 "\r\nnetwork buffer %u: peak tx=%u rx=%u (sampled stack per handler: get mqtt.sched)",
+                 buffer_size, peak_tx, peak_rx);
+    }
+    zn_cmd_format_response(CMD_SUCCESS, "%s", response);
+    return CMD_SUCCESS;
+}
+
+/*************************************************************************************************/
+ZOS_DEFINE_GETTER(mqtt_compress_threshold)
+{
+    mqtt_settings_t *settings;
+    ZOS_NVM_GET_REF(settings);
+    zn_cmd_format_response(CMD_SUCCESS, "%u", settings->compress_threshold);
+    return CMD_SUCCESS;
+}
+
+/*************************************************************************************************/
+ZOS_DEFINE_GETTER(mqtt_agg_window)
+{
+    mqtt_settings_t *settings;
+    ZOS_NVM_GET_REF(settings);
+    zn_cmd_format_response(CMD_SUCCESS, "%u", settings->agg_window);
+    return CMD_SUCCESS;
+}
+
+/*************************************************************************************************/
+ZOS_DEFINE_GETTER(mqtt_agg)
+{
+    telemetry_stats_t stats;
+
+    telemetry_get_stats(&stats);
+    zn_cmd_format_response(CMD_SUCCESS, "window: readings=%u series=%u dropped=%u\r\n"
+                           "summaries=%u failed=%u passed_through=%u pass_dropped=%u",
+                           stats.window_readings, stats.series, stats.window_dropped, stats.summaries,
+                           stats.summary_failures, stats.passed_through, stats.pass_dropped);
+    return CMD_SUCCESS;
+}
+
+/*************************************************************************************************/
+ZOS_DEFINE_GETTER(mqtt_power_save)
+{
+    mqtt_settings_t *settings;
+    ZOS_NVM_GET_REF(settings);
+    zn_cmd_format_response(CMD_SUCCESS, "%u", settings->power_save);
+    return CMD_SUCCESS;
+}
+
+/*************************************************************************************************/
+ZOS_DEFINE_GETTER(mqtt_power)
+{
+    power_stats_t stats;
+    uint32_t elapsed_min;
+
+    power_get_stats(&stats);
+    elapsed_min = stats.elapsed_ms / 60000;
+    zn_cmd_format_response(CMD_SUCCESS, "power_save=%u wakeups=%u (%u/min) idle=%ums (%u%%) busy=%ums\r\n"
+                           "next: %s in %ums",
+                           stats.enabled, stats.wakeups, (elapsed_min > 0) ? stats.wakeups / elapsed_min : stats.wakeups,
+                           stats.idle_ms,
+                           (stats.elapsed_ms > 0) ? (uint32_t)((uint64_t)stats.idle_ms * 100 / stats.elapsed_ms) : 0,
+                           stats.busy_ms, (stats.next_name != NULL) ? stats.next_name : "nothing", stats.next_ms);
+    return CMD_SUCCESS;
+}
+
+/*************************************************************************************************/
+ZOS_DEFINE_GETTER(mqtt_compression)
+{
+    publish_compress_stats_t stats;
+
+    publish_get_compress_stats(&stats);
+    zn_cmd_format_response(CMD_SUCCESS, "messages=%u skipped=%u raw=%u sent=%u ratio=%u%%",
+                           stats.messages, stats.skipped, stats.raw_bytes, stats.sent_bytes,
+                           (stats.raw_bytes > 0) ? (uint32_t)((uint64_t)stats.sent_bytes * 100 / stats.raw_bytes) : 100);
+    return CMD_SUCCESS;
+}
+
+/*************************************************************************************************/
+ZOS_DEFINE_GETTER(mqtt_pending)
+{
+    mqtt_settings_t *settings;
+    char response[200];
+    uint32_t length = 0;
+    uint8_t i;
+
+    ZOS_NVM_GET_REF(settings);
+    for (i = 0; settings_staged && i < sizeof(setting_fields) / sizeof(setting_fields[0]); i++)
+    {
+        if (settings_field_changed(&setting_fields[i], settings) && length < sizeof(response))
+        {
+            length += snprintf(&response[length], sizeof(response) - length, "%s%s",
+                               (length > 0) ? " " : "", setting_fields[i].name);
+        }
+    }
+    zn_cmd_format_response(CMD_SUCCESS, "%s", (length > 0) ? response : "none");
+    return CMD_SUCCESS;
+}
+
+/*************************************************************************************************/
+ZOS_DEFINE_GETTER(mqtt_subscriptions)
+{
+    static const char * const status_names[] = { "idle", "pending", "acked", "failed" };
+    char response[SUBS_MAX_ENTRIES * (MAX_TOPIC_STRING_SIZE + 50) + 40];
+    subs_entry_info_t info;
+    uint32_t length;
+    uint8_t i;
+
+    length = snprintf(response, sizeof(response), "restore pipelined, one SUBSCRIBE per topic, all acked in %ums",
+                      subs_ready_time());
+    for (i = 0; subs_get_entry(i, &info) == ZOS_SUCCESS && length < sizeof(response); i++)
+    {
+        length += snprintf(&response[length], sizeof(response) - length, "\r\n%s qos=%u %s%s rtt=%ums failed=%u",
+                           info.topic, info.qos, status_names[info.status], info.saved ? " saved" : "",
+                           info.rtt_ms, info.failures);
+    }
+    zn_cmd_format_response(CMD_SUCCESS, "%s", response);
+    return CMD_SUCCESS;
+}
+
+/*************************************************************************************************/
+ZOS_DEFINE_GETTER(mqtt_mesh)
+{
+    char response[(MESH_BRIDGE_COUNT + MESH_MAX_ROUTES) * 60];
+    mesh_bridge_stats_t stats;
+    uint8_t i, first, last, bridge;
+    uint32_t length = 0;
+
+    for (i = 0; mesh_get_bridge_stats(i, &stats) == ZOS_SUCCESS && length < sizeof(response); i++)
+    {
+        length += snprintf(&response[length], sizeof(response) - length, "%sbridge %u: uart=%u tx=%u frames/%u bytes rx=%u frames/%u bytes errors=%u",
+                           (length > 0) ? "\r\n" : "", i, stats.uart, stats.tx_frames, stats.tx_bytes, stats.rx_frames,
+                           stats.rx_bytes, stats.rx_errors);
+    }
+    for (i = 0; mesh_get_route(i, &first, &last, &bridge) == ZOS_SUCCESS && length < sizeof(response); i++)
+    {
+        length += snprintf(&response[length], sizeof(response) - length, "\r\nboards %u-%u: bridge %u",
+                           first, last, bridge);
+    }
+    zn_cmd_format_response(CMD_SUCCESS, "%s", response);
+    return CMD_SUCCESS;
+}
+
+/*************************************************************************************************/
+ZOS_DEFINE_GETTER(mqtt_gateway)
+{
+    char response[(GATEWAY_MAX_IDENTITIES + 1) * 100];
+    gateway_identity_stats_t stats;
+    uint32_t length;
+    uint8_t i;
+
+    length = snprintf(response, sizeof(response), "connections=%u/%u memory_per_identity=%u+%u(tls)",
+                      gateway_connection_count(), GATEWAY_MAX_IDENTITIES, gateway_identity_memory(),
+                      GATEWAY_TLS_SESSION_BYTES);
+    for (i = 0; i < GATEWAY_MAX_IDENTITIES && length < sizeof(response); i++)
+    {
+        if (gateway_get_stats(i, &stats) == ZOS_SUCCESS)
+        {
+            length += snprintf(&response[length], sizeof(response) - length,
+                               "\r\n%s: boards=%u-%u %s connects=%u c2d=%u d2c=%u", stats.device,
+                               stats.first_board, stats.last_board, stats.connected ? "up" : "down",
+                               stats.connects, stats.c2d_messages, stats.d2c_messages);
+        }
+    }
+    zn_cmd_format_response(CMD_SUCCESS, "%s", response);
+    return CMD_SUCCESS;
+}
+
 /*************************************************************************************************/
 ZOS_DEFINE_GETTER(mqtt_qos)
 {
@@ -329,16 +976,15 @@ ZOS_DEFINE_GETTER(mqtt_device)
  *************************************************************************************************/
 ZOS_DEFINE_SETTER(mqtt_host)
 {
-    mqtt_settings_t *settings;
+    mqtt_settings_t *settings = settings_stage();
 
-    if(strlen(argv[1]) > sizeof(settings->host))
+    if(strlen(argv[1]) >= sizeof(settings->host))
     {
-        ZOS_LOG("Failed (maximum length is %u)", sizeof(settings->host));
+        ZOS_LOG("Failed (maximum length is %u)", sizeof(settings->host) - 1);
         return CMD_BAD_ARGS;
     }
     else
     {
-        ZOS_NVM_GET_REF(settings);
         strcpy((char*)settings->host, argv[1]);
         return CMD_SET_OK;
     }
@@ -347,8 +993,7 @@ ZOS_DEFINE_SETTER(mqtt_host)
 /*************************************************************************************************/
 ZOS_DEFINE_SETTER(mqtt_port)
 {
-    mqtt_settings_t *settings;
-    ZOS_NVM_GET_REF(settings);
+    mqtt_settings_t *settings = settings_stage();
     ZOS_CMD_PARSE_INT_ARG_WITH_VAR(uint16_t, settings->port, argv[1], 0, 65535);
     return CMD_SET_OK;
 }
@@ -356,17 +1001,55 @@ ZOS_DEFINE_SETTER(mqtt_port)
 /*************************************************************************************************/
 ZOS_DEFINE_SETTER(mqtt_keepalive)
 {
-    mqtt_settings_t *settings;
-    ZOS_NVM_GET_REF(settings);
+    mqtt_settings_t *settings = settings_stage();
     ZOS_CMD_PARSE_INT_ARG_WITH_VAR(uint16_t, settings->keepalive, argv[1], 0, 65535);
     return CMD_SET_OK;
 }
 
+/*************************************************************************************************/
+ZOS_DEFINE_SETTER(mqtt_keepalive_min)
+{
+    mqtt_settings_t *settings = settings_stage();
+    ZOS_CMD_PARSE_INT_ARG_WITH_VAR(uint16_t, settings->keepalive_min, argv[1], 0, 65535);
+    return CMD_SET_OK;
+}
+
+/*************************************************************************************************/
+ZOS_DEFINE_SETTER(mqtt_latency_interval)
+{
+    mqtt_settings_t *settings = settings_stage();
+    ZOS_CMD_PARSE_INT_ARG_WITH_VAR(uint16_t, settings->latency_interval, argv[1], 0, 65535);
+    return CMD_SET_OK;
+}
+
+/*************************************************************************************************/
+ZOS_DEFINE_SETTER(mqtt_compress_threshold)
+{
+    mqtt_settings_t *settings = settings_stage();
+    ZOS_CMD_PARSE_INT_ARG_WITH_VAR(uint16_t, settings->compress_threshold, argv[1], 0, 65535);
+    return CMD_SET_OK;
+}
+
+/*************************************************************************************************/
+ZOS_DEFINE_SETTER(mqtt_agg_window)
+{
+    mqtt_settings_t *settings = settings_stage();
+    ZOS_CMD_PARSE_INT_ARG_WITH_VAR(uint16_t, settings->agg_window, argv[1], 0, 65535);
+    return CMD_SET_OK;
+}
+
+/*************************************************************************************************/
+ZOS_DEFINE_SETTER(mqtt_power_save)
+{
+    mqtt_settings_t *settings = settings_stage();
+    ZOS_CMD_PARSE_INT_ARG_WITH_VAR(uint16_t, settings->power_save, argv[1], 0, 1);
+    return CMD_SET_OK;
+}
+
 /*************************************************************************************************/
 ZOS_DEFINE_SETTER(mqtt_qos)
 {
-    mqtt_settings_t *settings;
-    ZOS_NVM_GET_REF(settings);
+    mqtt_settings_t *settings = settings_stage();
     ZOS_CMD_PARSE_INT_ARG_WITH_VAR(uint16_t, settings->qos, argv[1], 0, 2);
     return CMD_SET_OK;
 }
@@ -374,8 +1057,7 @@ ZOS_DEFINE_SETTER(mqtt_qos)
 /*************************************************************************************************/
 ZOS_DEFINE_SETTER(mqtt_security)
 {
-    mqtt_settings_t *settings;
-    ZOS_NVM_GET_REF(settings);
+    mqtt_settings_t *settings = settings_stage();
     ZOS_CMD_PARSE_INT_ARG_WITH_VAR(uint16_t, settings->security, argv[1], 0, 1);
     return CMD_SET_OK;
 }
@@ -383,16 +1065,15 @@ ZOS_DEFINE_SETTER(mqtt_security)
 /*************************************************************************************************/
 ZOS_DEFINE_SETTER(mqtt_token_sig)
 {
-    mqtt_settings_t *settings;
+    mqtt_settings_t *settings = settings_stage();
 
-    if(strlen(argv[1]) > sizeof(settings->token_sig))
+    if(strlen(argv[1]) >= sizeof(settings->token_sig))
     {
-        ZOS_LOG("Failed (maximum length is %u)", sizeof(settings->token_sig));
+        ZOS_LOG("Failed (maximum length is %u)", sizeof(settings->token_sig) - 1);
         return CMD_BAD_ARGS;
     }
     else
     {
-        ZOS_NVM_GET_REF(settings);
         strcpy((char*)settings->token_sig, argv[1]);
         return CMD_SET_OK;
     }
@@ -401,16 +1082,15 @@ ZOS_DEFINE_SETTER(mqtt_token_sig)
 /*************************************************************************************************/
 ZOS_DEFINE_SETTER(mqtt_token_expiry)
 {
-    mqtt_settings_t *settings;
+    mqtt_settings_t *settings = settings_stage();
 
-    if(strlen(argv[1]) > sizeof(settings->token_expiry))
+    if(strlen(argv[1]) >= sizeof(settings->token_expiry))
     {
-        ZOS_LOG("Failed (maximum length is %u)", sizeof(settings->token_expiry));
+        ZOS_LOG("Failed (maximum length is %u)", sizeof(settings->token_expiry) - 1);
         return CMD_BAD_ARGS;
     }
     else
     {
-        ZOS_NVM_GET_REF(settings);
         strcpy((char*)settings->token_expiry, argv[1]);
         return CMD_SET_OK;
     }
@@ -419,16 +1099,15 @@ ZOS_DEFINE_SETTER(mqtt_token_expiry)
 /*************************************************************************************************/
 ZOS_DEFINE_SETTER(mqtt_device)
 {
-    mqtt_settings_t *settings;
+    mqtt_settings_t *settings = settings_stage();
 
-    if(strlen(argv[1]) > sizeof(settings->device))
+    if(strlen(argv[1]) >= sizeof(settings->device))
     {
-        ZOS_LOG("Failed (maximum length is %u)", sizeof(settings->device));
+        ZOS_LOG("Failed (maximum length is %u)", sizeof(settings->device) - 1);
         return CMD_BAD_ARGS;
     }
     else
     {
-        ZOS_NVM_GET_REF(settings);
         strcpy((char*)settings->device, argv[1]);
         return CMD_SET_OK;
     }
@@ -12,7 +12,7 @@
 #include "mqtt_api.h"
 
 
-#define SETTINGS_MAGIC_NUMBER       0xD5A8A3AAUL
+#define SETTINGS_MAGIC_NUMBER       0xD5A8A3AFUL
 #define MQTT_HOST                   "ambient-hub.azure-devices.net"
 #define MQTT_DEVICE_ID              "007"
 #define MQTT_TOKEN_EXPIRY           "1540935986"
@@ -21,16 +21,29 @@
 #define MQTT_QOS                    MQTT_QOS_DELIVER_AT_MOST_ONCE
 #define MQTT_SECURITY               ZOS_TRUE
 #define MQTT_KEEPALIVE              120
+#define MQTT_KEEPALIVE_MIN          30  /// shortest idle time between liveness probes
+#define LATENCY_INTERVAL            300 /// seconds between latency summaries, 0 = off
+#define COMPRESS_THRESHOLD          0   /// compress telemetry of at least this many bytes, 0 = off
+#define AGG_WINDOW                  60  /// seconds per sensor summary, 0 = readings aren't uploaded
+#define POWER_SAVE                  ZOS_FALSE /// back the mesh UART polls off while the bridges are quiet
 
 #define MAX_TOPIC_STRING_SIZE       100
 #define MAX_MESSAGE_STRING_SIZE     100
+/// binary publishes through publish_buffer(), must fit network.buffer.size with the topic and TLS overhead
+#define MAX_PUBLISH_PAYLOAD_SIZE    (16*1024)
+/// keep in step with network.buffer.size in resources/settings.ini
+#define NETWORK_BUFFER_SIZE         17408
 #define MAX_USERNAME_STRING_SIZE    100
 #define MAX_PASSWORD_STRING_SIZE    200
 
+#define MAX_BATCH_FILE_SIZE         4096
+
 #define MAX_TOKEN_SIG_SIZE          60
 #define MAX_DEVICE_STRING_SIZE      50
 #define MAX_HOST_STRING_SIZE        40
 #define MAX_TOKEN_EXPIRY_SIZE       20
+/// anything before 2017-01-01 means SNTP hasn't set the clock yet
+#define MIN_SYNCED_UTC_MS           1483228800000ULL
 
 
 extern mqtt_connection_t* mqtt_connection;
@@ -46,8 +59,13 @@ typedef struct
     uint8_t token_sig[MAX_TOKEN_SIG_SIZE];
     uint16_t port;
     uint16_t keepalive;
+    uint16_t keepalive_min;
     uint8_t qos;
     zos_bool_t security;
+    uint16_t latency_interval;
+    uint16_t compress_threshold;
+    uint16_t agg_window;
+    zos_bool_t power_save;
 } mqtt_settings_t;
 
 void commands_init(void);
@@ -55,6 +73,5 @@ void commands_deinit(void);
 
 void mqtt_app_connect( void *arg );
 void mqtt_app_disconnect( void *arg );
-void mqtt_app_subscribe( void *arg );
-void mqtt_app_unsubscribe( void *arg );
 void mqtt_app_publish( void *arg );
+zos_result_t mqtt_app_inject_event( mqtt_event_info_t *event );
@@ -0,0 +1,382 @@
+/** @file This file contains the code for per-board Azure identities
+ *
+ * The MQTT callback doesn't say which connection an event belongs to, so
+ * every identity slot has its own small callback that forwards the event
+ * with the slot index.
+ *
+ * Copyright Ambient Sensors 2017
+ */
+
+#include "zos.h"
+#include "common.h"
+#include "mesh_control.h"
+#include "publish.h"
+#include "scheduler.h"
+#include "gateway.h"
+#include "app_memory.h"
+
+typedef struct
+{
+    zos_bool_t in_use;
+    gateway_identity_config_t config;
+    mqtt_connection_t *connection;
+    zos_bool_t connected;
+    uint32_t connects;
+    uint32_t c2d_messages;
+    uint32_t d2c_messages;
+} gateway_identity_t;
+
+static gateway_identity_t identities[GATEWAY_MAX_IDENTITIES];
+/// connects are serialized by the scheduler, so the slots can share these
+static uint8_t gateway_username[MAX_USERNAME_STRING_SIZE+1];
+static uint8_t gateway_password[MAX_PASSWORD_STRING_SIZE+1];
+static char gateway_topic[MAX_TOPIC_STRING_SIZE+1];
+
+static zos_result_t gateway_event_cb_0(mqtt_event_info_t *event);
+static zos_result_t gateway_event_cb_1(mqtt_event_info_t *event);
+
+/// one per identity slot, add one when GATEWAY_MAX_IDENTITIES grows
+static const mqtt_callback_t gateway_callbacks[GATEWAY_MAX_IDENTITIES] =
+{
+    gateway_event_cb_0,
+    gateway_event_cb_1,
+};
+
+
+static zos_result_t gateway_save(void)
+{
+    gateway_identity_config_t configs[GATEWAY_MAX_IDENTITIES];
+    zos_file_t file_info;
+    uint32_t handle;
+    zos_result_t result;
+    uint8_t i;
+
+    memset(configs, 0, sizeof(configs));
+    for (i = 0; i < GATEWAY_MAX_IDENTITIES; i++)
+    {
+        if (identities[i].in_use)
+        {
+            configs[i] = identities[i].config;
+        }
+    }
+
+    memset(&file_info, 0, sizeof(file_info));
+    strcpy(file_info.name, GATEWAY_FILE_NAME);
+    file_info.size = sizeof(configs);
+    file_info.type = FILE_TYPE_MISC_FIX_LEN;
+
+    zn_file_delete(GATEWAY_FILE_NAME);
+    if (zn_file_create(&file_info, &handle) != ZOS_SUCCESS)
+    {
+        ZOS_LOG("ERROR, failed to create %s", GATEWAY_FILE_NAME);
+        return ZOS_ERROR;
+    }
+    result = zn_file_write(handle, configs, sizeof(configs));
+    zn_file_close(handle);
+    return result;
+}
+
+static void gateway_connect_handler(void *arg)
+{
+    gateway_identity_t *identity = arg;
+    mqtt_settings_t *settings;
+    mqtt_pkt_connect_t conninfo;
+    uint8_t index = identity - identities;
+
+    if (!identity->in_use)
+    {
+        return;
+    }
+    ZOS_NVM_GET_REF(settings);
+
+    if (identity->connection == NULL)
+    {
+        identity->connection = app_mem_alloc(APP_MEM_GATEWAY_CONNECTION, index, sizeof(mqtt_connection_t));
+        if (identity->connection == NULL)
+        {
+            ZOS_LOG("Failed to allocate MQTT object for %s", identity->config.device);
+            return;
+        }
+        if (mqtt_init(identity->connection) != ZOS_SUCCESS)
+        {
+            ZOS_LOG("Error initializing MQTT object for %s", identity->config.device);
+            app_mem_free(APP_MEM_GATEWAY_CONNECTION, index, identity->connection);
+            identity->connection = NULL;
+            return;
+        }
+    }
+
+    snprintf((char*)gateway_username, sizeof(gateway_username), "%s/%s/api-version=2016-11-14",
+             settings->host, identity->config.device);
+    snprintf((char*)gateway_password, sizeof(gateway_password),
+             "SharedAccessSignature sr=%s%%2Fdevices%%2F%s&sig=%s&se=%s", settings->host,
+             identity->config.device, identity->config.token_sig, identity->config.token_expiry);
+
+    ZOS_LOG("Opening connection for %s (boards %u-%u)", identity->config.device,
+            identity->config.first_board, identity->config.last_board);
+    if (mqtt_open(identity->connection, (const char*)settings->host, settings->port, ZOS_WLAN,
+                  gateway_callbacks[index], settings->security) != ZOS_SUCCESS)
+    {
+        ZOS_LOG("Error opening connection for %s", identity->config.device);
+        return;
+    }
+
+    memset(&conninfo, 0, sizeof(conninfo));
+    conninfo.mqtt_version = MQTT_PROTOCOL_VER4;
+    conninfo.clean_session = 1;
+    conninfo.client_id = (uint8_t*)identity->config.device;
+    conninfo.keep_alive = settings->keepalive;
+    conninfo.username = gateway_username;
+    conninfo.password = gateway_password;
+    if (mqtt_connect(identity->connection, &conninfo) != ZOS_SUCCESS)
+    {
+        ZOS_LOG("Error connecting %s", identity->config.device);
+        return;
+    }
+    identity->connects += 1;
+
+    snprintf(gateway_topic, sizeof(gateway_topic), "devices/%s/messages/devicebound/#", identity->config.device);
+    if (mqtt_subscribe(identity->connection, (uint8_t*)gateway_topic, settings->qos) == 0)
+    {
+        ZOS_LOG("Error subscribing %s", identity->config.device);
+    }
+}
+
+static void gateway_disconnect(gateway_identity_t *identity)
+{
+    if (identity->connection == NULL)
+    {
+        return;
+    }
+    mqtt_disconnect(identity->connection);
+    publish_abort_all(identity->connection);
+    mqtt_deinit(identity->connection);
+    app_mem_free(APP_MEM_GATEWAY_CONNECTION, identity - identities, identity->connection);
+    identity->connection = NULL;
+    identity->connected = ZOS_FALSE;
+}
+
+static zos_result_t gateway_handle_event(uint8_t index, mqtt_event_info_t *event)
+{
+    gateway_identity_t *identity = &identities[index];
+    sched_frame_t frame;
+
+    sched_account_begin(&frame);
+
+    switch (event->type)
+    {
+        case MQTT_EVENT_TYPE_CONNECTED:
+            ZOS_LOG("%s CONNECTED", identity->config.device);
+            identity->connected = ZOS_TRUE;
+            break;
+        case MQTT_EVENT_TYPE_DISCONNECTED:
+            ZOS_LOG("%s DISCONNECTED", identity->config.device);
+            identity->connected = ZOS_FALSE;
+            publish_abort_all(identity->connection);
+            if (identity->in_use &&
+                SCHED_ISSUE_RETRY(gateway_connect_handler, identity, SCHED_PRIORITY_LOW, SCHED_NO_DEADLINE) != ZOS_SUCCESS)
+            {
+                ZOS_LOG("ERROR, couldn't schedule the reconnect of %s", identity->config.device);
+            }
+            break;
+        case MQTT_EVENT_TYPE_PUBLISHED:
+            publish_acknowledged(identity->connection, event->data.msgid);
+            break;
+        case MQTT_EVENT_TYPE_PUBLISH_MSG_RECEIVED:
+            app_mem_network_packet(ZOS_FALSE, event->data.pub_recvd.topic_len + event->data.pub_recvd.data_len);
+            /// the message addresses boards the same way as on the module's own identity, but only its own
+            ZOS_LOG("%s MESSAGE RECEIVED: %.*s", identity->config.device,
+                    event->data.pub_recvd.data_len, event->data.pub_recvd.data);
+            identity->c2d_messages += 1;
+            parse_received_request_for((char*)event->data.pub_recvd.data, event->data.pub_recvd.data_len,
+                                       identity->config.first_board, identity->config.last_board);
+            break;
+        default:
+            break;
+    }
+    sched_account_end(&frame, "gateway_handle_event", 0);
+    return ZOS_SUCCESS;
+}
+
+static zos_result_t gateway_event_cb_0(mqtt_event_info_t *event)
+{
+    return gateway_handle_event(0, event);
+}
+
+static zos_result_t gateway_event_cb_1(mqtt_event_info_t *event)
+{
+    return gateway_handle_event(1, event);
+}
+
+void gateway_init(void)
+{
+    gateway_identity_config_t configs[GATEWAY_MAX_IDENTITIES];
+    uint32_t handle, bytes_read;
+    uint8_t i;
+
+    if (zn_file_open(GATEWAY_FILE_NAME, &handle) != ZOS_SUCCESS)
+    {
+        return; /// not a gateway
+    }
+    if (zn_file_read(handle, configs, sizeof(configs), &bytes_read) != ZOS_SUCCESS)
+    {
+        bytes_read = 0;
+    }
+    zn_file_close(handle);
+
+    for (i = 0; i < GATEWAY_MAX_IDENTITIES && (i + 1) * sizeof(configs[0]) <= bytes_read; i++)
+    {
+        if (configs[i].device[0] != '\0')
+        {
+            configs[i].device[sizeof(configs[i].device) - 1] = '\0';
+            configs[i].token_expiry[sizeof(configs[i].token_expiry) - 1] = '\0';
+            configs[i].token_sig[sizeof(configs[i].token_sig) - 1] = '\0';
+            identities[i].in_use = ZOS_TRUE;
+            identities[i].config = configs[i];
+            SCHED_ISSUE_RETRY(gateway_connect_handler, &identities[i], SCHED_PRIORITY_LOW, SCHED_NO_DEADLINE);
+        }
+    }
+}
+
+zos_result_t gateway_add_identity(const gateway_identity_config_t *config)
+{
+    gateway_identity_t *identity = NULL;
+    gateway_identity_t *replaced = NULL;
+    uint8_t i;
+
+    for (i = 0; i < GATEWAY_MAX_IDENTITIES; i++)
+    {
+        if (identities[i].in_use && strcmp(identities[i].config.device, config->device) == 0)
+        {
+            replaced = &identities[i];
+        }
+        else if (identity == NULL && !identities[i].in_use)
+        {
+            identity = &identities[i];
+        }
+    }
+    if (replaced != NULL)
+    {
+        identity = replaced;
+    }
+    if (identity == NULL)
+    {
+        ZOS_LOG("Failed (all %u identities in use)", GATEWAY_MAX_IDENTITIES);
+        return ZOS_ERROR;
+    }
+    /// validated before the identity it replaces is touched, a refused update leaves that one running
+    for (i = 0; i < GATEWAY_MAX_IDENTITIES; i++)
+    {
+        if (identities[i].in_use && &identities[i] != identity &&
+            config->first_board <= identities[i].config.last_board &&
+            config->last_board >= identities[i].config.first_board)
+        {
+            ZOS_LOG("Failed (boards overlap with %s)", identities[i].config.device);
+            return ZOS_ERROR;
+        }
+    }
+    if (replaced != NULL)
+    {
+        replaced->in_use = ZOS_FALSE; /// so the disconnect doesn't schedule a reconnect
+        gateway_disconnect(replaced);
+    }
+
+    memset(identity, 0, sizeof(*identity));
+    identity->in_use = ZOS_TRUE;
+    identity->config = *config;
+    gateway_save();
+    return SCHED_ISSUE(gateway_connect_handler, identity, SCHED_PRIORITY_LOW, SCHED_NO_DEADLINE);
+}
+
+zos_result_t gateway_remove_identity(const char *device)
+{
+    uint8_t i;
+
+    for (i = 0; i < GATEWAY_MAX_IDENTITIES; i++)
+    {
+        if (identities[i].in_use && strcmp(identities[i].config.device, device) == 0)
+        {
+            identities[i].in_use = ZOS_FALSE;
+            gateway_disconnect(&identities[i]);
+            return gateway_save();
+        }
+    }
+    return ZOS_ERROR;
+}
+
+void gateway_reconnect_all(void)
+{
+    uint8_t i;
+
+    for (i = 0; i < GATEWAY_MAX_IDENTITIES; i++)
+    {
+        /// the DISCONNECTED event reconnects it since the identity stays in use,
+        /// one that isn't connected picks the settings up on its next attempt
+        if (identities[i].in_use && identities[i].connected)
+        {
+            mqtt_disconnect(identities[i].connection);
+        }
+    }
+}
+
+mqtt_msgid_t gateway_publish_for_board(uint8_t board, const uint8_t *data, uint32_t length,
+                                       publish_complete_cb_t complete, void *context)
+{
+    mqtt_settings_t *settings;
+    char board_topic[MAX_TOPIC_STRING_SIZE+1];
+    uint8_t i;
+
+    ZOS_NVM_GET_REF(settings);
+    for (i = 0; i < GATEWAY_MAX_IDENTITIES; i++)
+    {
+        gateway_identity_t *identity = &identities[i];
+
+        if (identity->in_use && identity->connected &&
+            board >= identity->config.first_board && board <= identity->config.last_board)
+        {
+            identity->d2c_messages += 1;
+            snprintf(board_topic, sizeof(board_topic), "devices/%s/messages/events/", identity->config.device);
+            return publish_buffer_on(identity->connection, board_topic, data, length, settings->qos, complete, context);
+        }
+    }
+    snprintf(board_topic, sizeof(board_topic), "devices/%s/messages/events/", settings->device);
+    return publish_buffer(board_topic, data, length, settings->qos, complete, context);
+}
+
+zos_result_t gateway_get_stats(uint8_t index, gateway_identity_stats_t *stats)
+{
+    const gateway_identity_t *identity;
+
+    if (index >= GATEWAY_MAX_IDENTITIES || !identities[index].in_use)
+    {
+        return ZOS_ERROR;
+    }
+    identity = &identities[index];
+    stats->device = identity->config.device;
+    stats->first_board = identity->config.first_board;
+    stats->last_board = identity->config.last_board;
+    stats->connected = identity->connected;
+    stats->connects = identity->connects;
+    stats->c2d_messages = identity->c2d_messages;
+    stats->d2c_messages = identity->d2c_messages;
+    return ZOS_SUCCESS;
+}
+
+uint8_t gateway_connection_count(void)
+{
+    uint8_t i, count = 0;
+
+    for (i = 0; i < GATEWAY_MAX_IDENTITIES; i++)
+    {
+        if (identities[i].connection != NULL)
+        {
+            count++;
+        }
+    }
+    return count;
+}
+
+uint32_t gateway_identity_memory(void)
+{
+    return sizeof(gateway_identity_t) + sizeof(mqtt_connection_t);
+}
@@ -0,0 +1,79 @@
+/** @file This file contains the api for per-board Azure identities
+ *
+ * In gateway mode selected mesh boards get their own IoT Hub device
+ * identity.  Each identity owns a range of board numbers and its own MQTT
+ * connection, so C2D messages sent to that device id reach its boards and
+ * data from those boards is published under that device id.  Boards that
+ * aren't routed to an identity keep using the module's own connection.
+ *
+ * The pool is bounded by GATEWAY_MAX_IDENTITIES, every identity holds a TLS
+ * session on top of the module's own.  The identity table is kept in the
+ * file GATEWAY_FILE_NAME so it survives a reboot.
+ *
+ * Copyright Ambient Sensors 2017
+ */
+#ifndef _GATEWAY_H_
+#define _GATEWAY_H_
+
+#define GATEWAY_MAX_IDENTITIES      2
+#define GATEWAY_FILE_NAME           "gateway.bin"
+/// RAM the WLAN stack holds per TLS session (context plus record buffers), reported as an estimate
+#define GATEWAY_TLS_SESSION_BYTES   6144
+
+typedef struct
+{
+    uint8_t first_board;
+    uint8_t last_board;
+    char device[MAX_DEVICE_STRING_SIZE];
+    char token_expiry[MAX_TOKEN_EXPIRY_SIZE];
+    char token_sig[MAX_TOKEN_SIG_SIZE];
+} gateway_identity_config_t;
+
+typedef struct
+{
+    const char *device;
+    uint8_t first_board;
+    uint8_t last_board;
+    zos_bool_t connected;
+    uint32_t connects;
+    uint32_t c2d_messages;
+    uint32_t d2c_messages;
+} gateway_identity_stats_t;
+
+/** @brief Load the identity table and connect every identity
+ */
+void gateway_init(void);
+
+/** @brief Add (or replace, same device id) an identity for a range of boards and connect it
+ */
+zos_result_t gateway_add_identity(const gateway_identity_config_t *config);
+
+/** @brief Disconnect and forget the identity with the given device id
+ */
+zos_result_t gateway_remove_identity(const char *device);
+
+/** @brief Drop and reopen every identity connection, to pick up a new host, port or security setting
+ */
+void gateway_reconnect_all(void);
+
+/** @brief Publish data from a board under the identity it is routed to
+ *
+ *  Falls back to the module's own identity when the board isn't routed.
+ *  Same buffer ownership rules as publish_buffer().
+ */
+mqtt_msgid_t gateway_publish_for_board(uint8_t board, const uint8_t *data, uint32_t length,
+                                       publish_complete_cb_t complete, void *context);
+
+/** @brief Statistics of the index'th identity, ZOS_ERROR if the slot is empty
+ */
+zos_result_t gateway_get_stats(uint8_t index, gateway_identity_stats_t *stats);
+
+/** @brief Number of open identity connections
+ */
+uint8_t gateway_connection_count(void);
+
+/** @brief RAM used by one identity: the app's own bytes, and the TLS session estimate on top
+ */
+uint32_t gateway_identity_memory(void);
+
+#endif
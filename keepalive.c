@@ -0,0 +1,346 @@
+/** @file This file contains the code for adaptive keepalive and liveness probing
+ *
+ * Copyright Ambient Sensors 2017
+ */
+
+#include "zos.h"
+#include "common.h"
+#include "scheduler.h"
+#include "publish.h"
+#include "keepalive.h"
+
+static struct
+{
+    zos_bool_t running;
+    uint16_t min_s;
+    uint16_t max_s;
+    uint32_t last_activity_ms;
+    uint32_t probe_due_ms;      /// when the probe timer fires
+    zos_bool_t probe_pending;
+    mqtt_msgid_t probe_msgid;   /// 0 if the SUBSCRIBE couldn't even be sent
+    uint32_t probe_sent_ms;
+    uint16_t probe_interval_s;
+    uint8_t probe_attempt;
+    uint32_t rtt_total_ms;
+    uint32_t rtt_count;
+    uint16_t recover_count;     /// probes answered at the ceiling since it last moved
+    uint16_t recover_after;     /// how many it takes to try a higher one, doubles with every drop
+    char topic[MAX_TOPIC_STRING_SIZE+1];
+} state;
+
+static keepalive_stats_t stats;
+
+static void keepalive_probe_handler(void *arg);
+static void keepalive_timeout_handler(void *arg);
+static void keepalive_reconnect_handler(void *arg);
+static void keepalive_recover_handler(void *arg);
+
+
+static void keepalive_add_history(uint16_t interval_s, uint16_t rtt_ms)
+{
+    if (stats.history_count == KEEPALIVE_HISTORY)
+    {
+        memmove(&stats.history[0], &stats.history[1], (KEEPALIVE_HISTORY - 1) * sizeof(keepalive_sample_t));
+        stats.history_count -= 1;
+    }
+    stats.history[stats.history_count].interval_s = interval_s;
+    stats.history[stats.history_count].rtt_ms = rtt_ms;
+    stats.history_count += 1;
+}
+
+/// longest interval to probe, the library's own PINGREQs keep the link from idling past the CONNECT keepalive
+static uint16_t keepalive_limit(void)
+{
+    return (state.running && stats.connect_s != 0 && stats.connect_s < stats.ceiling_s) ?
+            stats.connect_s : stats.ceiling_s;
+}
+
+/// (re)arm the probe timer for when the link will have been quiet for the interval
+static void keepalive_schedule(void)
+{
+    uint32_t now_ms = zn_rtos_get_time();
+    uint32_t idle_ms = now_ms - state.last_activity_ms;
+    uint32_t interval_ms = stats.interval_s * 1000UL;
+    uint32_t delay_ms = (idle_ms < interval_ms) ? interval_ms - idle_ms : 0;
+
+    state.probe_due_ms = now_ms + delay_ms;
+    sched_register_timed("keepalive_probe_handler", keepalive_probe_handler, NULL, delay_ms);
+}
+
+static void keepalive_send_probe(void)
+{
+    mqtt_settings_t *settings;
+
+    ZOS_NVM_GET_REF(settings);
+    state.probe_sent_ms = zn_rtos_get_time();
+    state.probe_pending = ZOS_TRUE;
+    state.probe_msgid = mqtt_subscribe(mqtt_connection, (uint8_t*)state.topic, settings->qos);
+    stats.probes += 1;
+    sched_register_timed("keepalive_timeout_handler", keepalive_timeout_handler, NULL, KEEPALIVE_PROBE_TIMEOUT_MS);
+}
+
+static void keepalive_probe_handler(void *arg)
+{
+    if (!state.running || state.probe_pending)
+    {
+        return;
+    }
+    if (zn_rtos_get_time() - state.last_activity_ms < stats.interval_s * 1000UL)
+    {
+        /// something arrived since the timer was armed, the link isn't idle yet
+        keepalive_schedule();
+        return;
+    }
+    state.probe_interval_s = stats.interval_s;
+    state.probe_attempt = 0;
+    keepalive_send_probe();
+}
+
+static void keepalive_timeout_handler(void *arg)
+{
+    if (!state.running || !state.probe_pending)
+    {
+        return;
+    }
+    stats.missed += 1;
+    keepalive_add_history(state.probe_interval_s, 0);
+
+    if (state.probe_attempt == 0)
+    {
+        /// one miss can be a lost packet, ask again right away before giving up
+        ZOS_LOG("Keepalive probe missed after %us idle, probing again", state.probe_interval_s);
+        state.probe_attempt = 1;
+        keepalive_send_probe();
+        return;
+    }
+
+    /// the path didn't survive this much idle time, settle below it
+    ZOS_LOG("Keepalive probe missed twice, reconnecting");
+    /// the reconnect sends the lower ceiling as the CONNECT keepalive
+    stats.ceiling_s = (state.probe_interval_s * 3) / 4;
+    if (stats.ceiling_s < stats.survived_s)
+    {
+        stats.ceiling_s = stats.survived_s;
+    }
+    if (stats.ceiling_s < state.min_s)
+    {
+        stats.ceiling_s = state.min_s;
+    }
+    stats.interval_s = (stats.survived_s >= state.min_s && stats.survived_s < state.probe_interval_s) ?
+                        stats.survived_s : state.min_s;
+    state.recover_count = 0;
+    state.recover_after = (state.recover_after * 2 > KEEPALIVE_RECOVER_MAX) ? KEEPALIVE_RECOVER_MAX :
+                          state.recover_after * 2;
+    stats.reconnects += 1;
+    keepalive_reconnect();
+}
+
+/// a longer keepalive can only be tried on a new connection, make it when nothing is waiting for an ack
+static void keepalive_recover_handler(void *arg)
+{
+    uint32_t due_ms;
+
+    if (!state.running || state.probe_pending || stats.ceiling_s <= stats.connect_s ||
+        publish_next_retransmit(&due_ms))
+    {
+        return; /// the next probe answered at the limit tries again
+    }
+    ZOS_LOG("Keepalive ceiling back up to %us, reconnecting to use it", stats.ceiling_s);
+    stats.reconnects += 1;
+    keepalive_reconnect();
+}
+
+/// the path keeps surviving the ceiling, so now and then give a longer idle time another try
+static void keepalive_recover(void)
+{
+    uint16_t step;
+
+    if (stats.ceiling_s <= stats.connect_s)
+    {
+        if (stats.ceiling_s >= state.max_s || ++state.recover_count < state.recover_after)
+        {
+            return;
+        }
+        state.recover_count = 0;
+        step = (stats.ceiling_s * KEEPALIVE_STEP_PERCENT) / 100;
+        stats.ceiling_s += (step > 0) ? step : 1;
+        if (stats.ceiling_s > state.max_s)
+        {
+            stats.ceiling_s = state.max_s;
+        }
+    }
+    /// not from inside the library's callback
+    SCHED_ISSUE(keepalive_recover_handler, NULL, SCHED_PRIORITY_NORMAL, SCHED_NO_DEADLINE);
+}
+
+static void keepalive_reconnect_handler(void *arg)
+{
+    /// the library didn't report the disconnect, reconnect ourselves
+    if (SCHED_ISSUE_RETRY(mqtt_app_connect, NULL, SCHED_PRIORITY_LOW, SCHED_NO_DEADLINE) != ZOS_SUCCESS)
+    {
+        ZOS_LOG("ERROR, couldn't schedule the reconnect, use mqtt_connect");
+    }
+}
+
+zos_bool_t keepalive_subscribed(mqtt_msgid_t msgid)
+{
+    uint32_t rtt_ms;
+    uint16_t step;
+
+    if (!state.probe_pending || state.probe_msgid == 0 || msgid != state.probe_msgid)
+    {
+        return ZOS_FALSE;
+    }
+    sched_unregister_periodic(keepalive_timeout_handler, NULL);
+    state.probe_pending = ZOS_FALSE;
+
+    rtt_ms = zn_rtos_get_time() - state.probe_sent_ms;
+    if (rtt_ms > 0xFFFF)
+    {
+        rtt_ms = 0xFFFF;
+    }
+    stats.rtt_last_ms = rtt_ms;
+    if (state.rtt_count == 0 || rtt_ms < stats.rtt_min_ms)
+    {
+        stats.rtt_min_ms = rtt_ms;
+    }
+    if (rtt_ms > stats.rtt_max_ms)
+    {
+        stats.rtt_max_ms = rtt_ms;
+    }
+    state.rtt_total_ms += rtt_ms;
+    state.rtt_count += 1;
+    stats.rtt_avg_ms = state.rtt_total_ms / state.rtt_count;
+    keepalive_add_history(state.probe_interval_s, rtt_ms);
+
+    /// the path survived this much idle time (a retry doesn't prove that), try a longer one
+    if (state.probe_attempt == 0 && state.probe_interval_s > stats.survived_s)
+    {
+        stats.survived_s = state.probe_interval_s;
+    }
+    step = (stats.interval_s * KEEPALIVE_STEP_PERCENT) / 100;
+    stats.interval_s += (step > 0) ? step : 1;
+    if (stats.interval_s > keepalive_limit())
+    {
+        stats.interval_s = keepalive_limit();
+    }
+    if (state.probe_attempt == 0 && state.probe_interval_s >= keepalive_limit())
+    {
+        keepalive_recover();
+    }
+
+    state.last_activity_ms = zn_rtos_get_time();
+    keepalive_schedule();
+    return ZOS_TRUE;
+}
+
+void keepalive_activity(void)
+{
+    state.last_activity_ms = zn_rtos_get_time();
+}
+
+void keepalive_set_bounds(uint16_t min_s, uint16_t max_s)
+{
+    if (min_s == 0 || max_s == 0)
+    {
+        /// keepalive disabled, nothing to probe for
+        keepalive_stop();
+        return;
+    }
+    if (min_s > max_s)
+    {
+        min_s = max_s;
+    }
+    state.min_s = min_s;
+    state.max_s = max_s;
+    if (state.recover_after == 0)
+    {
+        state.recover_after = KEEPALIVE_RECOVER_PROBES;
+    }
+    if (stats.ceiling_s == 0 || stats.ceiling_s > max_s || stats.ceiling_s < min_s)
+    {
+        stats.ceiling_s = max_s;
+    }
+    /// the current connection may have a CONNECT keepalive below min_s, probing past it proves nothing
+    if (stats.interval_s < min_s || stats.interval_s > keepalive_limit())
+    {
+        stats.interval_s = (min_s < keepalive_limit()) ? min_s : keepalive_limit();
+    }
+    /// the library keeps pinging at the CONNECT keepalive, a lower maximum only takes on a new connection
+    if (state.running && stats.connect_s > max_s)
+    {
+        ZOS_LOG("Keepalive %us is over the new maximum %us, reconnecting", stats.connect_s, max_s);
+        stats.reconnects += 1;
+        keepalive_reconnect();
+        return;
+    }
+    if (state.running && !state.probe_pending)
+    {
+        keepalive_schedule();
+    }
+}
+
+void keepalive_start(uint16_t min_s, uint16_t max_s)
+{
+    mqtt_settings_t *settings;
+
+    ZOS_NVM_GET_REF(settings);
+    sched_unregister_periodic(keepalive_reconnect_handler, NULL);
+    snprintf(state.topic, sizeof(state.topic), "devices/%s/messages/devicebound/#", settings->device);
+    state.probe_pending = ZOS_FALSE;
+    state.last_activity_ms = zn_rtos_get_time();
+    state.running = ZOS_TRUE;
+    state.recover_count = 0;
+    keepalive_set_bounds(min_s, max_s);
+}
+
+uint16_t keepalive_connect_interval(uint16_t min_s, uint16_t max_s)
+{
+    uint16_t connect_s = max_s;
+
+    /// the library pings at this interval, so ask for the idle time the path was found to survive
+    if (min_s != 0 && max_s != 0 && stats.ceiling_s >= min_s && stats.ceiling_s < max_s)
+    {
+        connect_s = stats.ceiling_s;
+    }
+    stats.connect_s = connect_s;
+    return connect_s;
+}
+
+void keepalive_reconnect(void)
+{
+    state.probe_pending = ZOS_FALSE;
+    state.running = ZOS_FALSE;
+    sched_unregister_periodic(keepalive_probe_handler, NULL);
+    sched_unregister_periodic(keepalive_timeout_handler, NULL);
+
+    /// armed first, the DISCONNECTED event (if it comes) cancels it through keepalive_stop()
+    sched_register_timed("keepalive_reconnect_handler", keepalive_reconnect_handler, NULL,
+                         KEEPALIVE_RECONNECT_GRACE_MS);
+    mqtt_disconnect(mqtt_connection);
+}
+
+void keepalive_stop(void)
+{
+    state.running = ZOS_FALSE;
+    state.probe_pending = ZOS_FALSE;
+    /// a recover already queued sees running is off
+    sched_unregister_periodic(keepalive_probe_handler, NULL);
+    sched_unregister_periodic(keepalive_timeout_handler, NULL);
+    sched_unregister_periodic(keepalive_reconnect_handler, NULL);
+}
+
+zos_bool_t keepalive_next_deadline(uint32_t *due_ms)
+{
+    if (!state.running)
+    {
+        return ZOS_FALSE;
+    }
+    *due_ms = state.probe_pending ? state.probe_sent_ms + KEEPALIVE_PROBE_TIMEOUT_MS : state.probe_due_ms;
+    return ZOS_TRUE;
+}
+
+void keepalive_get_stats(keepalive_stats_t *out)
+{
+    *out = stats;
+}
@@ -0,0 +1,97 @@
+/** @file This file contains the api for adaptive keepalive and liveness probing
+ *
+ * The MQTT library answers PINGREQs internally and doesn't report PINGRESP,
+ * so the probe is a re-SUBSCRIBE to the devicebound topic: it is idempotent
+ * on IoT Hub, isn't billed as a message, and its SUBACK gives a round trip
+ * time through the same path.
+ *
+ * A probe is sent once the link has been quiet for the current interval.
+ * Each answered probe proves the path survives that much idle time and the
+ * interval grows, up to the ceiling (at most mqtt.keepalive).  A missed
+ * answer triggers an early second probe, and if that is missed too the
+ * connection is dropped and reopened, the ceiling falling below the
+ * interval that failed.
+ *
+ * The library sends its own PINGREQ once the link has been idle for the
+ * keepalive given in CONNECT, so probing past it proves nothing.  Every
+ * connect therefore asks for the learned ceiling (keepalive_connect_interval())
+ * and the library's pings hold the link at what the path survives.  After
+ * KEEPALIVE_RECOVER_PROBES probes answered at the ceiling it is raised a
+ * step and the connection reopened with it, so a ceiling lowered by a bad
+ * spell recovers; every drop doubles the probes that takes.
+ *
+ * Copyright Ambient Sensors 2017
+ */
+#ifndef _KEEPALIVE_H_
+#define _KEEPALIVE_H_
+
+#define KEEPALIVE_PROBE_TIMEOUT_MS      5000
+#define KEEPALIVE_RECONNECT_GRACE_MS    2000    /// wait for DISCONNECTED before reconnecting ourselves
+#define KEEPALIVE_STEP_PERCENT          25
+#define KEEPALIVE_HISTORY               8
+#define KEEPALIVE_RECOVER_PROBES        8
+#define KEEPALIVE_RECOVER_MAX           64
+
+typedef struct
+{
+    uint16_t interval_s;        /// idle time before the probe
+    uint16_t rtt_ms;            /// 0 if the probe was missed
+} keepalive_sample_t;
+
+typedef struct
+{
+    uint16_t interval_s;        /// current probe interval
+    uint16_t ceiling_s;         /// largest interval still worth trying
+    uint16_t survived_s;        /// largest idle time the path survived
+    uint16_t connect_s;         /// keepalive sent in the last CONNECT, the library pings at it
+    uint32_t probes;
+    uint32_t missed;
+    uint32_t reconnects;
+    uint16_t rtt_last_ms;
+    uint16_t rtt_min_ms;
+    uint16_t rtt_max_ms;
+    uint16_t rtt_avg_ms;
+    uint8_t history_count;
+    keepalive_sample_t history[KEEPALIVE_HISTORY]; /// oldest first
+} keepalive_stats_t;
+
+/** @brief Start probing, call when the connection is up
+ */
+void keepalive_start(uint16_t min_s, uint16_t max_s);
+
+/** @brief Stop probing, call when the connection is down
+ */
+void keepalive_stop(void);
+
+/** @brief Note that something was received from the broker
+ */
+void keepalive_activity(void);
+
+/** @brief Check a SUBACK against the outstanding probe, ZOS_TRUE if it was the probe
+ */
+zos_bool_t keepalive_subscribed(mqtt_msgid_t msgid);
+
+/** @brief Apply new bounds, without dropping the connection unless it has to
+ *
+ *  Probes stay within the keepalive of the current connection, a longer
+ *  max_s is reached through the ceiling's recovery or the next connect.
+ *  A max_s below the CONNECT keepalive reconnects, the library's PINGREQs
+ *  would otherwise keep leaving the link idle for longer.
+ */
+void keepalive_set_bounds(uint16_t min_s, uint16_t max_s);
+
+/** @brief The keepalive to send in CONNECT: the learned ceiling, or max_s until there is one
+ */
+uint16_t keepalive_connect_interval(uint16_t min_s, uint16_t max_s);
+
+/** @brief Drop the connection and open it again, whether or not the library reports the disconnect
+ */
+void keepalive_reconnect(void);
+
+/** @brief When the probe (or the wait for its answer) is due, ZOS_FALSE if not probing
+ */
+zos_bool_t keepalive_next_deadline(uint32_t *due_ms);
+
+void keepalive_get_stats(keepalive_stats_t *stats);
+
+#endif
@@ -0,0 +1,281 @@
+/** @file This file contains the code for measuring cloud-to-device latency
+ *
+ * Copyright Ambient Sensors 2017
+ */
+
+#include "zos.h"
+#include "common.h"
+#include "publish.h"
+#include "latency.h"
+#include "scheduler.h"
+
+#define ENQUEUED_TIME_PROPERTY      "iothub-enqueuedtime="
+#define MAX_ENQUEUED_TIME_SIZE      40
+
+static latency_histogram_t hub_to_device;
+static latency_histogram_t device_to_mesh;
+static uint32_t unsynced;
+static uint32_t skewed;
+
+static char summary[LATENCY_SUMMARY_SIZE];
+static zos_bool_t summary_busy;
+
+
+static void histogram_add(latency_histogram_t *histogram, uint32_t value_ms)
+{
+    uint8_t bucket = 0;
+    uint32_t v = value_ms;
+
+    while (v > 0 && bucket < LATENCY_BUCKETS - 1)
+    {
+        v >>= 1;
+        bucket++;
+    }
+    if (histogram->count == 0 || value_ms < histogram->min_ms)
+    {
+        histogram->min_ms = value_ms;
+    }
+    if (value_ms > histogram->max_ms)
+    {
+        histogram->max_ms = value_ms;
+    }
+    histogram->count += 1;
+    histogram->total_ms += value_ms;
+    histogram->buckets[bucket] += 1;
+}
+
+/// upper bound of the bucket holding the given percentile
+static uint32_t histogram_percentile(const latency_histogram_t *histogram, uint8_t percent)
+{
+    uint32_t target = (histogram->count * percent + 99) / 100;
+    uint32_t seen = 0;
+    uint8_t i;
+
+    for (i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        seen += histogram->buckets[i];
+        if (seen >= target && seen > 0)
+        {
+            return (i < LATENCY_BUCKETS - 1) ? (1UL << i) : histogram->max_ms;
+        }
+    }
+    return 0;
+}
+
+/// days since 1970-01-01 of a civil date
+static int32_t days_from_civil(int32_t y, uint32_t m, uint32_t d)
+{
+    int32_t era;
+    uint32_t yoe, doy, doe;
+
+    y -= m <= 2;
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = (uint32_t)(y - era * 400);
+    doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (int32_t)doe - 719468;
+}
+
+/// decode the URL encoded property value up to the next '&'
+static uint16_t url_decode(const uint8_t *in, uint16_t in_len, char *out, uint16_t out_size)
+{
+    uint16_t i = 0, o = 0;
+    unsigned int c;
+
+    while (i < in_len && in[i] != '&' && o < out_size - 1)
+    {
+        if (in[i] == '%' && i + 2 < in_len && sscanf((const char*)&in[i+1], "%2x", &c) == 1)
+        {
+            out[o++] = (char)c;
+            i += 3;
+        }
+        else
+        {
+            out[o++] = (in[i] == '+') ? ' ' : (char)in[i];
+            i++;
+        }
+    }
+    out[o] = '\0';
+    return o;
+}
+
+/// parse "2018-10-20T12:34:56.789Z" or "10/20/2018 12:34:56 PM" into UTC milliseconds
+static zos_bool_t parse_enqueued_time(const char *text, uint64_t *utc_ms)
+{
+    unsigned int year, month, day, hour, minute, second, ms = 0;
+    char fraction[8] = "";
+    char meridiem[3] = "";
+
+    if (sscanf(text, "%4u-%2u-%2uT%2u:%2u:%2u.%7[0-9]", &year, &month, &day, &hour, &minute,
+               &second, fraction) >= 6)
+    {
+        /// only keep milliseconds of the fraction
+        fraction[3] = '\0';
+        while (strlen(fraction) < 3)
+        {
+            strcat(fraction, "0");
+        }
+        ms = atoi(fraction);
+    }
+    else if (sscanf(text, "%u/%u/%u %u:%u:%u %2s", &month, &day, &year, &hour, &minute,
+                    &second, meridiem) >= 6)
+    {
+        if (meridiem[0] == 'P' && hour < 12)
+        {
+            hour += 12;
+        }
+        else if (meridiem[0] == 'A' && hour == 12)
+        {
+            hour = 0;
+        }
+    }
+    else
+    {
+        return ZOS_FALSE;
+    }
+    if (month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || minute > 59 || second > 60)
+    {
+        return ZOS_FALSE;
+    }
+
+    *utc_ms = ((uint64_t)days_from_civil(year, month, day) * 86400ULL +
+               hour * 3600UL + minute * 60UL + second) * 1000ULL + ms;
+    return ZOS_TRUE;
+}
+
+static zos_bool_t find_enqueued_time(const uint8_t *topic, uint16_t topic_len, uint64_t *utc_ms)
+{
+    const uint16_t property_len = sizeof(ENQUEUED_TIME_PROPERTY) - 1;
+    char value[MAX_ENQUEUED_TIME_SIZE];
+    uint16_t i;
+
+    for (i = 0; i + property_len <= topic_len; i++)
+    {
+        if (memcmp(&topic[i], ENQUEUED_TIME_PROPERTY, property_len) == 0)
+        {
+            url_decode(&topic[i + property_len], topic_len - i - property_len, value, sizeof(value));
+            return parse_enqueued_time(value, utc_ms);
+        }
+    }
+    return ZOS_FALSE;
+}
+
+void latency_record_forward(uint32_t received_ms, uint32_t forwarded_ms)
+{
+    histogram_add(&device_to_mesh, forwarded_ms - received_ms);
+}
+
+void latency_record_received(const uint8_t *topic, uint16_t topic_len)
+{
+    zos_utc_time_ms_t now_ms;
+    uint64_t enqueued_ms;
+
+    if (!find_enqueued_time(topic, topic_len, &enqueued_ms))
+    {
+        return;
+    }
+    if (zn_time_get_utc_time_ms(&now_ms) != ZOS_SUCCESS || now_ms < MIN_SYNCED_UTC_MS)
+    {
+        unsynced += 1;
+        return;
+    }
+    if (now_ms < enqueued_ms)
+    {
+        /// our clock is behind the hub's, count it rather than skew the histogram
+        skewed += 1;
+        return;
+    }
+    histogram_add(&hub_to_device, (uint32_t)(now_ms - enqueued_ms));
+}
+
+static uint32_t format_histogram(char *buffer, uint32_t size, const char *name, const latency_histogram_t *histogram)
+{
+    uint32_t length;
+    uint8_t i;
+
+    length = snprintf(buffer, size, "\"%s\":{\"count\":%u,\"min\":%u,\"max\":%u,\"avg\":%u,"
+                      "\"p50\":%u,\"p90\":%u,\"p99\":%u,\"buckets\":[", name,
+                      histogram->count, histogram->min_ms, histogram->max_ms,
+                      (histogram->count > 0) ? histogram->total_ms / histogram->count : 0,
+                      histogram_percentile(histogram, 50), histogram_percentile(histogram, 90),
+                      histogram_percentile(histogram, 99));
+    for (i = 0; i < LATENCY_BUCKETS && length < size; i++)
+    {
+        length += snprintf(&buffer[length], size - length, "%s%u", (i > 0) ? "," : "", histogram->buckets[i]);
+    }
+    if (length < size)
+    {
+        length += snprintf(&buffer[length], size - length, "]}");
+    }
+    return length;
+}
+
+uint32_t latency_format_summary(char *buffer, uint32_t size)
+{
+    uint32_t length;
+
+    length = snprintf(buffer, size, "{\"type\":\"latency\",\"unsynced\":%u,\"skewed\":%u,", unsynced, skewed);
+    if (length < size)
+    {
+        length += format_histogram(&buffer[length], size - length, "hub_to_device", &hub_to_device);
+    }
+    if (length < size)
+    {
+        length += snprintf(&buffer[length], size - length, ",");
+    }
+    if (length < size)
+    {
+        length += format_histogram(&buffer[length], size - length, "device_to_mesh", &device_to_mesh);
+    }
+    if (length < size)
+    {
+        length += snprintf(&buffer[length], size - length, "}");
+    }
+    return (length < size) ? length : 0;
+}
+
+static void latency_summary_sent(void *context, zos_result_t result)
+{
+    summary_busy = ZOS_FALSE;
+}
+
+static void latency_summary_handler(void *arg)
+{
+    mqtt_settings_t *settings;
+    char summary_topic[MAX_TOPIC_STRING_SIZE+1];
+    uint32_t length;
+
+    if (summary_busy || (hub_to_device.count == 0 && device_to_mesh.count == 0))
+    {
+        return;
+    }
+    length = latency_format_summary(summary, sizeof(summary));
+    if (length == 0)
+    {
+        return;
+    }
+
+    ZOS_NVM_GET_REF(settings);
+    snprintf(summary_topic, sizeof(summary_topic), "devices/%s/messages/events/", settings->device);
+    summary_busy = ZOS_TRUE;
+    if (publish_buffer(summary_topic, (uint8_t*)summary, length, settings->qos, latency_summary_sent, NULL) == 0)
+    {
+        summary_busy = ZOS_FALSE;
+        return;
+    }
+
+    /// start a new window
+    memset(&hub_to_device, 0, sizeof(hub_to_device));
+    memset(&device_to_mesh, 0, sizeof(device_to_mesh));
+    unsynced = 0;
+    skewed = 0;
+}
+
+void latency_summary_start(uint16_t interval_s)
+{
+    sched_unregister_periodic(latency_summary_handler, NULL);
+    if (interval_s > 0)
+    {
+        sched_register_periodic("latency_summary_handler", latency_summary_handler, NULL, interval_s * 1000UL, 0);
+    }
+}
@@ -0,0 +1,51 @@
+/** @file This file contains the api for measuring cloud-to-device latency
+ *
+ * Two latencies are tracked per C2D message:
+ *  - hub to device: IoT Hub's iothub-enqueuedtime against the SNTP synced
+ *    wall clock when the message reaches mqtt_connection_event_cb
+ *  - device to mesh: from the callback until the frames are on the UART
+ *
+ * Each goes into a log2 histogram that is published as telemetry every
+ * mqtt.latency_interval seconds and then cleared.  The clock is synced by
+ * the module's SNTP client, which resources/settings.ini turns on against
+ * pool.ntp.org; 'set ntp.server <ip>' points it at a local stand-in
+ * server for bench testing.  Until the first sync C2D messages are only
+ * counted as unsynced.
+ *
+ * Copyright Ambient Sensors 2017
+ */
+#ifndef _LATENCY_H_
+#define _LATENCY_H_
+
+#define LATENCY_BUCKETS             16      /// bucket n holds [2^(n-1), 2^n) ms, the last one everything above
+#define LATENCY_SUMMARY_SIZE        512
+
+typedef struct
+{
+    uint32_t count;
+    uint32_t min_ms;
+    uint32_t max_ms;
+    uint32_t total_ms;
+    uint32_t buckets[LATENCY_BUCKETS];
+} latency_histogram_t;
+
+/** @brief Record the hub to device latency of a C2D message as it reaches the callback
+ */
+void latency_record_received(const uint8_t *topic, uint16_t topic_len);
+
+/** @brief Record the device to mesh latency of a C2D message
+ *
+ *  received_ms is zn_rtos_get_time() when the message reached the callback
+ *  and forwarded_ms when it had been handed to the mesh.
+ */
+void latency_record_forward(uint32_t received_ms, uint32_t forwarded_ms);
+
+/** @brief Publish a summary every interval_s seconds (0 stops publishing)
+ */
+void latency_summary_start(uint16_t interval_s);
+
+/** @brief Format the current window as JSON, returns the length
+ */
+uint32_t latency_format_summary(char *buffer, uint32_t size);
+
+#endif
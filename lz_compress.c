@@ -0,0 +1,163 @@
+/** @file This file contains the code for the small-window LZ compressor
+ *
+ * The hash table only remembers the most recent position for each 3 byte
+ * prefix, trading a little ratio for constant RAM and time per byte.
+ *
+ * Copyright Ambient Sensors 2017
+ */
+
+#include <string.h>
+#include "lz_compress.h"
+
+#define LZ_HASH(p)      ((uint8_t)(((p)[0] << 5) ^ ((p)[1] << 2) ^ (p)[2]) & ((1 << LZ_HASH_BITS) - 1))
+
+
+uint32_t lz_compress(const uint8_t *in, uint32_t in_len, uint8_t *out, uint32_t out_size, lz_state_t *state)
+{
+    uint32_t pos = 0, o = LZ_HEADER_SIZE, flag_pos = 0;
+    uint8_t flag_bit = 8;
+
+    if (in_len > 0xFFFF || out_size <= LZ_HEADER_SIZE || in_len <= LZ_HEADER_SIZE)
+    {
+        return 0;
+    }
+    /// never worth more than the raw data
+    if (out_size > in_len)
+    {
+        out_size = in_len;
+    }
+    memset(state->head, 0, sizeof(state->head));
+    out[0] = in_len & 0xFF;
+    out[1] = (in_len >> 8) & 0xFF;
+    out[2] = 0;
+    out[3] = 0;
+
+    while (pos < in_len)
+    {
+        uint32_t match_len = 0, match_offset = 0;
+
+        if (flag_bit == 8)
+        {
+            if (o >= out_size)
+            {
+                return 0;
+            }
+            flag_pos = o++;
+            out[flag_pos] = 0;
+            flag_bit = 0;
+        }
+
+        if (pos + LZ_MIN_MATCH <= in_len)
+        {
+            uint8_t hash = LZ_HASH(&in[pos]);
+            uint32_t candidate = state->head[hash];
+
+            state->head[hash] = pos + 1;
+            if (candidate > 0 && pos - (candidate - 1) <= LZ_WINDOW_SIZE)
+            {
+                const uint8_t *a = &in[candidate - 1];
+                uint32_t limit = in_len - pos;
+
+                if (limit > LZ_MAX_MATCH)
+                {
+                    limit = LZ_MAX_MATCH;
+                }
+                while (match_len < limit && a[match_len] == in[pos + match_len])
+                {
+                    match_len++;
+                }
+                match_offset = pos - (candidate - 1);
+            }
+        }
+
+        if (match_len >= LZ_MIN_MATCH)
+        {
+            uint32_t i;
+
+            if (o + 2 > out_size)
+            {
+                return 0;
+            }
+            out[o++] = match_offset & 0xFF;
+            out[o++] = ((match_offset >> 4) & 0xF0) | (match_len - LZ_MIN_MATCH);
+            /// keep the table current for the bytes the match covered
+            for (i = 1; i < match_len && pos + i + LZ_MIN_MATCH <= in_len; i++)
+            {
+                state->head[LZ_HASH(&in[pos + i])] = pos + i + 1;
+            }
+            pos += match_len;
+        }
+        else
+        {
+            if (o + 1 > out_size)
+            {
+                return 0;
+            }
+            out[flag_pos] |= 1 << flag_bit;
+            out[o++] = in[pos++];
+        }
+        flag_bit++;
+    }
+    return (o < out_size) ? o : 0;
+}
+
+uint32_t lz_decompress(const uint8_t *in, uint32_t in_len, uint8_t *out, uint32_t out_size)
+{
+    uint32_t length, i = LZ_HEADER_SIZE, o = 0;
+    uint8_t flags = 0, flag_bit = 8;
+
+    if (in_len < LZ_HEADER_SIZE)
+    {
+        return 0;
+    }
+    length = in[0] | (in[1] << 8) | ((uint32_t)in[2] << 16) | ((uint32_t)in[3] << 24);
+    if (length > out_size)
+    {
+        return 0;
+    }
+
+    while (o < length)
+    {
+        if (flag_bit == 8)
+        {
+            if (i >= in_len)
+            {
+                return 0;
+            }
+            flags = in[i++];
+            flag_bit = 0;
+        }
+        if (flags & (1 << flag_bit))
+        {
+            if (i >= in_len)
+            {
+                return 0;
+            }
+            out[o++] = in[i++];
+        }
+        else
+        {
+            uint32_t offset, match_len;
+
+            if (i + 2 > in_len)
+            {
+                return 0;
+            }
+            offset = in[i] | ((in[i + 1] & 0xF0) << 4);
+            match_len = (in[i + 1] & 0x0F) + LZ_MIN_MATCH;
+            i += 2;
+            if (offset == 0 || offset > o || o + match_len > length)
+            {
+                return 0;
+            }
+            /// byte by byte, matches may overlap the bytes they produce
+            while (match_len-- > 0)
+            {
+                out[o] = out[o - offset];
+                o++;
+            }
+        }
+        flag_bit++;
+    }
+    return o;
+}
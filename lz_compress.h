@@ -0,0 +1,47 @@
+/** @file This file contains the api for the small-window LZ compressor
+ *
+ * LZSS with a 4 KB window over the input buffer itself, so compressing
+ * needs no RAM beyond the caller's output buffer and a 512 byte hash table.
+ * Plain C without ZentriOS dependencies, so the backend decoder and the
+ * host benchmark (tools/lz_bench.c) build from the same file.
+ *
+ * Stream format ("lzss" content encoding):
+ *   uint32_t  uncompressed length, little endian
+ *   then groups of a flag byte and up to 8 items, flag bit n (LSB first)
+ *   set for a literal byte, clear for a 2 byte match:
+ *     byte 0: offset bits 0-7
+ *     byte 1: offset bits 8-11 in the high nibble, length - LZ_MIN_MATCH in the low nibble
+ *   offset is the distance back from the current position (1..LZ_WINDOW_SIZE).
+ *
+ * Copyright Ambient Sensors 2017
+ */
+#ifndef _LZ_COMPRESS_H_
+#define _LZ_COMPRESS_H_
+
+#include <stdint.h>
+
+#define LZ_CONTENT_ENCODING         "lzss"
+#define LZ_WINDOW_SIZE              4095
+#define LZ_MIN_MATCH                3
+#define LZ_MAX_MATCH                (LZ_MIN_MATCH + 15)
+#define LZ_HASH_BITS                8
+#define LZ_HEADER_SIZE              4
+
+typedef struct
+{
+    uint16_t head[1 << LZ_HASH_BITS];   /// last position + 1 seen for each hash, 0 for none
+} lz_state_t;
+
+/** @brief Compress in into out
+ *
+ *  Returns the compressed length, or 0 if the result wouldn't be smaller
+ *  than the input (or doesn't fit out), in which case send the raw data.
+ *  Inputs are limited to 64 KB.
+ */
+uint32_t lz_compress(const uint8_t *in, uint32_t in_len, uint8_t *out, uint32_t out_size, lz_state_t *state);
+
+/** @brief Decompress a stream made by lz_compress, returns the length or 0 if it is malformed
+ */
+uint32_t lz_decompress(const uint8_t *in, uint32_t in_len, uint8_t *out, uint32_t out_size);
+
+#endif
@@ -10,6 +10,16 @@
 #include "zos.h"
 #include "common.h"
 #include "mesh_control.h"
+#include "traffic_trace.h"
+#include "publish.h"
+#include "latency.h"
+#include "scheduler.h"
+#include "gateway.h"
+#include "keepalive.h"
+#include "app_memory.h"
+#include "subscriptions.h"
+#include "telemetry.h"
+#include "power.h"
 
 /** @file
  *
@@ -55,6 +65,9 @@
  *                      Macros
  ******************************************************/
 #define MAX_SIS 8
+#define C2D_FORWARD_SLOTS           4
+#define MAX_C2D_REQUEST_SIZE        256
+#define MESH_FORWARD_DEADLINE_MS    20
 
 /******************************************************
  *                    Constants
@@ -71,11 +84,21 @@
 /******************************************************
  *                    Structures
  ******************************************************/
+/// C2D request copied out of the MQTT callback, waiting to be forwarded to the mesh
+typedef struct
+{
+    zos_bool_t busy;
+    zos_bool_t replayed;        /// from a trace replay, kept out of the latency figures
+    uint32_t received_ms;
+    uint16_t length;
+    char data[MAX_C2D_REQUEST_SIZE];
+} c2d_forward_t;
 
 /******************************************************
  *               Function Declarations
  ******************************************************/
 static zos_result_t mqtt_connection_event_cb( mqtt_event_info_t *event );
+static void mesh_forward_handler( void *arg );
 
 /******************************************************
  *               Variable Definitions
@@ -88,6 +111,7 @@ uint8_t username[MAX_USERNAME_STRING_SIZE+1];
 uint8_t password[MAX_PASSWORD_STRING_SIZE+1];
 
 static mqtt_callback_t callback = mqtt_connection_event_cb;
+static c2d_forward_t forward_slots[C2D_FORWARD_SLOTS];
 
 /******************************************************
  *               Function Definitions
@@ -111,8 +135,8 @@ void zn_app_init(void)
         }
     }
 
-    /* Memory allocated for MQTT object*/
-    zn_malloc((uint8_t**)&mqtt_connection, sizeof(mqtt_connection_t));
+    /* Memory allocated for MQTT object (from the static arena when built with APP_STATIC_MEMORY) */
+    mqtt_connection = app_mem_alloc(APP_MEM_MQTT_CONNECTION, 0, sizeof(mqtt_connection_t));
     if ( mqtt_connection == NULL )
     {
         ZOS_LOG("Failed to allocate MQTT object...\n");
@@ -123,7 +147,7 @@ void zn_app_init(void)
     if(result != ZOS_SUCCESS)
     {
         ZOS_LOG("Error initializing");
-        zn_free(mqtt_connection);
+        app_mem_free(APP_MEM_MQTT_CONNECTION, 0, mqtt_connection);
         mqtt_connection = NULL;
         return;
     }
@@ -133,13 +157,29 @@ void zn_app_init(void)
 
     ZOS_LOG("MQTT Demo Application Started:");
     ZOS_LOG("  - List all variables                        : get mqtt");
-    ZOS_LOG("  - Set variable <mqtt.var> to value <val>    : set mqtt.var val");
+    ZOS_LOG("  - Stage variable <mqtt.var> value <val>     : set mqtt.var val");
+    ZOS_LOG("  - Apply (and save) the staged variables     : mqtt_commit");
+    ZOS_LOG("  - Discard the staged variables              : mqtt_abort");
     ZOS_LOG("  - Connect to broker <mqtt.host:port>        : mqtt_connect");
-    ZOS_LOG("  - Subscribe to topic                        : mqtt_subscribe <topic>");
+    ZOS_LOG("  - Subscribe to topic (kept over reboots)    : mqtt_subscribe <topic> [save]");
+    ZOS_LOG("  - Subscriptions and their SUBACK status     : get mqtt.subscriptions");
     ZOS_LOG("  - Publish to topic                          : mqtt_publish <topic> <message>");
     ZOS_LOG("  - Unsubscribe from topic                    : mqtt_unsubscribe <topic>");
     ZOS_LOG("  - Disconnect from broker <mqtt.host>        : mqtt_disconnect");
     ZOS_LOG("  - send cmd to mesh (\"cmd - -\" for usage)    : cmd");
+    ZOS_LOG("  - send many cmds to mesh in one burst       : cmd_batch <cmd>:<arg>,... | -f <file>");
+    ZOS_LOG("  - Send boards' commands to mesh bridge <n>  : mesh_route <board>[-<last>] <n>");
+    ZOS_LOG("  - Give boards their own Azure identity      : gw_add <board>[-<last>] <device> <expiry> <sig>");
+    ZOS_LOG("  - Remove a board identity                   : gw_remove <device>");
+    ZOS_LOG("  - Memory, stack and network buffer peaks    : get mqtt.memory");
+    ZOS_LOG("  - Compress telemetry of <n> bytes or more   : set mqtt.compress_threshold <n>");
+    ZOS_LOG("  - Summarize sensor readings every <n> s     : set mqtt.agg_window <n>");
+    ZOS_LOG("  - Upload readings outside <low>..<high> raw : agg_threshold <metric> <low> <high>");
+    ZOS_LOG("  - Poll quiet mesh bridges less often        : set mqtt.power_save 1");
+    ZOS_LOG("  - Wakeups, idle time and next deadline      : get mqtt.power");
+    ZOS_LOG("  - Capture traffic into <file>               : trace_start <file>");
+    ZOS_LOG("  - Stop capturing traffic                    : trace_stop");
+    ZOS_LOG("  - Replay traffic from <file> <speedup>      : trace_replay <file> [speedup]");
 
     if(zn_load_app_settings("settings.ini") != ZOS_SUCCESS)
     {
@@ -163,7 +203,16 @@ void zn_app_init(void)
     strcpy((char *) settings->device, "0641304100000000220068001851343438333231");
 #endif
 
-    zn_event_issue(mqtt_app_connect, NULL, 0);
+    latency_summary_start(settings->latency_interval);
+    publish_set_compress_threshold(settings->compress_threshold);
+    subs_init();
+    telemetry_init(settings->agg_window);
+    power_init(settings->power_save);
+    if (SCHED_ISSUE_RETRY(mqtt_app_connect, NULL, SCHED_PRIORITY_LOW, SCHED_NO_DEADLINE) != ZOS_SUCCESS)
+    {
+        ZOS_LOG("ERROR, couldn't schedule the connect, use mqtt_connect");
+    }
+    gateway_init();
 }
 
 
@@ -171,7 +220,7 @@ void zn_app_init(void)
 void zn_app_deinit(void)
 {
     mqtt_deinit( mqtt_connection );
-    zn_free(mqtt_connection);
+    app_mem_free(APP_MEM_MQTT_CONNECTION, 0, mqtt_connection);
     mqtt_connection = NULL;
 }
 
@@ -193,6 +242,8 @@ void mqtt_app_connect( void *arg )
     mqtt_pkt_connect_t conninfo;
     zos_result_t ret = ZOS_SUCCESS;
 
+    SCHED_STACK_SAMPLE();
+
     sprintf((char*)username, "%s/%s/api-version=2016-11-14", settings->host, settings->device);
     sprintf((char*)password, "SharedAccessSignature sr=%s%%2Fdevices%%2F%s&sig=%s&se=%s",
             settings->host, settings->device, settings->token_sig, settings->token_expiry);
@@ -214,7 +265,8 @@ void mqtt_app_connect( void *arg )
     conninfo.clean_session = 1; /// Azure, don't give me old messages
     conninfo.client_id = settings->device;
 
-    conninfo.keep_alive = settings->keepalive;
+    /// the library pings at this interval, ask for what the probes found the path to survive
+    conninfo.keep_alive = keepalive_connect_interval( settings->keepalive_min, settings->keepalive );
     conninfo.username = username;
     conninfo.password = password;
 
@@ -229,10 +281,8 @@ void mqtt_app_connect( void *arg )
     }
     else
     {
-        /// now that we are successfully connected, subscribe to our topic
-        snprintf(topic, MAX_TOPIC_STRING_SIZE,
-                 "devices/%s/messages/devicebound/#", settings->device);
-        zn_event_issue(mqtt_app_subscribe, NULL, 0); /// uses the topic string
+        /// now that we are successfully connected, restore our topic and any others in the table
+        SCHED_ISSUE(subs_restore, NULL, SCHED_PRIORITY_NORMAL, SCHED_NO_DEADLINE);
     }
 }
 
@@ -251,49 +301,21 @@ void mqtt_app_disconnect( void *arg )
 
 /*************************************************************************************************/
 /*
- * Subscribe to topic
- */
-void mqtt_app_subscribe( void *arg )
-{
-    mqtt_msgid_t pktid;
-    ZOS_LOG("Subscribing to topic '%s'", topic);
-    pktid = mqtt_subscribe( mqtt_connection, (uint8_t*)topic, settings->qos );
-    if ( pktid == 0 )
-    {
-        ZOS_LOG("Error subscribing: packet ID = 0");
-    }
-}
-
-/*************************************************************************************************/
-/*
- * Unsubscribe from topic
+ * Publish (send) message to topic
  */
-void mqtt_app_unsubscribe( void *arg )
+void mqtt_app_publish( void *arg )
 {
-    mqtt_msgid_t pktid;
-    ZOS_LOG("Unsubscribing from topic '%s'", topic);
-    pktid = mqtt_unsubscribe( mqtt_connection, (uint8_t*)topic );
-
-    if ( pktid == 0 )
-    {
-        ZOS_LOG("Error unsubscribing: packet ID = 0");
-    }
+    ZOS_LOG("Publishing to topic: '%s', message: '%s'", topic, message);
+    publish_buffer( topic, (uint8_t*)message, (uint32_t)strlen(message), settings->qos, NULL, NULL );
 }
 
 /*************************************************************************************************/
 /*
- * Publish (send) message to topic
+ * Hand an event to the connection callback as if it came from the broker (used by trace replay)
  */
-void mqtt_app_publish( void *arg )
+zos_result_t mqtt_app_inject_event( mqtt_event_info_t *event )
 {
-    mqtt_msgid_t pktid;
-    ZOS_LOG("Publishing to topic: '%s', message: '%s'", topic, message);
-    pktid = mqtt_publish( mqtt_connection, (uint8_t*)topic, (uint8_t*)message, (uint32_t)strlen(message), settings->qos );
-
-    if ( pktid == 0 )
-    {
-        ZOS_LOG("Error publishing: packet ID = 0");
-    }
+    return callback( event );
 }
 
 /******************************************************
@@ -304,20 +326,40 @@ void mqtt_app_publish( void *arg )
  */
 static zos_result_t mqtt_connection_event_cb( mqtt_event_info_t *event )
 {
+    sched_frame_t frame;
+
+    sched_account_begin(&frame);
+    keepalive_activity();
     switch ( event->type )
     {
         case MQTT_EVENT_TYPE_CONNECTED:
             ZOS_LOG("CONNECTED" );
+            keepalive_start( settings->keepalive_min, settings->keepalive );
             break;
         case MQTT_EVENT_TYPE_DISCONNECTED:
             ZOS_LOG("DISCONNECTED - issue event to connect" );
-            zn_event_issue(mqtt_app_connect, NULL, 0);
+            keepalive_stop();
+            publish_abort_all( mqtt_connection );
+            subs_disconnected();
+            /// a full queue only delays the reconnect, it would otherwise never come
+            if (SCHED_ISSUE_RETRY(mqtt_app_connect, NULL, SCHED_PRIORITY_LOW, SCHED_NO_DEADLINE) != ZOS_SUCCESS)
+            {
+                ZOS_LOG("ERROR, couldn't schedule the reconnect, use mqtt_connect");
+            }
             break;
         case MQTT_EVENT_TYPE_PUBLISHED:
             ZOS_LOG("MESSAGE PUBLISHED" );
+            publish_acknowledged( mqtt_connection, event->data.msgid );
             break;
         case MQTT_EVENT_TYPE_SUBCRIBED:
-            ZOS_LOG("TOPIC SUBSCRIBED" );
+            if ( keepalive_subscribed( event->data.msgid ) )
+            {
+                break; /// answer to a liveness probe
+            }
+            if ( !subs_acknowledged( event->data.msgid ) )
+            {
+                ZOS_LOG("TOPIC SUBSCRIBED" );
+            }
             break;
         case MQTT_EVENT_TYPE_UNSUBSCRIBED:
             ZOS_LOG("TOPIC UNSUBSCRIBED" );
@@ -325,19 +367,76 @@ static zos_result_t mqtt_connection_event_cb( mqtt_event_info_t *event )
         case MQTT_EVENT_TYPE_PUBLISH_MSG_RECEIVED:
         {
             mqtt_topic_msg_t msg = event->data.pub_recvd;
+            c2d_forward_t *slot = NULL;
+            /// a replayed message carries the enqueued time of the capture, it says nothing about today's latency
+            zos_bool_t replayed = trace_replay_injecting();
+            uint8_t i;
             ZOS_LOG("MESSAGE RECEIVED");
+            app_mem_network_packet(ZOS_FALSE, msg.topic_len + msg.data_len);
 
             ZOS_LOG("----------------------------");
             ZOS_LOG("Topic  : %.*s", msg.topic_len, msg.topic );
             ZOS_LOG("Message: %.*s", msg.data_len, msg.data);
             ZOS_LOG("----------------------------");
 
-            parse_received_request((char *) msg.data, msg.data_len);
+            trace_record_mqtt_in(msg.topic, msg.topic_len, msg.data, msg.data_len);
+            if (!replayed)
+            {
+                latency_record_received(msg.topic, msg.topic_len);
+            }
+
+            for (i = 0; i < C2D_FORWARD_SLOTS && msg.data_len <= MAX_C2D_REQUEST_SIZE; i++)
+            {
+                if (!forward_slots[i].busy)
+                {
+                    slot = &forward_slots[i];
+                    break;
+                }
+            }
+            if (slot != NULL)
+            {
+                /// hand the mesh forwarding to the scheduler so it doesn't run on the network callback
+                slot->busy = ZOS_TRUE;
+                slot->replayed = replayed;
+                slot->received_ms = frame.start_ms;
+                slot->length = msg.data_len;
+                memcpy(slot->data, msg.data, msg.data_len);
+                if (SCHED_ISSUE(mesh_forward_handler, slot, SCHED_PRIORITY_HIGH, MESH_FORWARD_DEADLINE_MS) != ZOS_SUCCESS)
+                {
+                    mesh_forward_handler(slot);
+                }
+            }
+            else
+            {
+                /// all slots busy (or too big to copy), forward it right here
+                parse_received_request((char *) msg.data, msg.data_len);
+                if (!replayed)
+                {
+                    latency_record_forward(frame.start_ms, zn_rtos_get_time());
+                }
+            }
         }
             break;
         default:
             ZOS_LOG("recevied unknown connection event - WHAT EVENT TYPE IS %d?", event->type);
             break;
     }
+    sched_account_end(&frame, "mqtt_connection_event_cb", 0);
     return ZOS_SUCCESS;
 }
+
+/*************************************************************************************************/
+/*
+ * Forward a C2D request that was copied out of the connection callback to the mesh
+ */
+static void mesh_forward_handler( void *arg )
+{
+    c2d_forward_t *slot = arg;
+
+    parse_received_request(slot->data, slot->length);
+    if (!slot->replayed)
+    {
+        latency_record_forward(slot->received_ms, zn_rtos_get_time());
+    }
+    slot->busy = ZOS_FALSE;
+}
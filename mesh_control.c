@@ -6,114 +6,546 @@
  */
 
 #include "zos.h"
+#include "mesh_control.h"
+#include "traffic_trace.h"
+#include "scheduler.h"
+#include "telemetry.h"
+#include "power.h"
 
-#define MAX_CMD_LENGTH 16
-#define ORDER_CMD_LENGTH 5
-#define STD_BOARD_CMD_LENGTH 4
-#define SERIAL_MESH_CMD 0x20
+#define MESH_BATCH_BUFFER_SIZE 256
+/// "C1B1;" is the shortest, a whole C2D request of them fits
+#define MESH_MAX_REQUEST_COMMANDS 64
+/// a frame not completed within this is given up, the bridge sends them in one go
+#define RX_FRAME_TIMEOUT_MS (2 * POLL_UART_MS)
 
-#define POLL_UART_MS 200
+/// fastest poll, the power mode backs off from here while a bridge is quiet
+#define POLL_UART_MS POWER_POLL_MIN_MS
 // how big do we want our receive buffer??
-static uint8_t ring_buffer_data[1024];
+#define MESH_RING_BUFFER_SIZE 1024
+
+/// every bridge's poll holds a timed slot, next to the seven other users listed at SCHED_MAX_PERIODIC
+#if SCHED_MAX_PERIODIC < MESH_MAX_BRIDGES + 7
+#error SCHED_MAX_PERIODIC has no room for a UART poll per bridge
+#endif
+
+typedef struct
+{
+    zos_uart_t uart;
+    uint32_t baud_rate;
+    const char *poll_name;      /// handler name in the scheduler statistics
+} mesh_bridge_config_t;
+
+typedef struct
+{
+    const mesh_bridge_config_t *config;
+    uint8_t ring_buffer_data[MESH_RING_BUFFER_SIZE];
+    /// frames queued up to go out to this bridge in one burst
+    uint8_t frames[MESH_BATCH_BUFFER_SIZE];
+    uint16_t length;
+    uint16_t count;
+    uint32_t tx_frames;
+    uint32_t tx_bytes;
+    uint32_t rx_bytes;
+    mesh_rx_t rx;
+    power_poll_t poll;
+} mesh_bridge_t;
+
+typedef struct
+{
+    uint8_t first_board;
+    uint8_t last_board;
+    uint8_t bridge;
+} mesh_route_t;
+
+typedef struct
+{
+    uint8_t cmd;
+    uint8_t order;
+    uint16_t arg;
+} mesh_command_t;
+
+/// a C2D request parsed in full before any of it is sent
+typedef struct
+{
+    const uint8_t *range;       /// first and last board of a board identity, NULL for the gateway's own
+    uint8_t count;
+    mesh_command_t commands[MESH_MAX_REQUEST_COMMANDS];
+} mesh_request_t;
+
+/// the Nordic bridges wired to the module, the first MESH_BRIDGE_COUNT are used
+static const mesh_bridge_config_t bridge_configs[MESH_MAX_BRIDGES] =
+{
+    { ZOS_UART_1, 115200, "uart_rx_bridge0" },
+    { ZOS_UART_2, 115200, "uart_rx_bridge1" },
+};
+
+static mesh_bridge_t bridges[MESH_BRIDGE_COUNT];
+/// boards without a route go to bridge 0
+static mesh_route_t routes[MESH_MAX_ROUTES];
+static uint16_t batch_sent;
 
 
 static void uart_rx_data_handler(void *arg)
 {
+    mesh_bridge_t *bridge = arg;
     const uint8_t *dummy;
     uint16_t bytes_read;
     uint8_t rx_buffer[256];
 
     // see if the UART had any data available
-    zn_uart_peek_bytes(ZOS_UART_1, &dummy, &bytes_read);
+    zn_uart_peek_bytes(bridge->config->uart, &dummy, &bytes_read);
 
     if (bytes_read > 0)
     {
-        zn_uart_receive_bytes(ZOS_UART_1, rx_buffer, bytes_read, ZOS_NO_WAIT);
-        /// uncomment the loop below if you really want to see all the stuff coming back
-#if 0
-        for (i=0; i<bytes_read; i++)
+        if (bytes_read > sizeof(rx_buffer))
         {
-            ZOS_LOG("We just read 0x%X", rx_buffer[i]);
+            bytes_read = sizeof(rx_buffer);
         }
-#endif
+        zn_uart_receive_bytes(bridge->config->uart, rx_buffer, bytes_read, ZOS_NO_WAIT);
+        bridge->rx_bytes += bytes_read;
+        trace_record_uart(TRACE_EVENT_UART_IN, bridge - bridges, rx_buffer, bytes_read);
+        mesh_process_rx_data(bridge - bridges, rx_buffer, bytes_read);
+    }
+    sched_register_timed(bridge->config->poll_name, uart_rx_data_handler, bridge,
+                         power_next_poll(&bridge->poll, bytes_read));
+}
+
+static zos_result_t mesh_save_routes(void)
+{
+    zos_file_t file_info;
+    uint32_t handle;
+    zos_result_t result;
+
+    memset(&file_info, 0, sizeof(file_info));
+    strcpy(file_info.name, MESH_ROUTE_FILE_NAME);
+    file_info.size = sizeof(routes);
+    file_info.type = FILE_TYPE_MISC_FIX_LEN;
+
+    zn_file_delete(MESH_ROUTE_FILE_NAME);
+    if (zn_file_create(&file_info, &handle) != ZOS_SUCCESS)
+    {
+        ZOS_LOG("ERROR, failed to create %s", MESH_ROUTE_FILE_NAME);
+        return ZOS_ERROR;
+    }
+    result = zn_file_write(handle, routes, sizeof(routes));
+    zn_file_close(handle);
+    return result;
+}
+
+static void mesh_load_routes(void)
+{
+    uint32_t handle, bytes_read;
+    uint8_t i;
+
+    if (zn_file_open(MESH_ROUTE_FILE_NAME, &handle) != ZOS_SUCCESS)
+    {
+        return; /// everything on bridge 0
+    }
+    if (zn_file_read(handle, routes, sizeof(routes), &bytes_read) != ZOS_SUCCESS || bytes_read != sizeof(routes))
+    {
+        memset(routes, 0, sizeof(routes));
+    }
+    zn_file_close(handle);
+
+    for (i = 0; i < MESH_MAX_ROUTES; i++)
+    {
+        if (routes[i].bridge >= MESH_BRIDGE_COUNT)
+        {
+            /// saved by a build with more bridges
+            routes[i].bridge = 0;
+        }
+    }
+}
+
+static uint8_t mesh_route_board(uint8_t board)
+{
+    uint8_t i;
+
+    for (i = 0; i < MESH_MAX_ROUTES; i++)
+    {
+        if (routes[i].bridge != 0 && board >= routes[i].first_board && board <= routes[i].last_board)
+        {
+            return routes[i].bridge;
+        }
+    }
+    return 0;
+}
+
+static int mesh_bridge_send(mesh_bridge_t *bridge)
+{
+    int result = 0;
+
+    if (bridge->length > 0)
+    {
+        result = mesh_send_frames(bridge - bridges, bridge->frames, bridge->length);
+        batch_sent += bridge->count;
+        bridge->tx_frames += bridge->count;
+    }
+    bridge->length = 0;
+    bridge->count = 0;
+    return result;
+}
+
+/// queue one encoded frame for a bridge, sending its burst first if it's full
+static int mesh_bridge_queue(mesh_bridge_t *bridge, const uint8_t *frame, uint8_t length)
+{
+    if (bridge->length + length > sizeof(bridge->frames) && mesh_bridge_send(bridge) != 0)
+    {
+        return -1;
+    }
+    memcpy(&bridge->frames[bridge->length], frame, length);
+    bridge->length += length;
+    bridge->count += 1;
+    return 0;
+}
+
+static void mesh_handle_frame(void *context, const uint8_t *frame, uint8_t length)
+{
+    uint8_t board, metric;
+    int16_t value;
+
+    if (mesh_decode_sensor(frame, length, &board, &metric, &value) == 0)
+    {
+        telemetry_reading(board, metric, value);
     }
 }
 
+void mesh_process_rx_data(uint8_t index, const uint8_t *data, uint16_t size)
+{
+    if (index >= MESH_BRIDGE_COUNT)
+    {
+        return; /// replaying a trace from a build with more bridges
+    }
+    mesh_rx_feed(&bridges[index].rx, data, size, zn_rtos_get_time(), RX_FRAME_TIMEOUT_MS, mesh_handle_frame, NULL);
+}
+
 int setup_serial_port(void)
 {
-    /// setup the UART
-    const zos_uart_config_t config =
+    /// setup the UARTs, one per bridge
+    zos_uart_config_t config =
     {
-        .baud_rate = 115200,
         .data_width = UART_WIDTH_8BIT,
         .parity = UART_NO_PARITY,
         .stop_bits = UART_STOP_BITS_1,
         .flow_control = UART_FLOW_CTS_RTS,
     };
-    const zos_uart_buffer_t uart_buffer =
+    zos_uart_buffer_t uart_buffer;
+    uint8_t i;
+
+    mesh_load_routes();
+    for (i = 0; i < MESH_BRIDGE_COUNT; i++)
     {
-        .buffer = ring_buffer_data,
-        .length = sizeof(ring_buffer_data)
-    };
+        bridges[i].config = &bridge_configs[i];
+        config.baud_rate = bridge_configs[i].baud_rate;
+        uart_buffer.buffer = bridges[i].ring_buffer_data;
+        uart_buffer.length = sizeof(bridges[i].ring_buffer_data);
 
-    // do we need to send a rigado reset pulse here?
-    ZOS_LOG("uart config returned 0x%X", zn_uart_configure(ZOS_UART_1, &config, &uart_buffer));
-    /// register handler to periodically poll UART
-    zn_event_register_periodic(uart_rx_data_handler, NULL, POLL_UART_MS, EVENT_FLAGS1(RUN_NOW));
+        // do we need to send a rigado reset pulse here?
+        ZOS_LOG("uart %u config returned 0x%X", bridge_configs[i].uart,
+                zn_uart_configure(bridge_configs[i].uart, &config, &uart_buffer));
+        /// poll the UART, every poll arms the next one
+        power_poll_reset(&bridges[i].poll);
+        if (sched_register_timed(bridge_configs[i].poll_name, uart_rx_data_handler, &bridges[i], 0) != ZOS_SUCCESS)
+        {
+            ZOS_LOG("no scheduler slot to poll bridge %u", i);
+        }
+    }
     return 0;
 }
 
-int parse_received_request(char *buffer, size_t size)
+int mesh_send_frames(uint8_t bridge, const uint8_t *frames, uint16_t length)
+{
+    SCHED_STACK_SAMPLE();
+    if (bridge >= MESH_BRIDGE_COUNT || zn_uart_transmit_bytes(bridges[bridge].config->uart, frames, length) != ZOS_SUCCESS)
+    {
+        ZOS_LOG("ERROR, %s failed to send %u bytes to bridge %u", __func__, length, bridge);
+        return -1;
+    }
+    bridges[bridge].tx_bytes += length;
+    trace_record_uart(TRACE_EVENT_UART_OUT, bridge, frames, length);
+    if (bridges[bridge].poll.period_ms > POLL_UART_MS)
+    {
+        /// backed off, but an answer is on its way
+        power_poll_reset(&bridges[bridge].poll);
+        sched_register_timed(bridges[bridge].config->poll_name, uart_rx_data_handler, &bridges[bridge], POLL_UART_MS);
+    }
+    return 0;
+}
+
+int mesh_send_command(uint8_t cmd, uint16_t arg, uint8_t order)
 {
-    int cmd, board_num, parsed, order;
-    char parm_type;
-    char temp_array[100];
-    uint8_t byte_array_send[MAX_CMD_LENGTH];
-
-    // check for the "Order command type"
-    parsed = sscanf(buffer, "C%d%c%s", &cmd, &parm_type, temp_array);
-    if (parsed != 3)
-    {
-    	ZOS_LOG("ERROR, %s didn't do a basic parse", __func__);
-    	return parsed;
-    }
-    ZOS_LOG("Sandra, cmd=0x%X, parm_type=%c, temp_array=%s", cmd, parm_type, temp_array);
-    if (parm_type == 'O')
-    {
-    	// this is an order command - parse the parm as hex (without 0x in front)
-    	parsed = sscanf(buffer, "C%dO%x", &cmd, &order);
-    	if (parsed != 2)
-    	{
-    		ZOS_LOG("ERROR, %s didn't parse the order properly", __func__);
-    		return parsed;
-    	}
-    	ZOS_LOG("cmd=%d, order=0x%X", cmd, order);
-    	byte_array_send[0] = ORDER_CMD_LENGTH - 1; /// don't include this byte in length
-    	byte_array_send[1] = SERIAL_MESH_CMD;
-    	byte_array_send[2] = cmd;
-    	byte_array_send[3] = (order >> 8) & 0xFF;
-        ZOS_LOG("Just set byte 3 to 0x%X", byte_array_send[3]);
-    	byte_array_send[4] = order & 0xFF;
-        ZOS_LOG("Just set byte 4 to 0x%X", byte_array_send[4]);
-    }
-    else
-    {
-    	parsed = sscanf(buffer, "C%dB%d", &cmd, &board_num);
-    	if (parsed != 2)
-    	{
-    		ZOS_LOG("ERROR, %s didn't parse the 2 commands", __func__);
-    		return parsed;
-    	}
-    	ZOS_LOG("cmd=%d, board_num=%d", cmd, board_num);
-        /// don't include this byte in length
-    	byte_array_send[0] = STD_BOARD_CMD_LENGTH - 1;
-    	byte_array_send[1] = SERIAL_MESH_CMD;
-    	byte_array_send[2] = cmd;
-    	byte_array_send[3] = board_num;
-    }
-
-    zn_uart_transmit_bytes(ZOS_UART_1, byte_array_send, byte_array_send[0] + 1);
-    ZOS_LOG("Sent length of 0x%X", byte_array_send[0] + 1);
+    uint8_t frame[MESH_MAX_CMD_LENGTH];
+    uint8_t length = mesh_encode_command(cmd, arg, order, frame);
+    uint8_t i;
+    int result = 0;
+
+    if (length == 0)
+    {
+        ZOS_LOG("ERROR, board number %u out of range", arg);
+        return -1;
+    }
+    ZOS_LOG("cmd=%u, arg=0x%X", cmd, arg);
+    if (!order)
+    {
+        return mesh_send_frames(mesh_route_board(arg), frame, length);
+    }
+    /// the order covers every board, so every mesh gets it
+    for (i = 0; i < MESH_BRIDGE_COUNT; i++)
+    {
+        result |= mesh_send_frames(i, frame, length);
+    }
+    return result;
+}
+
+void mesh_batch_begin(void)
+{
+    uint8_t i;
+
+    for (i = 0; i < MESH_BRIDGE_COUNT; i++)
+    {
+        bridges[i].length = 0;
+        bridges[i].count = 0;
+    }
+    batch_sent = 0;
+}
+
+int mesh_batch_add(uint8_t cmd, uint16_t arg, uint8_t order)
+{
+    uint8_t frame[MESH_MAX_CMD_LENGTH];
+    uint8_t length = mesh_encode_command(cmd, arg, order, frame);
+    uint8_t i;
+
+    if (length == 0)
+    {
+        ZOS_LOG("ERROR, board number %u out of range", arg);
+        return -1;
+    }
+    if (!order)
+    {
+        return mesh_bridge_queue(&bridges[mesh_route_board(arg)], frame, length);
+    }
+    for (i = 0; i < MESH_BRIDGE_COUNT; i++)
+    {
+        if (mesh_bridge_queue(&bridges[i], frame, length) != 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int mesh_batch_send(void)
+{
+    int result = 0;
+    uint8_t i;
+
+    /// one write per bridge, each link carries only its own mesh's share of the burst
+    for (i = 0; i < MESH_BRIDGE_COUNT; i++)
+    {
+        result |= mesh_bridge_send(&bridges[i]);
+    }
+    return result;
+}
+
+/// take a free entry of the table, NULL if all are in use
+static mesh_route_t *mesh_free_route(mesh_route_t *table)
+{
+    uint8_t i;
+
+    for (i = 0; i < MESH_MAX_ROUTES; i++)
+    {
+        if (table[i].bridge == 0)
+        {
+            return &table[i];
+        }
+    }
+    return NULL;
+}
+
+zos_result_t mesh_set_route(uint8_t first_board, uint8_t last_board, uint8_t bridge)
+{
+    mesh_route_t updated[MESH_MAX_ROUTES];
+    mesh_route_t *route;
+    uint8_t i;
+
+    if (first_board > last_board || bridge >= MESH_BRIDGE_COUNT)
+    {
+        return ZOS_ERROR;
+    }
+    /// worked out on a copy, so a table that runs out of entries is left as it was
+    memcpy(updated, routes, sizeof(updated));
+    for (i = 0; i < MESH_MAX_ROUTES; i++)
+    {
+        route = &updated[i];
+        if (route->bridge == 0 || first_board > route->last_board || last_board < route->first_board)
+        {
+            continue;
+        }
+        /// the new range takes its boards out of the route, keeping what lies on either side
+        if (route->first_board < first_board && route->last_board > last_board)
+        {
+            mesh_route_t *rest = mesh_free_route(updated);
+
+            if (rest == NULL)
+            {
+                ZOS_LOG("Failed (all %u routes in use)", MESH_MAX_ROUTES);
+                return ZOS_ERROR;
+            }
+            rest->first_board = last_board + 1;
+            rest->last_board = route->last_board;
+            rest->bridge = route->bridge;
+            route->last_board = first_board - 1;
+        }
+        else if (route->first_board < first_board)
+        {
+            route->last_board = first_board - 1;
+        }
+        else if (route->last_board > last_board)
+        {
+            route->first_board = last_board + 1;
+        }
+        else
+        {
+            route->bridge = 0;
+        }
+    }
+    if (bridge != 0)
+    {
+        route = mesh_free_route(updated);
+        if (route == NULL)
+        {
+            ZOS_LOG("Failed (all %u routes in use)", MESH_MAX_ROUTES);
+            return ZOS_ERROR;
+        }
+        route->first_board = first_board;
+        route->last_board = last_board;
+        route->bridge = bridge;
+    }
+    memcpy(routes, updated, sizeof(routes));
+    return mesh_save_routes();
+}
+
+zos_result_t mesh_get_route(uint8_t index, uint8_t *first_board, uint8_t *last_board, uint8_t *bridge)
+{
+    uint8_t i, found = 0;
+
+    for (i = 0; i < MESH_MAX_ROUTES; i++)
+    {
+        if (routes[i].bridge != 0 && found++ == index)
+        {
+            *first_board = routes[i].first_board;
+            *last_board = routes[i].last_board;
+            *bridge = routes[i].bridge;
+            return ZOS_SUCCESS;
+        }
+    }
+    return ZOS_ERROR;
+}
+
+zos_result_t mesh_get_bridge_stats(uint8_t bridge, mesh_bridge_stats_t *stats)
+{
+    if (bridge >= MESH_BRIDGE_COUNT)
+    {
+        return ZOS_ERROR;
+    }
+    stats->uart = bridges[bridge].config->uart;
+    stats->tx_frames = bridges[bridge].tx_frames;
+    stats->tx_bytes = bridges[bridge].tx_bytes;
+    stats->rx_bytes = bridges[bridge].rx_bytes;
+    stats->rx_frames = bridges[bridge].rx.frames;
+    stats->rx_errors = bridges[bridge].rx.errors;
+    return ZOS_SUCCESS;
+}
+
+/// mesh_command_cb_t for the parsers, adds to the current batch
+static int mesh_batch_add_parsed(void *context, uint8_t cmd, uint16_t arg, uint8_t order)
+{
+    return mesh_batch_add(cmd, arg, order);
+}
+
+/// at most 8 characters of the text at error, which needn't be NUL terminated
+static int mesh_error_length(const char *error, const char *end)
+{
+    return (end - error < 8) ? (int)(end - error) : 8;
+}
+
+int mesh_batch_parse_list(const char *text, size_t size)
+{
+    const char *error;
+    int count = mesh_parse_list(text, size, mesh_batch_add_parsed, NULL, &error);
+
+    if (count < 0)
+    {
+        /// a full burst buffer goes out while parsing, say what already did
+        ZOS_LOG("ERROR, bad <cmd>:<arg> at '%.*s', %u command(s) already sent",
+                mesh_error_length(error, text + size), error, batch_sent);
+    }
+    return count;
+}
+
+/// mesh_command_cb_t for C2D requests, only collects the command
+static int mesh_request_add(void *context, uint8_t cmd, uint16_t arg, uint8_t order)
+{
+    mesh_request_t *request = context;
+
+    /// a board identity only commands its own boards, the order form would reach every board
+    if (request->range != NULL && (order || arg < request->range[0] || arg > request->range[1]))
+    {
+        ZOS_LOG("Dropped cmd %u arg 0x%X, not for boards %u-%u", cmd, arg, request->range[0], request->range[1]);
+        return 0;
+    }
+    if (request->count >= MESH_MAX_REQUEST_COMMANDS)
+    {
+        return -1;
+    }
+    request->commands[request->count].cmd = cmd;
+    request->commands[request->count].arg = arg;
+    request->commands[request->count].order = order;
+    request->count += 1;
+    return 0;
+}
+
+static int mesh_parse_received(char *buffer, size_t size, const uint8_t *range)
+{
+    static mesh_request_t request;
+    const char *error;
+    uint8_t i;
+
+    /// requests are "C<cmd>B<board>" or "C<cmd>O<hex order>", several may be joined with ';'
+    /// all of it is parsed first, so a malformed request sends nothing
+    request.range = range;
+    request.count = 0;
+    if (mesh_parse_request(buffer, size, mesh_request_add, &request, &error) < 0)
+    {
+        ZOS_LOG("ERROR, %s couldn't parse '%.*s'", __func__, mesh_error_length(error, buffer + size), error);
+        return -1;
+    }
+    mesh_batch_begin();
+    for (i = 0; i < request.count; i++)
+    {
+        if (mesh_batch_add(request.commands[i].cmd, request.commands[i].arg, request.commands[i].order) != 0)
+        {
+            break;
+        }
+    }
+    if (i < request.count || mesh_batch_send() != 0)
+    {
+        ZOS_LOG("ERROR, only %u of %u command(s) reached the mesh", batch_sent, request.count);
+        return -1;
+    }
+    ZOS_LOG("Sent %u command(s) to the mesh", batch_sent);
     /// do we want to add a thread or isr that will read data back from serial, and send back to azure?
     return 0;
 }
+
+int parse_received_request(char *buffer, size_t size)
+{
+    return mesh_parse_received(buffer, size, NULL);
+}
+
+int parse_received_request_for(char *buffer, size_t size, uint8_t first_board, uint8_t last_board)
+{
+    uint8_t range[2] = { first_board, last_board };
+
+    return mesh_parse_received(buffer, size, range);
+}
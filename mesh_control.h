@@ -1,11 +1,41 @@
 /** @file This file contains the api for sending/receiving data to the mesh
+ *
+ * The module can drive several meshes, each through its own Nordic bridge
+ * on its own UART.  A routing table maps ranges of board numbers to a
+ * bridge (boards without a route use bridge 0) and is kept in the file
+ * MESH_ROUTE_FILE_NAME.  A batch is split per bridge, so every link only
+ * carries the commands for its own mesh.
  *
  * Copyright Ambient Sensors 2017
  */
 #ifndef _MESH_CONTROL_H_
 #define _MESH_CONTROL_H_
 
-/** @brief simple setup of serial port for communicating to Nordic Mesh
+#include "mesh_protocol.h"
+
+#define MESH_MAX_BRIDGES 2
+/// bridges actually wired up, add MESH_BRIDGE_COUNT=2 to $(NAME)_DEFINES for a second one on UART 2
+#ifndef MESH_BRIDGE_COUNT
+#define MESH_BRIDGE_COUNT 1
+#endif
+#define MESH_MAX_ROUTES 8
+#define MESH_ROUTE_FILE_NAME "mesh_routes.bin"
+
+#if MESH_BRIDGE_COUNT < 1 || MESH_BRIDGE_COUNT > MESH_MAX_BRIDGES
+#error MESH_BRIDGE_COUNT must be between 1 and MESH_MAX_BRIDGES
+#endif
+
+typedef struct
+{
+    zos_uart_t uart;
+    uint32_t tx_frames;
+    uint32_t tx_bytes;
+    uint32_t rx_bytes;
+    uint32_t rx_frames;
+    uint32_t rx_errors;         /// bytes skipped resyncing and frames given up
+} mesh_bridge_stats_t;
+
+/** @brief simple setup of the serial ports for communicating to the Nordic Meshes
  */
 int setup_serial_port(void);
 
@@ -13,9 +43,76 @@ int setup_serial_port(void);
  *
  *  When data is received from the wifi, figure out which commands
  *  in the mesh it pertains to, and format it for the mesh.  Then
- *  send it to the mesh.
+ *  send it to the mesh.  Several requests joined with ';' go out
+ *  to the mesh as one burst, and only once all of them parsed, so a
+ *  malformed request sends nothing.
  */
 int parse_received_request(char *buffer, size_t size);
 
+/** @brief Same as parse_received_request() for a request to a board identity
+ *
+ *  Commands for boards outside first_board..last_board, and order form
+ *  commands which reach every board, are dropped and logged.
+ */
+int parse_received_request_for(char *buffer, size_t size, uint8_t first_board, uint8_t last_board);
+
+/** @brief Transmit already encoded frames to one bridge in one write
+ */
+int mesh_send_frames(uint8_t bridge, const uint8_t *frames, uint16_t length);
+
+/** @brief Encode and send a single command to the mesh its board is routed to
+ *
+ *  With order set arg is a board order and the command goes to every mesh
+ *  (see mesh_encode_command()).
+ */
+int mesh_send_command(uint8_t cmd, uint16_t arg, uint8_t order);
+
+/** @brief Collect commands and send them to the meshes as one burst per bridge
+ *
+ *  mesh_batch_add() encodes the command into the burst buffer of the
+ *  bridge its board is routed to, sending what is queued there first if
+ *  the buffer is full.  mesh_batch_send() puts the rest on the wire.
+ */
+void mesh_batch_begin(void);
+int mesh_batch_add(uint8_t cmd, uint16_t arg, uint8_t order);
+int mesh_batch_send(void);
+
+/** @brief Add a list of "<cmd>:<arg>" commands (see mesh_parse_list()) to the current batch
+ *
+ *  Returns the number of commands added, or -1 on a malformed entry.  A
+ *  list too long for one burst is sent as it is parsed, so what came
+ *  before a malformed entry may have gone out already; the log says how
+ *  many commands did.
+ */
+int mesh_batch_parse_list(const char *text, size_t size);
+
+/** @brief Handle data that has come in from the mesh
+ *
+ *  Called by the UART poll with whatever the bridge sent since the
+ *  last poll, and by the trace replay with recorded UART data.  Frames
+ *  use the same [length][type]... layout as the commands sent to the
+ *  bridge and are reassembled across calls, sensor readings go to
+ *  telemetry_reading().
+ */
+void mesh_process_rx_data(uint8_t bridge, const uint8_t *data, uint16_t size);
+
+/** @brief Route boards first_board to last_board to a bridge
+ *
+ *  Only the boards in the range change: overlapping routes are trimmed, or
+ *  split in two around it, so 15 on bridge 0 out of 10-20 leaves 10-14 and
+ *  16-20.  Routing to bridge 0 sends the range to the default bridge.
+ *  Fails, with the table unchanged, if that takes more than
+ *  MESH_MAX_ROUTES entries.  The table is saved.
+ */
+zos_result_t mesh_set_route(uint8_t first_board, uint8_t last_board, uint8_t bridge);
+
+/** @brief Get the index'th route, ZOS_ERROR past the last one
+ */
+zos_result_t mesh_get_route(uint8_t index, uint8_t *first_board, uint8_t *last_board, uint8_t *bridge);
+
+/** @brief Traffic counters of a bridge, ZOS_ERROR if there is no such bridge
+ */
+zos_result_t mesh_get_bridge_stats(uint8_t bridge, mesh_bridge_stats_t *stats);
+
 
 #endif
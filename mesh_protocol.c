@@ -0,0 +1,191 @@
+/** @file This file contains the code for the mesh serial protocol
+ *
+ * Copyright Ambient Sensors 2017
+ */
+
+#include "mesh_protocol.h"
+
+
+uint8_t mesh_encode_command(uint8_t cmd, uint16_t arg, uint8_t order, uint8_t *frame)
+{
+    if (order)
+    {
+        frame[0] = MESH_ORDER_CMD_LENGTH - 1; /// don't include this byte in length
+        frame[1] = MESH_SERIAL_CMD;
+        frame[2] = cmd;
+        frame[3] = (arg >> 8) & 0xFF;
+        frame[4] = arg & 0xFF;
+        return MESH_ORDER_CMD_LENGTH;
+    }
+    if (arg > 0xFF)
+    {
+        return 0;
+    }
+    frame[0] = MESH_STD_BOARD_CMD_LENGTH - 1; /// don't include this byte in length
+    frame[1] = MESH_SERIAL_CMD;
+    frame[2] = cmd;
+    frame[3] = arg;
+    return MESH_STD_BOARD_CMD_LENGTH;
+}
+
+void mesh_rx_feed(mesh_rx_t *rx, const uint8_t *data, uint16_t size, uint32_t now_ms, uint32_t timeout_ms,
+                  mesh_frame_cb_t handler, void *context)
+{
+    uint16_t i;
+
+    if (rx->length > 0 && now_ms - rx->last_ms > timeout_ms)
+    {
+        rx->errors += 1;
+        rx->length = 0;
+    }
+    rx->last_ms = now_ms;
+
+    for (i = 0; i < size; i++)
+    {
+        /// frames start with the number of bytes that follow, skip bytes that can't be one
+        if (rx->length == 0 && (data[i] == 0 || data[i] >= MESH_MAX_RX_FRAME_LENGTH))
+        {
+            rx->errors += 1;
+            continue;
+        }
+        rx->frame[rx->length++] = data[i];
+        if (rx->length == rx->frame[0] + 1)
+        {
+            rx->frames += 1;
+            handler(context, rx->frame, rx->length);
+            rx->length = 0;
+        }
+    }
+}
+
+int mesh_decode_sensor(const uint8_t *frame, uint8_t length, uint8_t *board, uint8_t *metric, int16_t *value)
+{
+    if (length != MESH_SENSOR_FRAME_LENGTH || frame[1] != MESH_SERIAL_SENSOR)
+    {
+        return -1;
+    }
+    *board = frame[2];
+    *metric = frame[3];
+    *value = (int16_t)((frame[4] << 8) | frame[5]);
+    return 0;
+}
+
+/// parse an unsigned number no bigger than max, advancing *text past the digits
+static int parse_number(const char **text, const char *end, int base, uint32_t max, uint32_t *value)
+{
+    const char *p = *text;
+    uint32_t result = 0;
+    int digit;
+
+    while (p < end)
+    {
+        if (*p >= '0' && *p <= '9')
+        {
+            digit = *p - '0';
+        }
+        else if (base == 16 && *p >= 'a' && *p <= 'f')
+        {
+            digit = *p - 'a' + 10;
+        }
+        else if (base == 16 && *p >= 'A' && *p <= 'F')
+        {
+            digit = *p - 'A' + 10;
+        }
+        else
+        {
+            break;
+        }
+        /// checked before it's added up, so a long run of digits can't wrap back into range
+        if (result > (max - digit) / base)
+        {
+            return 0;
+        }
+        result = result * base + digit;
+        p++;
+    }
+    if (p == *text)
+    {
+        return 0;
+    }
+    *text = p;
+    *value = result;
+    return 1;
+}
+
+int mesh_parse_request(const char *text, size_t size, mesh_command_cb_t add, void *context, const char **error)
+{
+    const char *p = text;
+    const char *end = text + size;
+    const char *start;
+    uint32_t cmd, arg;
+    uint8_t order;
+    int count = 0;
+
+    while (p < end && *p != '\0')
+    {
+        if (*p == ';' || *p == ' ' || *p == '\r' || *p == '\n')
+        {
+            p++;
+            continue;
+        }
+        start = p;
+        if (*p++ != 'C' || !parse_number(&p, end, 10, 0xFF, &cmd) || p >= end || (*p != 'O' && *p != 'B'))
+        {
+            *error = start;
+            return -1;
+        }
+        // an order command has the parm as hex (without 0x in front), any command can take either form
+        order = (*p++ == 'O');
+        if (!parse_number(&p, end, order ? 16 : 10, order ? 0xFFFF : 0xFF, &arg) || add(context, cmd, arg, order) != 0)
+        {
+            *error = start;
+            return -1;
+        }
+        count++;
+    }
+    return count;
+}
+
+int mesh_parse_list(const char *text, size_t size, mesh_command_cb_t add, void *context, const char **error)
+{
+    const char *p = text;
+    const char *end = text + size;
+    const char *start;
+    uint32_t cmd, arg;
+    uint8_t order;
+    int count = 0;
+
+    while (p < end && *p != '\0')
+    {
+        if (*p == ',' || *p == ';' || *p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+        {
+            p++;
+            continue;
+        }
+        if (*p == '#')
+        {
+            /// comment, skip to the end of the line
+            while (p < end && *p != '\n')
+            {
+                p++;
+            }
+            continue;
+        }
+        start = p;
+        if (!parse_number(&p, end, 10, 0xFF, &cmd) || p >= end || *p != ':')
+        {
+            *error = start;
+            return -1;
+        }
+        p++;
+        /// the order command takes the board order as hex, like "cmd 6 ABCD"
+        order = (cmd == MESH_CMD_ORDER);
+        if (!parse_number(&p, end, order ? 16 : 10, order ? 0xFFFF : 0xFF, &arg) || add(context, cmd, arg, order) != 0)
+        {
+            *error = start;
+            return -1;
+        }
+        count++;
+    }
+    return count;
+}
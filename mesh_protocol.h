@@ -0,0 +1,85 @@
+/** @file This file contains the api for the mesh serial protocol
+ *
+ * How commands are encoded into frames for the Nordic bridges, how the
+ * frames the bridges send back are reassembled from the received bytes,
+ * and how commands are parsed from the text forms they arrive in (C2D
+ * requests and cmd_batch lists).
+ *
+ * Plain C without ZentriOS dependencies so a capture can be run through it
+ * on a host (tools/trace_replay.c), mesh_control.c drives the UARTs.
+ *
+ * Copyright Ambient Sensors 2017
+ */
+#ifndef _MESH_PROTOCOL_H_
+#define _MESH_PROTOCOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MESH_CMD_ORDER 6   /// set the board order, sent in the order form by the cmd and cmd_batch commands
+
+#define MESH_MAX_CMD_LENGTH 16
+#define MESH_ORDER_CMD_LENGTH 5
+#define MESH_STD_BOARD_CMD_LENGTH 4
+#define MESH_SERIAL_CMD 0x20
+/// sensor reading from a board: [len=5][0x21][board][metric][value hi][value lo], value signed
+#define MESH_SERIAL_SENSOR 0x21
+#define MESH_SENSOR_FRAME_LENGTH 6
+#define MESH_MAX_RX_FRAME_LENGTH 32
+
+/// frame being reassembled from the bytes a bridge sent
+typedef struct
+{
+    uint8_t frame[MESH_MAX_RX_FRAME_LENGTH];
+    uint8_t length;
+    uint32_t last_ms;
+    uint32_t frames;
+    uint32_t errors;            /// bytes skipped resyncing and frames given up
+} mesh_rx_t;
+
+typedef void (*mesh_frame_cb_t)(void *context, const uint8_t *frame, uint8_t length);
+
+/// called for every command parsed, returns 0 or -1 to stop the parse
+typedef int (*mesh_command_cb_t)(void *context, uint8_t cmd, uint16_t arg, uint8_t order);
+
+/** @brief Encode a mesh command straight into a serial frame
+ *
+ *  arg is the board number, or with order set a 16 bit board order in the
+ *  longer order form, which isn't for one board and goes to every mesh.
+ *  Returns the frame length, or 0 if arg doesn't fit the command.
+ */
+uint8_t mesh_encode_command(uint8_t cmd, uint16_t arg, uint8_t order, uint8_t *frame);
+
+/** @brief Reassemble frames from received bytes, calling handler for every complete one
+ *
+ *  Frames start with the number of bytes that follow.  A partial frame
+ *  older than timeout_ms when more data arrives is given up.
+ */
+void mesh_rx_feed(mesh_rx_t *rx, const uint8_t *data, uint16_t size, uint32_t now_ms, uint32_t timeout_ms,
+                  mesh_frame_cb_t handler, void *context);
+
+/** @brief Decode a sensor reading frame, returns 0 or -1 if it isn't one
+ */
+int mesh_decode_sensor(const uint8_t *frame, uint8_t length, uint8_t *board, uint8_t *metric, int16_t *value);
+
+/** @brief Parse C2D requests, "C<cmd>B<board>" or "C<cmd>O<hex order>" joined with ';'
+ *
+ *  The form is up to the request, whatever the command (C6B<board> is a
+ *  board command, C<cmd>O<hex> is encoded in the order form).  Commands
+ *  are 0-255, boards 0-255 and orders 0-FFFF.  Returns the number of
+ *  commands passed to add, or -1 with *error pointing at the text that
+ *  couldn't be parsed.
+ */
+int mesh_parse_request(const char *text, size_t size, mesh_command_cb_t add, void *context, const char **error);
+
+/** @brief Parse a list of "<cmd>:<arg>" commands
+ *
+ *  Entries are separated by commas, semicolons or whitespace and '#'
+ *  starts a comment up to the end of the line, so the same parser reads
+ *  a command line or a resource file.  MESH_CMD_ORDER takes a hex order and
+ *  is encoded in the order form, every other command takes a board.
+ *  Returns like mesh_parse_request().
+ */
+int mesh_parse_list(const char *text, size_t size, mesh_command_cb_t add, void *context, const char **error);
+
+#endif
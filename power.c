@@ -0,0 +1,133 @@
+/** @file This file contains the code for the low-power mode
+ *
+ * Copyright Ambient Sensors 2017
+ */
+
+#include "zos.h"
+#include "common.h"
+#include "power.h"
+#include "scheduler.h"
+#include "keepalive.h"
+#include "subscriptions.h"
+#include "publish.h"
+
+/// the rtos clock compares due times as a signed difference
+#define POWER_MAX_DEADLINE_MS       0x7FFFFFFFUL
+
+static zos_bool_t enabled;
+static power_account_t account;
+
+
+/// keep the nearer of two deadlines
+static void power_nearer(zos_bool_t found, uint32_t due_ms, const char *name,
+                         zos_bool_t *have, uint32_t *next_ms, const char **next_name)
+{
+    if (found && (!*have || (int32_t)(due_ms - *next_ms) < 0))
+    {
+        *have = ZOS_TRUE;
+        *next_ms = due_ms;
+        *next_name = name;
+    }
+}
+
+/// the connection is refused from the token's expiry, a new signature has to be set before then
+static zos_bool_t power_token_deadline(uint32_t now_ms, uint32_t *due_ms)
+{
+    mqtt_settings_t *settings;
+    zos_utc_time_ms_t utc_ms;
+    uint64_t expiry_ms;
+
+    ZOS_NVM_GET_REF(settings);
+    if (zn_time_get_utc_time_ms(&utc_ms) != ZOS_SUCCESS || utc_ms < MIN_SYNCED_UTC_MS)
+    {
+        return ZOS_FALSE;
+    }
+    expiry_ms = strtoul((const char*)settings->token_expiry, NULL, 10) * 1000ULL;
+    if (expiry_ms <= utc_ms)
+    {
+        return ZOS_FALSE; /// already expired, nothing left to wait for
+    }
+    *due_ms = now_ms + ((expiry_ms - utc_ms > POWER_MAX_DEADLINE_MS) ? POWER_MAX_DEADLINE_MS : expiry_ms - utc_ms);
+    return ZOS_TRUE;
+}
+
+void power_init(zos_bool_t on)
+{
+    enabled = on;
+    power_account_init(&account, zn_rtos_get_time());
+}
+
+void power_set_enabled(zos_bool_t on)
+{
+    enabled = on;
+}
+
+void power_wake(uint32_t now_ms)
+{
+    power_account_wake(&account, now_ms);
+}
+
+void power_sleep(uint32_t now_ms)
+{
+    power_account_sleep(&account, now_ms);
+}
+
+uint32_t power_next_poll(power_poll_t *poll, uint32_t received)
+{
+    uint32_t now_ms = zn_rtos_get_time();
+    uint32_t due_ms;
+    const char *name;
+
+    if (!enabled || received > 0 || !power_next_deadline(now_ms, &due_ms, &name))
+    {
+        due_ms = now_ms + POWER_POLL_MAX_MS;
+    }
+    return power_poll_next(poll, received, power_until(now_ms, due_ms), enabled);
+}
+
+zos_bool_t power_next_deadline(uint32_t now_ms, uint32_t *due_ms, const char **name)
+{
+    zos_bool_t have = ZOS_FALSE;
+    uint32_t due;
+    const char *timed_name = NULL;
+    zos_bool_t found;
+
+    found = keepalive_next_deadline(&due);
+    power_nearer(found, due, "keepalive", &have, due_ms, name);
+    found = subs_next_deadline(&due);
+    power_nearer(found, due, "suback", &have, due_ms, name);
+    found = publish_next_retransmit(&due);
+    power_nearer(found, due, "retransmit", &have, due_ms, name);
+    found = power_token_deadline(now_ms, &due);
+    power_nearer(found, due, "token_expiry", &have, due_ms, name);
+    found = sched_next_due(&due, &timed_name);
+    power_nearer(found, due, timed_name, &have, due_ms, name);
+    return have;
+}
+
+void power_get_stats(power_stats_t *stats)
+{
+    uint32_t now_ms = zn_rtos_get_time();
+    uint32_t due_ms;
+
+    stats->enabled = enabled;
+    stats->wakeups = account.wakeups;
+    stats->idle_ms = account.idle_ms;
+    stats->busy_ms = account.busy_ms;
+    /// count the stretch in progress too
+    if (account.awake)
+    {
+        stats->busy_ms += now_ms - account.changed_ms;
+    }
+    else
+    {
+        stats->idle_ms += now_ms - account.changed_ms;
+    }
+    stats->elapsed_ms = now_ms - account.since_ms;
+    stats->next_name = NULL;
+    stats->next_ms = 0;
+    if (power_next_deadline(now_ms, &due_ms, &stats->next_name))
+    {
+        stats->next_ms = power_until(now_ms, due_ms);
+    }
+}
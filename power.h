@@ -0,0 +1,64 @@
+/** @file This file contains the api for the low-power mode
+ *
+ * With mqtt.power_save set the mesh UART polls back off while the bridges
+ * are quiet and are lined up with the next deadline of the other work
+ * (see power_policy.h).  This is adaptive UART polling, not sleeping until
+ * the next deadline: without a UART receive interrupt a quiet bridge is
+ * still polled every POWER_POLL_MAX_MS, and data that arrives then waits
+ * up to that long.  zn_app_idle() still returns ZOS_TRUE: it only keeps
+ * the app loaded, the OS sleeps between events on its own.
+ *
+ * Every outermost handler accounted by the scheduler is a wakeup: the
+ * UART polls, the keepalive and SUBACK timers, the summary windows and
+ * the queued work.  The time between them is idle_ms.  The module can
+ * only sleep in that time, but the OS, the network stack and the MQTT
+ * library's own timers run in it too, so it is an upper bound on the time
+ * asleep rather than a measure of it.  Both are counted whether or not
+ * the mode is on, so the two can be compared.
+ *
+ * Copyright Ambient Sensors 2017
+ */
+#ifndef _POWER_H_
+#define _POWER_H_
+
+#include "power_policy.h"
+
+typedef struct
+{
+    zos_bool_t enabled;
+    uint32_t wakeups;
+    uint32_t idle_ms;
+    uint32_t busy_ms;
+    uint32_t elapsed_ms;        /// since the counters were started
+    const char *next_name;      /// NULL if nothing is due
+    uint32_t next_ms;           /// until the next deadline
+} power_stats_t;
+
+/** @brief Start the accounting, call once at startup
+ */
+void power_init(zos_bool_t enabled);
+
+/** @brief Turn the backoff on or off, applies from each bridge's next poll
+ */
+void power_set_enabled(zos_bool_t enabled);
+
+/** @brief Called by the scheduler around the outermost accounted handler
+ */
+void power_wake(uint32_t now_ms);
+void power_sleep(uint32_t now_ms);
+
+/** @brief Delay until a bridge's next poll, given what the last one received
+ */
+uint32_t power_next_poll(power_poll_t *poll, uint32_t received);
+
+/** @brief Find the nearest deadline of the app's work, ZOS_FALSE if none
+ *
+ *  Looks at the keepalive probe, the SUBACK timeout, the retransmit of
+ *  unacknowledged publishes, the expiry of the SAS token and the scheduler's
+ *  timed handlers (summary windows, ...).  name tells which it is.
+ */
+zos_bool_t power_next_deadline(uint32_t now_ms, uint32_t *due_ms, const char **name);
+
+void power_get_stats(power_stats_t *stats);
+
+#endif
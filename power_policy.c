@@ -0,0 +1,71 @@
+/** @file This file contains the code for the low-power polling policy
+ *
+ * Copyright Ambient Sensors 2017
+ */
+
+#include "power_policy.h"
+
+
+void power_poll_reset(power_poll_t *poll)
+{
+    poll->period_ms = POWER_POLL_MIN_MS;
+    poll->empty_polls = 0;
+}
+
+uint32_t power_poll_next(power_poll_t *poll, uint32_t received, uint32_t until_deadline_ms, int backoff)
+{
+    if (received > 0 || !backoff)
+    {
+        power_poll_reset(poll);
+        return poll->period_ms;
+    }
+    if (++poll->empty_polls >= POWER_POLL_IDLE_POLLS && poll->period_ms < POWER_POLL_MAX_MS)
+    {
+        poll->period_ms = (poll->period_ms * 2 < POWER_POLL_MAX_MS) ? poll->period_ms * 2 : POWER_POLL_MAX_MS;
+        poll->empty_polls = 0;
+    }
+    /// the module wakes for the deadline anyway, a deadline that is (nearly) due doesn't move the poll
+    if (until_deadline_ms >= POWER_POLL_MIN_MS && until_deadline_ms < poll->period_ms)
+    {
+        return until_deadline_ms;
+    }
+    return poll->period_ms;
+}
+
+void power_account_init(power_account_t *account, uint32_t now_ms)
+{
+    account->awake = 1;
+    account->changed_ms = now_ms;
+    account->since_ms = now_ms;
+    account->wakeups = 0;
+    account->idle_ms = 0;
+    account->busy_ms = 0;
+}
+
+void power_account_wake(power_account_t *account, uint32_t now_ms)
+{
+    if (account->awake)
+    {
+        return;
+    }
+    account->idle_ms += now_ms - account->changed_ms;
+    account->changed_ms = now_ms;
+    account->awake = 1;
+    account->wakeups += 1;
+}
+
+void power_account_sleep(power_account_t *account, uint32_t now_ms)
+{
+    if (!account->awake)
+    {
+        return;
+    }
+    account->busy_ms += now_ms - account->changed_ms;
+    account->changed_ms = now_ms;
+    account->awake = 0;
+}
+
+uint32_t power_until(uint32_t now_ms, uint32_t due_ms)
+{
+    return ((int32_t)(due_ms - now_ms) > 0) ? due_ms - now_ms : 0;
+}
@@ -0,0 +1,76 @@
+/** @file This file contains the api for the low-power polling policy
+ *
+ * The OS sleeps whenever no event is due, so how long the module sleeps
+ * comes down to how often the app asks to be woken.  Left alone that is the
+ * mesh UART poll, five times a second per bridge even when nothing arrives.
+ *
+ * With the policy on, a bridge that stayed quiet for POWER_POLL_IDLE_POLLS
+ * polls in a row is polled half as often, down to once every
+ * POWER_POLL_MAX_MS, and polled at the fastest rate again as soon as it
+ * sends something or is sent a command (a reply is expected).  Nothing is
+ * lost meanwhile: the UART ring buffer and CTS/RTS flow control hold the
+ * bridge back until the next poll, but what a backed off bridge sends
+ * waits up to POWER_POLL_MAX_MS for it.  A poll that would fall due after
+ * the next deadline of some other work (keepalive probe, summary window,
+ * ...) is brought forward onto it, so both run in a single wakeup.  It is
+ * never pushed back to a later deadline: the bridges are polled at least
+ * every POWER_POLL_MAX_MS, however far off the next deadline is.
+ *
+ * Wakeups and the time between them are accounted here as well.
+ *
+ * Plain C without ZentriOS dependencies so it can be built and exercised
+ * on a host (tools/power_sim.c), the app side lives in power.c.
+ *
+ * Copyright Ambient Sensors 2017
+ */
+#ifndef _POWER_POLICY_H_
+#define _POWER_POLICY_H_
+
+#include <stdint.h>
+
+#define POWER_POLL_MIN_MS           200
+#define POWER_POLL_MAX_MS           1600
+#define POWER_POLL_IDLE_POLLS       5       /// empty polls at one period before it doubles
+
+typedef struct
+{
+    uint32_t period_ms;
+    uint8_t empty_polls;
+} power_poll_t;
+
+typedef struct
+{
+    uint8_t awake;
+    uint32_t changed_ms;        /// last wakeup, or last return to idle
+    uint32_t since_ms;          /// start of the accounting
+    uint32_t wakeups;
+    uint32_t idle_ms;           /// between the app's handlers, an upper bound on the time asleep
+    uint32_t busy_ms;           /// in the app's handlers
+} power_account_t;
+
+/** @brief Poll at the fastest rate again
+ */
+void power_poll_reset(power_poll_t *poll);
+
+/** @brief Adjust the period after a poll, returns the delay to the next one
+ *
+ *  received is what the poll read.  until_deadline_ms is how long until the
+ *  next deadline of other work, the poll is brought forward onto it if that
+ *  comes first.  backoff 0 keeps the period at POWER_POLL_MIN_MS.
+ */
+uint32_t power_poll_next(power_poll_t *poll, uint32_t received, uint32_t until_deadline_ms, int backoff);
+
+/** @brief Start accounting at now_ms, awake
+ */
+void power_account_init(power_account_t *account, uint32_t now_ms);
+
+/** @brief Note that the app started handling an event, or has finished with it
+ */
+void power_account_wake(power_account_t *account, uint32_t now_ms);
+void power_account_sleep(power_account_t *account, uint32_t now_ms);
+
+/** @brief Milliseconds from now_ms until due_ms, 0 if it has passed
+ */
+uint32_t power_until(uint32_t now_ms, uint32_t due_ms);
+
+#endif
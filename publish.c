@@ -0,0 +1,337 @@
+/** @file This file contains the code for publishing caller-owned buffers
+ *
+ * Copyright Ambient Sensors 2017
+ */
+
+#include "zos.h"
+#include "common.h"
+#include "publish.h"
+#include "scheduler.h"
+#include "app_memory.h"
+#include "lz_compress.h"
+
+#define PUBLISH_ENCODING_PROPERTY   "%24.ce=" LZ_CONTENT_ENCODING
+
+typedef struct
+{
+    mqtt_connection_t *connection;
+    mqtt_msgid_t msgid;
+    uint32_t sent_ms;
+    publish_complete_cb_t complete;
+    void *context;
+} publish_inflight_t;
+
+static publish_inflight_t inflight[PUBLISH_MAX_INFLIGHT];
+static uint16_t compress_threshold;
+static publish_compress_stats_t compress_stats;
+/// the gathered copy of a segmented publish, held like a caller's buffer until its completion
+static struct
+{
+    uint8_t *buffer;
+    publish_complete_cb_t complete;
+    void *context;
+} gather;
+/// the compressed copy of a publish, held the same way
+static struct
+{
+    uint8_t *block;
+    publish_complete_cb_t complete;
+    void *context;
+} compressed;
+
+
+static publish_inflight_t *publish_find_slot(mqtt_connection_t *connection, mqtt_msgid_t msgid)
+{
+    uint8_t i;
+
+    for (i = 0; i < PUBLISH_MAX_INFLIGHT; i++)
+    {
+        if (inflight[i].msgid == msgid && (msgid == 0 || inflight[i].connection == connection))
+        {
+            return &inflight[i];
+        }
+    }
+    return NULL;
+}
+
+/// publish_complete_cb_t for a gathered publish, releases the copy and passes the result on
+static void publish_gather_complete(void *context, zos_result_t result)
+{
+    app_mem_free(APP_MEM_GATHER, 0, gather.buffer);
+    gather.buffer = NULL;
+    if (gather.complete != NULL)
+    {
+        gather.complete(gather.context, result);
+    }
+}
+
+/// publish_complete_cb_t for a compressed publish
+static void publish_compressed_complete(void *context, zos_result_t result)
+{
+    app_mem_free(APP_MEM_COMPRESS, 0, compressed.block);
+    compressed.block = NULL;
+    if (compressed.complete != NULL)
+    {
+        compressed.complete(compressed.context, result);
+    }
+}
+
+/// topic with the content encoding added to its property bag, ZOS_FALSE if it won't fit
+static zos_bool_t publish_encoded_topic(const char *topic, char *encoded, uint32_t size)
+{
+    const char *properties = strstr(topic, PUBLISH_TELEMETRY_TOPIC) + sizeof(PUBLISH_TELEMETRY_TOPIC) - 1;
+    uint32_t length = strlen(topic);
+
+    if (length + sizeof(PUBLISH_ENCODING_PROPERTY) + 1 > size)
+    {
+        return ZOS_FALSE;
+    }
+    memcpy(encoded, topic, length);
+    /// property bag is url encoded key=value pairs joined by '&'
+    if (*properties != 0)
+    {
+        encoded[length++] = '&';
+    }
+    memcpy(&encoded[length], PUBLISH_ENCODING_PROPERTY, sizeof(PUBLISH_ENCODING_PROPERTY));
+    return ZOS_TRUE;
+}
+
+/// compress telemetry over the threshold into the compress block, ZOS_FALSE if it should go out raw
+static zos_bool_t publish_compress(const char *topic, const uint8_t *data, uint32_t length,
+                                   char *encoded_topic, uint32_t encoded_size, uint32_t *compressed_length)
+{
+    if (compress_threshold == 0 || length < compress_threshold || strstr(topic, PUBLISH_TELEMETRY_TOPIC) == NULL)
+    {
+        return ZOS_FALSE;
+    }
+    /// a block still held for an earlier compressed publish makes this one go out raw
+    if (compressed.block != NULL ||
+        publish_encoded_topic(topic, encoded_topic, encoded_size) == ZOS_FALSE ||
+        (compressed.block = app_mem_alloc(APP_MEM_COMPRESS, 0, APP_COMPRESS_SIZE)) == NULL)
+    {
+        compress_stats.skipped += 1;
+        return ZOS_FALSE;
+    }
+
+    *compressed_length = lz_compress(data, length, &compressed.block[sizeof(lz_state_t)],
+                                     APP_COMPRESS_SIZE - sizeof(lz_state_t), (lz_state_t*)compressed.block);
+    if (*compressed_length == 0)
+    {
+        compress_stats.skipped += 1;
+        app_mem_free(APP_MEM_COMPRESS, 0, compressed.block);
+        compressed.block = NULL;
+        return ZOS_FALSE;
+    }
+    return ZOS_TRUE;
+}
+
+mqtt_msgid_t publish_buffer(const char *topic, const uint8_t *data, uint32_t length, uint8_t qos,
+                            publish_complete_cb_t complete, void *context)
+{
+    return publish_buffer_on(mqtt_connection, topic, data, length, qos, complete, context);
+}
+
+mqtt_msgid_t publish_buffer_on(mqtt_connection_t *connection, const char *topic, const uint8_t *data,
+                               uint32_t length, uint8_t qos, publish_complete_cb_t complete, void *context)
+{
+    char encoded_topic[MAX_TOPIC_STRING_SIZE + sizeof(PUBLISH_ENCODING_PROPERTY) + 1];
+    publish_inflight_t *slot = NULL;
+    uint32_t compressed_length = 0;
+    mqtt_msgid_t pktid;
+
+    if ((connection == NULL) || (connection->net_init_ok != ZOS_TRUE))
+    {
+        ZOS_LOG("Not connected, can't publish to '%s'", topic);
+        return 0;
+    }
+    if (length > MAX_PUBLISH_PAYLOAD_SIZE)
+    {
+        ZOS_LOG("Failed (maximum payload size is %u)", MAX_PUBLISH_PAYLOAD_SIZE);
+        return 0;
+    }
+    if (qos != MQTT_QOS_DELIVER_AT_MOST_ONCE && complete != NULL)
+    {
+        /// reserve the slot first, it's too late once the packet is on the wire
+        slot = publish_find_slot(NULL, 0);
+        if (slot == NULL)
+        {
+            ZOS_LOG("Failed (%u publishes already waiting for an ack)", PUBLISH_MAX_INFLIGHT);
+            return 0;
+        }
+    }
+
+    SCHED_STACK_SAMPLE();
+    /// the compressed block is held until the publish completes, which at QoS 1 takes a slot
+    if ((slot != NULL || qos == MQTT_QOS_DELIVER_AT_MOST_ONCE || publish_find_slot(NULL, 0) != NULL) &&
+        publish_compress(topic, data, length, encoded_topic, sizeof(encoded_topic), &compressed_length))
+    {
+        if (slot == NULL && qos != MQTT_QOS_DELIVER_AT_MOST_ONCE)
+        {
+            slot = publish_find_slot(NULL, 0);
+        }
+        compressed.complete = complete;
+        compressed.context = context;
+        complete = publish_compressed_complete;
+        context = NULL;
+        app_mem_network_packet(ZOS_TRUE, strlen(encoded_topic) + compressed_length);
+        ZOS_LOG("Publishing %u bytes (%u compressed) to topic: '%s'", length, compressed_length, encoded_topic);
+        pktid = mqtt_publish(connection, (uint8_t*)encoded_topic, &compressed.block[sizeof(lz_state_t)],
+                             compressed_length, qos);
+        if (pktid == 0)
+        {
+            /// a failed send is the caller's to retry, sending it again raw would make two attempts
+            app_mem_free(APP_MEM_COMPRESS, 0, compressed.block);
+            compressed.block = NULL;
+        }
+        else
+        {
+            compress_stats.messages += 1;
+            compress_stats.raw_bytes += length;
+            compress_stats.sent_bytes += compressed_length;
+        }
+    }
+    else
+    {
+        app_mem_network_packet(ZOS_TRUE, strlen(topic) + length);
+        ZOS_LOG("Publishing %u bytes to topic: '%s'", length, topic);
+        pktid = mqtt_publish(connection, (uint8_t*)topic, (uint8_t*)data, length, qos);
+    }
+    if (pktid == 0)
+    {
+        ZOS_LOG("Error publishing: packet ID = 0");
+        return 0;
+    }
+
+    if (slot != NULL)
+    {
+        slot->connection = connection;
+        slot->msgid = pktid;
+        slot->sent_ms = zn_rtos_get_time();
+        slot->complete = complete;
+        slot->context = context;
+    }
+    else if (complete != NULL)
+    {
+        complete(context, ZOS_SUCCESS);
+    }
+    return pktid;
+}
+
+mqtt_msgid_t publish_segments(const char *topic, const publish_segment_t *segments, uint8_t count,
+                              uint8_t qos, publish_complete_cb_t complete, void *context)
+{
+    uint32_t total = 0;
+    zos_bool_t contiguous = ZOS_TRUE;
+    mqtt_msgid_t pktid;
+    uint8_t i;
+
+    if (count == 0 || count > PUBLISH_MAX_SEGMENTS)
+    {
+        return 0;
+    }
+    for (i = 0; i < count; i++)
+    {
+        if (i > 0 && segments[i].data != segments[i-1].data + segments[i-1].length)
+        {
+            contiguous = ZOS_FALSE;
+        }
+        total += segments[i].length;
+    }
+    if (contiguous)
+    {
+        return publish_buffer(topic, segments[0].data, total, qos, complete, context);
+    }
+    if (total > MAX_PUBLISH_PAYLOAD_SIZE)
+    {
+        ZOS_LOG("Failed (maximum payload size is %u)", MAX_PUBLISH_PAYLOAD_SIZE);
+        return 0;
+    }
+
+    /// the MQTT library wants one buffer, so scattered segments have to be gathered
+    /// and, as it may resend from that buffer, the copy lives until the publish completes
+    if (gather.buffer != NULL)
+    {
+        ZOS_LOG("Failed (a gathered publish is already waiting for an ack)");
+        return 0;
+    }
+    gather.buffer = app_mem_alloc(APP_MEM_GATHER, 0, total);
+    if (gather.buffer == NULL)
+    {
+        ZOS_LOG("Failed to allocate %u bytes to gather segments", total);
+        return 0;
+    }
+    total = 0;
+    for (i = 0; i < count; i++)
+    {
+        memcpy(&gather.buffer[total], segments[i].data, segments[i].length);
+        total += segments[i].length;
+    }
+    gather.complete = complete;
+    gather.context = context;
+    /// QoS 0 completes before publish_buffer() returns, QoS 1 on the ack or the disconnect
+    pktid = publish_buffer(topic, gather.buffer, total, qos, publish_gather_complete, NULL);
+    if (pktid == 0)
+    {
+        app_mem_free(APP_MEM_GATHER, 0, gather.buffer);
+        gather.buffer = NULL;
+    }
+    return pktid;
+}
+
+void publish_set_compress_threshold(uint16_t threshold)
+{
+    compress_threshold = threshold;
+}
+
+void publish_get_compress_stats(publish_compress_stats_t *stats)
+{
+    *stats = compress_stats;
+}
+
+void publish_acknowledged(mqtt_connection_t *connection, mqtt_msgid_t msgid)
+{
+    publish_inflight_t *slot;
+
+    if (msgid == 0 || (slot = publish_find_slot(connection, msgid)) == NULL)
+    {
+        return;
+    }
+    slot->msgid = 0;
+    slot->complete(slot->context, ZOS_SUCCESS);
+}
+
+zos_bool_t publish_next_retransmit(uint32_t *due_ms)
+{
+    mqtt_settings_t *settings;
+    zos_bool_t found = ZOS_FALSE;
+    uint8_t i;
+
+    /// the library resends what isn't acknowledged when its PINGRESP comes in,
+    /// and it pings at the latest one keepalive after the packet went out (never without one)
+    ZOS_NVM_GET_REF(settings);
+    for (i = 0; i < PUBLISH_MAX_INFLIGHT && settings->keepalive != 0; i++)
+    {
+        uint32_t due = inflight[i].sent_ms + settings->keepalive * 1000UL;
+
+        if (inflight[i].msgid != 0 && (!found || (int32_t)(due - *due_ms) < 0))
+        {
+            *due_ms = due;
+            found = ZOS_TRUE;
+        }
+    }
+    return found;
+}
+
+void publish_abort_all(mqtt_connection_t *connection)
+{
+    uint8_t i;
+
+    for (i = 0; i < PUBLISH_MAX_INFLIGHT; i++)
+    {
+        if (inflight[i].msgid != 0 && inflight[i].connection == connection)
+        {
+            inflight[i].msgid = 0;
+            inflight[i].complete(inflight[i].context, ZOS_ERROR);
+        }
+    }
+}
@@ -0,0 +1,93 @@
+/** @file This file contains the api for publishing caller-owned buffers
+ *
+ * The payload is handed to the MQTT library straight from the caller's
+ * buffer, no copy is made into the global message string, and it may be
+ * binary and up to MAX_PUBLISH_PAYLOAD_SIZE bytes long.  The caller keeps
+ * ownership of the buffer until the completion callback runs:
+ *  - QoS 0: as soon as the publish has been handed to the network
+ *  - QoS 1: when the broker acknowledges it, or the connection drops
+ *
+ * Telemetry (devices/<id>/messages/events/) at or above the compression
+ * threshold is LZ compressed (see lz_compress.h) when that makes it smaller,
+ * and the content encoding is added to the topic's property bag ($.ce=lzss)
+ * so the backend knows to decode it.  There is room for the compressed
+ * copy of any payload up to MAX_PUBLISH_PAYLOAD_SIZE, so every publish over
+ * the threshold that shrinks is sent compressed.  The copy is held like the
+ * caller's buffer until the publish completes, a publish over the threshold
+ * meanwhile goes out raw.
+ *
+ * Copyright Ambient Sensors 2017
+ */
+#ifndef _PUBLISH_H_
+#define _PUBLISH_H_
+
+#define PUBLISH_MAX_INFLIGHT        4
+#define PUBLISH_MAX_SEGMENTS        8
+#define PUBLISH_TELEMETRY_TOPIC     "/messages/events/"
+
+typedef struct
+{
+    uint32_t messages;          /// publishes sent compressed
+    uint32_t skipped;           /// over the threshold but sent raw (didn't shrink, no memory, block still held)
+    uint32_t raw_bytes;         /// payload bytes of the compressed publishes before compression
+    uint32_t sent_bytes;        /// and after
+} publish_compress_stats_t;
+
+typedef struct
+{
+    const uint8_t *data;
+    uint32_t length;
+} publish_segment_t;
+
+/** @brief Called once the buffer(s) passed to a publish may be released
+ *
+ *  result is ZOS_SUCCESS when the message was delivered (QoS 0: sent),
+ *  ZOS_ERROR when the connection dropped before it was acknowledged.
+ */
+typedef void (*publish_complete_cb_t)(void *context, zos_result_t result);
+
+/** @brief Publish a single caller-owned buffer
+ *
+ *  Returns the packet id, or 0 on failure in which case complete is NOT
+ *  called and the caller still owns the buffer.
+ */
+mqtt_msgid_t publish_buffer(const char *topic, const uint8_t *data, uint32_t length, uint8_t qos,
+                            publish_complete_cb_t complete, void *context);
+
+/** @brief Same as publish_buffer() on another connection (gateway identities)
+ */
+mqtt_msgid_t publish_buffer_on(mqtt_connection_t *connection, const char *topic, const uint8_t *data,
+                               uint32_t length, uint8_t qos, publish_complete_cb_t complete, void *context);
+
+/** @brief Publish a message made of several caller-owned segments
+ *
+ *  Segments that follow each other in memory go out without being copied.
+ *  Otherwise they are gathered into the app's gather block, which is held
+ *  like a caller's buffer until complete runs (the segments themselves can
+ *  be released as soon as this returns).  Only one gathered publish can wait
+ *  for its ack at a time.
+ */
+mqtt_msgid_t publish_segments(const char *topic, const publish_segment_t *segments, uint8_t count,
+                              uint8_t qos, publish_complete_cb_t complete, void *context);
+
+/** @brief Compress telemetry payloads of at least threshold bytes, 0 turns compression off
+ */
+void publish_set_compress_threshold(uint16_t threshold);
+
+/** @brief Get the compression counters
+ */
+void publish_get_compress_stats(publish_compress_stats_t *stats);
+
+/** @brief Complete the publish with the given packet id (call on MQTT_EVENT_TYPE_PUBLISHED)
+ */
+void publish_acknowledged(mqtt_connection_t *connection, mqtt_msgid_t msgid);
+
+/** @brief When the oldest unacknowledged publish is due to be resent, ZOS_FALSE if none is waiting
+ */
+zos_bool_t publish_next_retransmit(uint32_t *due_ms);
+
+/** @brief Fail every publish on the connection still waiting for an acknowledgement (call on disconnect)
+ */
+void publish_abort_all(mqtt_connection_t *connection);
+
+#endif
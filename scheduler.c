@@ -0,0 +1,479 @@
+/** @file This file contains the code for the prioritized event scheduler
+ *
+ * Copyright Ambient Sensors 2017
+ */
+
+#include "zos.h"
+#include "scheduler.h"
+#include "power.h"
+
+/// retry of a dispatch the OS event queue had no room for
+#define SCHED_DISPATCH_RETRY_MS     10
+
+typedef struct
+{
+    const char *name;
+    zos_event_handler_t handler;
+    void *arg;
+    uint32_t issued_ms;
+    uint32_t deadline_ms;       /// relative to issued_ms, SCHED_NO_DEADLINE if none
+} sched_item_t;
+
+typedef struct
+{
+    sched_item_t items[SCHED_QUEUE_SIZE];
+    uint8_t count;
+} sched_queue_t;
+
+typedef struct
+{
+    const char *name;
+    zos_event_handler_t handler;
+    void *arg;
+    uint32_t period_ms;         /// 0 for a one-shot registered with sched_register_timed()
+    uint32_t due_ms;
+    zos_bool_t armed;
+} sched_periodic_t;
+
+typedef struct
+{
+    sched_item_t item;          /// issued_ms is when it was first issued
+    sched_priority_t priority;
+} sched_retry_t;
+
+static sched_queue_t queues[SCHED_PRIORITY_COUNT];
+static sched_stats_t stats[SCHED_MAX_HANDLERS];
+static sched_periodic_t periodic[SCHED_MAX_PERIODIC];
+static sched_retry_t retries[SCHED_MAX_RETRIES];
+static uint32_t retry_due_ms;
+static zos_bool_t dispatch_pending;
+/// lowest stack address sampled since the innermost sched_account_begin()
+static uintptr_t stack_low;
+/// frames open, the app is idle between the outermost ones
+static uint8_t depth;
+
+
+static sched_stats_t *sched_find_stats(const char *name)
+{
+    uint8_t i;
+
+    for (i = 0; i < SCHED_MAX_HANDLERS; i++)
+    {
+        if (stats[i].name == NULL)
+        {
+            stats[i].name = name;
+            return &stats[i];
+        }
+        if (stats[i].name == name || strcmp(stats[i].name, name) == 0)
+        {
+            return &stats[i];
+        }
+    }
+    return NULL;
+}
+
+void sched_stack_sample(void)
+{
+    volatile uint8_t marker;
+    uintptr_t sp = (uintptr_t)&marker;
+
+    if (sp < stack_low)
+    {
+        stack_low = sp;
+    }
+}
+
+void sched_account_begin(sched_frame_t *frame)
+{
+    volatile uint8_t marker;
+
+    frame->start_ms = zn_rtos_get_time();
+    frame->stack_base = (uintptr_t)&marker;
+    frame->outer_stack_low = stack_low;
+    stack_low = frame->stack_base;
+    if (depth++ == 0)
+    {
+        power_wake(frame->start_ms);
+    }
+}
+
+void sched_account_end(sched_frame_t *frame, const char *name, uint32_t late_ms)
+{
+    sched_stats_t *entry = sched_find_stats(name);
+    uint32_t now_ms = zn_rtos_get_time();
+    uint32_t runtime_ms = now_ms - frame->start_ms;
+    uint32_t stack = frame->stack_base - stack_low;
+
+    if (depth > 0 && --depth == 0)
+    {
+        power_sleep(now_ms);
+    }
+    /// what this handler used counts for the one it is nested in too
+    if (frame->outer_stack_low != 0 && frame->outer_stack_low < stack_low)
+    {
+        stack_low = frame->outer_stack_low;
+    }
+    if (entry == NULL)
+    {
+        return;
+    }
+    entry->runs += 1;
+    entry->total_ms += runtime_ms;
+    if (runtime_ms > entry->max_ms)
+    {
+        entry->max_ms = runtime_ms;
+    }
+    if (stack > entry->max_stack)
+    {
+        entry->max_stack = stack;
+    }
+    if (late_ms > 0)
+    {
+        entry->late += 1;
+        if (late_ms > entry->max_late_ms)
+        {
+            entry->max_late_ms = late_ms;
+        }
+    }
+}
+
+void sched_run_accounted(const char *name, zos_event_handler_t handler, void *arg)
+{
+    sched_frame_t frame;
+
+    sched_account_begin(&frame);
+    handler(arg);
+    sched_account_end(&frame, name, 0);
+}
+
+/// pop the next item: highest class first, nearest deadline first within a class
+static zos_bool_t sched_pop(sched_item_t *item)
+{
+    sched_queue_t *queue;
+    uint8_t priority, i, best;
+
+    for (priority = 0; priority < SCHED_PRIORITY_COUNT; priority++)
+    {
+        queue = &queues[priority];
+        if (queue->count == 0)
+        {
+            continue;
+        }
+        best = 0;
+        for (i = 1; i < queue->count; i++)
+        {
+            const sched_item_t *a = &queue->items[i];
+            const sched_item_t *b = &queue->items[best];
+
+            if (a->deadline_ms != SCHED_NO_DEADLINE &&
+                (b->deadline_ms == SCHED_NO_DEADLINE ||
+                 (int32_t)((a->issued_ms + a->deadline_ms) - (b->issued_ms + b->deadline_ms)) < 0))
+            {
+                best = i;
+            }
+        }
+        *item = queue->items[best];
+        /// keep issue order for the remaining items
+        memmove(&queue->items[best], &queue->items[best + 1], (queue->count - best - 1) * sizeof(sched_item_t));
+        queue->count -= 1;
+        return ZOS_TRUE;
+    }
+    return ZOS_FALSE;
+}
+
+static void sched_dispatch(void *arg);
+
+/// make sure a dispatch is on its way while items are queued
+static void sched_kick(void)
+{
+    zos_bool_t queued = ZOS_FALSE;
+    uint8_t priority;
+
+    for (priority = 0; priority < SCHED_PRIORITY_COUNT; priority++)
+    {
+        if (queues[priority].count > 0)
+        {
+            queued = ZOS_TRUE;
+        }
+    }
+    if (dispatch_pending || !queued)
+    {
+        return;
+    }
+    if (zn_event_issue(sched_dispatch, NULL, 0) == ZOS_SUCCESS)
+    {
+        dispatch_pending = ZOS_TRUE;
+    }
+    /// the OS event queue is full, the timer doesn't need a slot in it until it fires
+    else if (zn_event_register_timed(sched_dispatch, NULL, SCHED_DISPATCH_RETRY_MS, 0) == ZOS_SUCCESS)
+    {
+        dispatch_pending = ZOS_TRUE;
+    }
+    else
+    {
+        /// the next item issued tries again
+        ZOS_LOG("ERROR, %s couldn't issue a dispatch", __func__);
+    }
+}
+
+static void sched_dispatch(void *arg)
+{
+    sched_item_t item;
+    sched_frame_t frame;
+    uint32_t late_ms = 0;
+
+    dispatch_pending = ZOS_FALSE;
+    if (sched_pop(&item))
+    {
+        sched_account_begin(&frame);
+        if (item.deadline_ms != SCHED_NO_DEADLINE && frame.start_ms - item.issued_ms > item.deadline_ms)
+        {
+            late_ms = frame.start_ms - item.issued_ms - item.deadline_ms;
+        }
+        item.handler(item.arg);
+        sched_account_end(&frame, item.name, late_ms);
+    }
+
+    /// one item per event so other events get a turn in between
+    sched_kick();
+}
+
+static zos_bool_t sched_enqueue(const sched_item_t *item, sched_priority_t priority)
+{
+    sched_queue_t *queue = &queues[priority];
+
+    if (queue->count >= SCHED_QUEUE_SIZE)
+    {
+        return ZOS_FALSE;
+    }
+    queue->items[queue->count++] = *item;
+    sched_kick();
+    return ZOS_TRUE;
+}
+
+zos_result_t sched_issue(const char *name, zos_event_handler_t handler, void *arg,
+                         sched_priority_t priority, uint32_t deadline_ms)
+{
+    const sched_item_t item = { name, handler, arg, zn_rtos_get_time(), deadline_ms };
+
+    if (!sched_enqueue(&item, priority))
+    {
+        ZOS_LOG("ERROR, %s queue %u full, dropping %s", __func__, priority, name);
+        return ZOS_ERROR;
+    }
+    return ZOS_SUCCESS;
+}
+
+static void sched_retry_handler(void *arg)
+{
+    zos_bool_t waiting = ZOS_FALSE;
+    uint8_t i;
+
+    for (i = 0; i < SCHED_MAX_RETRIES; i++)
+    {
+        if (retries[i].item.handler == NULL)
+        {
+            continue;
+        }
+        if (sched_enqueue(&retries[i].item, retries[i].priority))
+        {
+            retries[i].item.handler = NULL;
+        }
+        else
+        {
+            waiting = ZOS_TRUE;
+        }
+    }
+    /// picks up a dispatch that couldn't be issued at all
+    sched_kick();
+    if (waiting)
+    {
+        retry_due_ms = zn_rtos_get_time() + SCHED_RETRY_MS;
+        zn_event_register_timed(sched_retry_handler, NULL, SCHED_RETRY_MS, 0);
+    }
+}
+
+zos_result_t sched_issue_retry(const char *name, zos_event_handler_t handler, void *arg,
+                               sched_priority_t priority, uint32_t deadline_ms)
+{
+    const sched_item_t item = { name, handler, arg, zn_rtos_get_time(), deadline_ms };
+    sched_retry_t *free_retry = NULL;
+    zos_bool_t armed = ZOS_FALSE;
+    uint8_t i;
+
+    if (sched_enqueue(&item, priority))
+    {
+        return ZOS_SUCCESS;
+    }
+    for (i = 0; i < SCHED_MAX_RETRIES; i++)
+    {
+        if (retries[i].item.handler == handler && retries[i].item.arg == arg)
+        {
+            return ZOS_SUCCESS; /// already waiting
+        }
+        if (retries[i].item.handler != NULL)
+        {
+            armed = ZOS_TRUE;
+        }
+        else if (free_retry == NULL)
+        {
+            free_retry = &retries[i];
+        }
+    }
+    if (free_retry == NULL)
+    {
+        ZOS_LOG("ERROR, %s no room to retry %s", __func__, name);
+        return ZOS_ERROR;
+    }
+    ZOS_LOG("%s queue %u full, retrying %s", __func__, priority, name);
+    free_retry->item = item;
+    free_retry->priority = priority;
+    if (!armed)
+    {
+        retry_due_ms = item.issued_ms + SCHED_RETRY_MS;
+        zn_event_register_timed(sched_retry_handler, NULL, SCHED_RETRY_MS, 0);
+    }
+    return ZOS_SUCCESS;
+}
+
+static void sched_periodic_trampoline(void *arg)
+{
+    sched_periodic_t *entry = arg;
+
+    if (entry->period_ms != 0)
+    {
+        entry->due_ms = zn_rtos_get_time() + entry->period_ms;
+    }
+    else
+    {
+        entry->armed = ZOS_FALSE;
+    }
+    sched_run_accounted(entry->name, entry->handler, entry->arg);
+}
+
+/// the handler's slot, unregistered, or a free one
+static sched_periodic_t *sched_claim_slot(const char *name, zos_event_handler_t handler, void *arg)
+{
+    uint8_t i;
+
+    for (i = 0; i < SCHED_MAX_PERIODIC; i++)
+    {
+        if (periodic[i].handler == handler && periodic[i].arg == arg)
+        {
+            zn_event_unregister(sched_periodic_trampoline, &periodic[i]);
+            return &periodic[i];
+        }
+    }
+    for (i = 0; i < SCHED_MAX_PERIODIC; i++)
+    {
+        if (periodic[i].handler == NULL)
+        {
+            periodic[i].name = name;
+            periodic[i].handler = handler;
+            periodic[i].arg = arg;
+            return &periodic[i];
+        }
+    }
+    ZOS_LOG("ERROR, %s no room for %s", __func__, name);
+    return NULL;
+}
+
+zos_result_t sched_register_periodic(const char *name, zos_event_handler_t handler, void *arg,
+                                     uint32_t period_ms, uint32_t flags)
+{
+    sched_periodic_t *entry = sched_claim_slot(name, handler, arg);
+
+    if (entry == NULL)
+    {
+        return ZOS_ERROR;
+    }
+    entry->name = name;
+    entry->period_ms = period_ms;
+    entry->due_ms = zn_rtos_get_time() + period_ms;
+    entry->armed = ZOS_TRUE;
+    return zn_event_register_periodic(sched_periodic_trampoline, entry, period_ms, flags);
+}
+
+zos_result_t sched_register_timed(const char *name, zos_event_handler_t handler, void *arg, uint32_t delay_ms)
+{
+    sched_periodic_t *entry = sched_claim_slot(name, handler, arg);
+
+    if (entry == NULL)
+    {
+        return ZOS_ERROR;
+    }
+    entry->name = name;
+    entry->period_ms = 0;
+    entry->due_ms = zn_rtos_get_time() + delay_ms;
+    entry->armed = ZOS_TRUE;
+    return zn_event_register_timed(sched_periodic_trampoline, entry, delay_ms, 0);
+}
+
+void sched_unregister_periodic(zos_event_handler_t handler, void *arg)
+{
+    uint8_t i;
+
+    for (i = 0; i < SCHED_MAX_PERIODIC; i++)
+    {
+        if (periodic[i].handler == handler && periodic[i].arg == arg)
+        {
+            zn_event_unregister(sched_periodic_trampoline, &periodic[i]);
+            periodic[i].handler = NULL;
+            periodic[i].armed = ZOS_FALSE;
+        }
+    }
+}
+
+zos_bool_t sched_next_due(uint32_t *due_ms, const char **name)
+{
+    const sched_periodic_t *next = NULL;
+    uint8_t i;
+
+    for (i = 0; i < SCHED_MAX_PERIODIC; i++)
+    {
+        if (periodic[i].handler != NULL && periodic[i].armed &&
+            (next == NULL || (int32_t)(periodic[i].due_ms - next->due_ms) < 0))
+        {
+            next = &periodic[i];
+        }
+    }
+    for (i = 0; i < SCHED_MAX_RETRIES; i++)
+    {
+        if (retries[i].item.handler != NULL && (next == NULL || (int32_t)(retry_due_ms - next->due_ms) < 0))
+        {
+            *due_ms = retry_due_ms;
+            *name = retries[i].item.name;
+            return ZOS_TRUE;
+        }
+    }
+    if (next == NULL)
+    {
+        return ZOS_FALSE;
+    }
+    *due_ms = next->due_ms;
+    *name = next->name;
+    return ZOS_TRUE;
+}
+
+zos_result_t sched_get_stats(uint8_t index, sched_stats_t *out)
+{
+    if (index >= SCHED_MAX_HANDLERS || stats[index].name == NULL)
+    {
+        return ZOS_ERROR;
+    }
+    *out = stats[index];
+    return ZOS_SUCCESS;
+}
+
+void sched_reset_stats(void)
+{
+    uint8_t i;
+
+    for (i = 0; i < SCHED_MAX_HANDLERS; i++)
+    {
+        /// keep the names so the table order stays stable
+        const char *name = stats[i].name;
+        memset(&stats[i], 0, sizeof(stats[i]));
+        stats[i].name = name;
+    }
+}
@@ -0,0 +1,125 @@
+/** @file This file contains the api for the prioritized event scheduler
+ *
+ * A thin layer over zn_event_issue().  Work is queued per priority class
+ * and run one item per ZentriOS event, so periodic OS events such as the
+ * UART poll get a turn between every item instead of waiting for a whole
+ * backlog.  Within a class the item with the nearest deadline runs first,
+ * items without a deadline run in the order they were issued.
+ *
+ * Every handler run through the scheduler (and every periodic or timed
+ * handler registered with sched_register_periodic/sched_register_timed) is
+ * accounted: run count, total and maximum runtime, how often it started
+ * after its deadline, and the deepest stack seen at the SCHED_STACK_SAMPLE()
+ * points it passed through.  That is a lower bound: frames below the
+ * deepest sample point (library calls in particular) aren't seen, so leave
+ * margin when sizing a stack from it.  The outermost accounted handler also tells
+ * power.c when the app wakes up and goes idle again.
+ *
+ * Copyright Ambient Sensors 2017
+ */
+#ifndef _SCHEDULER_H_
+#define _SCHEDULER_H_
+
+#define SCHED_QUEUE_SIZE            8       /// pending items per priority class
+#define SCHED_MAX_HANDLERS          16      /// distinct handlers that are accounted
+/// summary and latency windows, a UART poll per bridge, three keepalive timers, the SUBACK timeout, replay
+#define SCHED_MAX_PERIODIC          12
+#define SCHED_MAX_RETRIES           4       /// items that must not be lost waiting for room in their class
+#define SCHED_RETRY_MS              250
+#define SCHED_NO_DEADLINE           0
+
+typedef enum
+{
+    SCHED_PRIORITY_HIGH,        /// time sensitive, e.g. forwarding frames to the mesh
+    SCHED_PRIORITY_NORMAL,      /// publish, subscribe, ...
+    SCHED_PRIORITY_LOW,         /// slow work that may block, e.g. the TLS connect
+    SCHED_PRIORITY_COUNT
+} sched_priority_t;
+
+typedef struct
+{
+    const char *name;
+    uint32_t runs;
+    uint32_t total_ms;
+    uint32_t max_ms;
+    uint32_t late;              /// runs that started after their deadline
+    uint32_t max_late_ms;
+    uint32_t max_stack;         /// bytes below the handler's entry at the deepest sample (a lower bound), 0 if none was hit
+} sched_stats_t;
+
+/// filled in by sched_account_begin(), frames nest
+typedef struct
+{
+    uint32_t start_ms;
+    uintptr_t stack_base;
+    uintptr_t outer_stack_low;
+} sched_frame_t;
+
+/// note the stack depth here for the handler being accounted, put it in the deepest functions
+#define SCHED_STACK_SAMPLE()    sched_stack_sample()
+
+/** @brief Queue a handler to run at the given priority
+ *
+ *  deadline_ms is a hint, relative to now, of when the handler should have
+ *  started (SCHED_NO_DEADLINE for none).  Use the SCHED_ISSUE() macro so the
+ *  handler is accounted under its own name.
+ */
+zos_result_t sched_issue(const char *name, zos_event_handler_t handler, void *arg,
+                         sched_priority_t priority, uint32_t deadline_ms);
+
+#define SCHED_ISSUE(handler, arg, priority, deadline_ms) \
+    sched_issue(#handler, handler, arg, priority, deadline_ms)
+
+/** @brief Queue a handler that must not be lost to a full queue, e.g. a reconnect
+ *
+ *  Same as sched_issue(), but when the class is full the item is kept and
+ *  issued again every SCHED_RETRY_MS until it gets in.  An item that is
+ *  already waiting (same handler and arg) isn't kept twice.  Fails only if
+ *  all SCHED_MAX_RETRIES are waiting already.
+ */
+zos_result_t sched_issue_retry(const char *name, zos_event_handler_t handler, void *arg,
+                               sched_priority_t priority, uint32_t deadline_ms);
+
+#define SCHED_ISSUE_RETRY(handler, arg, priority, deadline_ms) \
+    sched_issue_retry(#handler, handler, arg, priority, deadline_ms)
+
+/** @brief Register a periodic handler that is accounted like scheduled ones
+ */
+zos_result_t sched_register_periodic(const char *name, zos_event_handler_t handler, void *arg,
+                                     uint32_t period_ms, uint32_t flags);
+
+/** @brief Run a handler once after delay_ms, accounted like scheduled ones
+ *
+ *  It takes one of the SCHED_MAX_PERIODIC slots until unregistered, so a
+ *  handler can re-arm itself with a new delay every time it runs.
+ */
+zos_result_t sched_register_timed(const char *name, zos_event_handler_t handler, void *arg, uint32_t delay_ms);
+
+/** @brief Unregister a handler registered with sched_register_periodic or sched_register_timed
+ */
+void sched_unregister_periodic(zos_event_handler_t handler, void *arg);
+
+/** @brief Find the periodic or timed handler (or item retry) that runs next, ZOS_FALSE if none is armed
+ */
+zos_bool_t sched_next_due(uint32_t *due_ms, const char **name);
+
+/** @brief Run a handler now and account its runtime under name
+ */
+void sched_run_accounted(const char *name, zos_event_handler_t handler, void *arg);
+
+/** @brief Account a callback the OS invokes directly, call begin on entry and end on exit
+ */
+void sched_account_begin(sched_frame_t *frame);
+void sched_account_end(sched_frame_t *frame, const char *name, uint32_t late_ms);
+
+void sched_stack_sample(void);
+
+/** @brief Get the statistics of the index'th accounted handler, ZOS_ERROR past the last one
+ */
+zos_result_t sched_get_stats(uint8_t index, sched_stats_t *stats);
+
+/** @brief Clear all statistics
+ */
+void sched_reset_stats(void);
+
+#endif
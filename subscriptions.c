@@ -0,0 +1,337 @@
+/** @file This file contains the code for the subscription table
+ *
+ * Copyright Ambient Sensors 2017
+ */
+
+#include "zos.h"
+#include "common.h"
+#include "scheduler.h"
+#include "subscriptions.h"
+
+typedef struct
+{
+    char topic[MAX_TOPIC_STRING_SIZE+1];
+    uint8_t qos;
+} subs_saved_t;
+
+typedef struct
+{
+    zos_bool_t in_use;
+    zos_bool_t saved;
+    char topic[MAX_TOPIC_STRING_SIZE+1];
+    uint8_t qos;
+    subs_status_t status;
+    mqtt_msgid_t msgid;
+    uint32_t sent_ms;
+    uint16_t rtt_ms;
+    uint32_t failures;
+} subs_entry_t;
+
+/// entry 0 is the devicebound topic, filled in from the settings at init and every restore
+static subs_entry_t entries[SUBS_MAX_ENTRIES];
+static uint32_t restore_start_ms;
+static uint32_t ready_ms;
+
+static void subs_timeout_handler(void *arg);
+
+
+static void subs_set_devicebound(void)
+{
+    mqtt_settings_t *settings;
+
+    ZOS_NVM_GET_REF(settings);
+    snprintf(entries[0].topic, sizeof(entries[0].topic), "devices/%s/messages/devicebound/#", settings->device);
+    entries[0].qos = settings->qos;
+}
+
+static zos_bool_t subs_connected(void)
+{
+    return (mqtt_connection != NULL) && (mqtt_connection->net_init_ok == ZOS_TRUE);
+}
+
+static zos_result_t subs_save(void)
+{
+    subs_saved_t saved[SUBS_MAX_ENTRIES - 1];
+    zos_file_t file_info;
+    uint32_t handle;
+    zos_result_t result;
+    uint8_t i;
+
+    memset(saved, 0, sizeof(saved));
+    for (i = 1; i < SUBS_MAX_ENTRIES; i++)
+    {
+        if (entries[i].in_use && entries[i].saved)
+        {
+            strcpy(saved[i - 1].topic, entries[i].topic);
+            saved[i - 1].qos = entries[i].qos;
+        }
+    }
+
+    memset(&file_info, 0, sizeof(file_info));
+    strcpy(file_info.name, SUBS_FILE_NAME);
+    file_info.size = sizeof(saved);
+    file_info.type = FILE_TYPE_MISC_FIX_LEN;
+
+    zn_file_delete(SUBS_FILE_NAME);
+    if (zn_file_create(&file_info, &handle) != ZOS_SUCCESS)
+    {
+        ZOS_LOG("ERROR, failed to create %s", SUBS_FILE_NAME);
+        return ZOS_ERROR;
+    }
+    result = zn_file_write(handle, saved, sizeof(saved));
+    zn_file_close(handle);
+    return result;
+}
+
+static void subs_send(subs_entry_t *entry)
+{
+    entry->sent_ms = zn_rtos_get_time();
+    entry->msgid = mqtt_subscribe(mqtt_connection, (uint8_t*)entry->topic, entry->qos);
+    if (entry->msgid == 0)
+    {
+        ZOS_LOG("Error subscribing to '%s'", entry->topic);
+        entry->status = SUBS_STATUS_FAILED;
+        entry->failures += 1;
+        return;
+    }
+    entry->status = SUBS_STATUS_PENDING;
+    sched_register_timed("subs_timeout_handler", subs_timeout_handler, NULL, SUBS_ACK_TIMEOUT_MS);
+}
+
+static void subs_timeout_handler(void *arg)
+{
+    uint8_t i;
+
+    for (i = 0; i < SUBS_MAX_ENTRIES; i++)
+    {
+        if (entries[i].in_use && entries[i].status == SUBS_STATUS_PENDING &&
+            zn_rtos_get_time() - entries[i].sent_ms >= SUBS_ACK_TIMEOUT_MS)
+        {
+            ZOS_LOG("No SUBACK for '%s'", entries[i].topic);
+            entries[i].status = SUBS_STATUS_FAILED;
+            entries[i].failures += 1;
+        }
+    }
+}
+
+static subs_entry_t *subs_find(const char *topic)
+{
+    uint8_t i;
+
+    for (i = 0; i < SUBS_MAX_ENTRIES; i++)
+    {
+        if (entries[i].in_use && strcmp(entries[i].topic, topic) == 0)
+        {
+            return &entries[i];
+        }
+    }
+    return NULL;
+}
+
+void subs_init(void)
+{
+    subs_saved_t saved[SUBS_MAX_ENTRIES - 1];
+    uint32_t handle, bytes_read;
+    uint8_t i;
+
+    entries[0].in_use = ZOS_TRUE;
+    subs_set_devicebound();
+    if (zn_file_open(SUBS_FILE_NAME, &handle) != ZOS_SUCCESS)
+    {
+        return; /// nothing saved
+    }
+    if (zn_file_read(handle, saved, sizeof(saved), &bytes_read) != ZOS_SUCCESS)
+    {
+        bytes_read = 0;
+    }
+    zn_file_close(handle);
+
+    for (i = 0; i < SUBS_MAX_ENTRIES - 1 && (i + 1) * sizeof(saved[0]) <= bytes_read; i++)
+    {
+        if (saved[i].topic[0] != '\0')
+        {
+            saved[i].topic[sizeof(saved[i].topic) - 1] = '\0';
+            entries[i + 1].in_use = ZOS_TRUE;
+            entries[i + 1].saved = ZOS_TRUE;
+            entries[i + 1].qos = saved[i].qos;
+            strcpy(entries[i + 1].topic, saved[i].topic);
+        }
+    }
+}
+
+zos_result_t subs_add(const char *topic, uint8_t qos, zos_bool_t save)
+{
+    subs_entry_t *entry = subs_find(topic);
+    uint8_t i;
+
+    if (strlen(topic) > MAX_TOPIC_STRING_SIZE)
+    {
+        ZOS_LOG("Failed (maximum topic length is %u)", MAX_TOPIC_STRING_SIZE);
+        return ZOS_ERROR;
+    }
+    for (i = 1; entry == NULL && i < SUBS_MAX_ENTRIES; i++)
+    {
+        if (!entries[i].in_use)
+        {
+            entry = &entries[i];
+            memset(entry, 0, sizeof(*entry));
+            strcpy(entry->topic, topic);
+            entry->in_use = ZOS_TRUE;
+        }
+    }
+    if (entry == NULL)
+    {
+        ZOS_LOG("Failed (all %u subscriptions in use)", SUBS_MAX_ENTRIES);
+        return ZOS_ERROR;
+    }
+
+    entry->qos = qos;
+    if (save && entry != &entries[0])
+    {
+        entry->saved = ZOS_TRUE;
+        subs_save();
+    }
+    if (subs_connected())
+    {
+        subs_send(entry);
+    }
+    return ZOS_SUCCESS;
+}
+
+zos_result_t subs_remove(const char *topic)
+{
+    subs_entry_t *entry = subs_find(topic);
+
+    if (entry == &entries[0])
+    {
+        ZOS_LOG("Failed (the devicebound topic can't be removed)");
+        return ZOS_ERROR;
+    }
+    if (subs_connected() && mqtt_unsubscribe(mqtt_connection, (uint8_t*)topic) == 0)
+    {
+        ZOS_LOG("Error unsubscribing from '%s'", topic);
+    }
+    if (entry != NULL)
+    {
+        entry->in_use = ZOS_FALSE;
+        if (entry->saved)
+        {
+            subs_save();
+        }
+    }
+    return ZOS_SUCCESS;
+}
+
+void subs_restore(void *arg)
+{
+    uint8_t i;
+
+    SCHED_STACK_SAMPLE();
+    /// the device id or qos may have been changed since the last connect
+    subs_set_devicebound();
+
+    restore_start_ms = zn_rtos_get_time();
+    ready_ms = 0;
+    for (i = 0; i < SUBS_MAX_ENTRIES && subs_connected(); i++)
+    {
+        if (entries[i].in_use)
+        {
+            subs_send(&entries[i]);
+        }
+    }
+}
+
+zos_bool_t subs_acknowledged(mqtt_msgid_t msgid)
+{
+    subs_entry_t *entry = NULL;
+    uint32_t rtt_ms;
+    uint8_t i;
+
+    for (i = 0; msgid != 0 && i < SUBS_MAX_ENTRIES; i++)
+    {
+        if (entries[i].in_use && entries[i].status == SUBS_STATUS_PENDING && entries[i].msgid == msgid)
+        {
+            entry = &entries[i];
+            break;
+        }
+    }
+    if (entry == NULL)
+    {
+        return ZOS_FALSE;
+    }
+
+    rtt_ms = zn_rtos_get_time() - entry->sent_ms;
+    entry->rtt_ms = (rtt_ms > 0xFFFF) ? 0xFFFF : rtt_ms;
+    entry->status = SUBS_STATUS_ACKED;
+    ZOS_LOG("Subscribed to '%s' (%ums)", entry->topic, rtt_ms);
+
+    for (i = 0; i < SUBS_MAX_ENTRIES; i++)
+    {
+        if (entries[i].in_use && entries[i].status == SUBS_STATUS_PENDING)
+        {
+            return ZOS_TRUE;
+        }
+    }
+    sched_unregister_periodic(subs_timeout_handler, NULL);
+    if (ready_ms == 0)
+    {
+        ready_ms = zn_rtos_get_time() - restore_start_ms;
+    }
+    return ZOS_TRUE;
+}
+
+void subs_disconnected(void)
+{
+    uint8_t i;
+
+    sched_unregister_periodic(subs_timeout_handler, NULL);
+    for (i = 0; i < SUBS_MAX_ENTRIES; i++)
+    {
+        entries[i].status = SUBS_STATUS_IDLE;
+        entries[i].msgid = 0;
+    }
+}
+
+zos_result_t subs_get_entry(uint8_t index, subs_entry_info_t *info)
+{
+    uint8_t i, found = 0;
+
+    for (i = 0; i < SUBS_MAX_ENTRIES; i++)
+    {
+        if (entries[i].in_use && found++ == index)
+        {
+            info->topic = entries[i].topic;
+            info->qos = entries[i].qos;
+            info->saved = entries[i].saved;
+            info->status = entries[i].status;
+            info->rtt_ms = entries[i].rtt_ms;
+            info->failures = entries[i].failures;
+            return ZOS_SUCCESS;
+        }
+    }
+    return ZOS_ERROR;
+}
+
+zos_bool_t subs_next_deadline(uint32_t *due_ms)
+{
+    zos_bool_t found = ZOS_FALSE;
+    uint8_t i;
+
+    for (i = 0; i < SUBS_MAX_ENTRIES; i++)
+    {
+        uint32_t due = entries[i].sent_ms + SUBS_ACK_TIMEOUT_MS;
+
+        if (entries[i].in_use && entries[i].status == SUBS_STATUS_PENDING &&
+            (!found || (int32_t)(due - *due_ms) < 0))
+        {
+            *due_ms = due;
+            found = ZOS_TRUE;
+        }
+    }
+    return found;
+}
+
+uint32_t subs_ready_time(void)
+{
+    return ready_ms;
+}
@@ -0,0 +1,78 @@
+/** @file This file contains the api for the subscription table
+ *
+ * Every topic the module subscribes to is kept in a table, entry 0 being
+ * the device's own devicebound topic, so the subscriptions can be restored
+ * after every reconnect instead of being lost.  Entries added with 'save'
+ * are also kept in the file SUBS_FILE_NAME and survive a reboot.
+ *
+ * The MQTT library only puts one topic in a SUBSCRIBE, so the restore sends
+ * one per entry back to back without waiting for the SUBACKs in between:
+ * the whole table costs one round trip rather than one per topic.  The
+ * SUBACK (or its absence after SUBS_ACK_TIMEOUT_MS) is tracked per entry.
+ *
+ * Copyright Ambient Sensors 2017
+ */
+#ifndef _SUBSCRIPTIONS_H_
+#define _SUBSCRIPTIONS_H_
+
+#define SUBS_MAX_ENTRIES            8
+#define SUBS_FILE_NAME              "subs.bin"
+#define SUBS_ACK_TIMEOUT_MS         10000
+
+typedef enum
+{
+    SUBS_STATUS_IDLE,           /// not subscribed on this connection yet
+    SUBS_STATUS_PENDING,        /// SUBSCRIBE sent, waiting for the SUBACK
+    SUBS_STATUS_ACKED,
+    SUBS_STATUS_FAILED,         /// couldn't be sent, or no SUBACK in time
+} subs_status_t;
+
+typedef struct
+{
+    const char *topic;
+    uint8_t qos;
+    zos_bool_t saved;
+    subs_status_t status;
+    uint16_t rtt_ms;            /// SUBSCRIBE to SUBACK, last time it was acked
+    uint32_t failures;
+} subs_entry_info_t;
+
+/** @brief Load the saved entries, call once at startup
+ */
+void subs_init(void);
+
+/** @brief Add a topic (or update its qos) and subscribe to it now if connected
+ *
+ *  save keeps the entry in flash so it is restored after a reboot too.
+ */
+zos_result_t subs_add(const char *topic, uint8_t qos, zos_bool_t save);
+
+/** @brief Remove a topic from the table and unsubscribe from it if connected
+ */
+zos_result_t subs_remove(const char *topic);
+
+/** @brief Subscribe to every entry in one burst (event handler, issue once connected)
+ */
+void subs_restore(void *arg);
+
+/** @brief Check a SUBACK against the table, ZOS_TRUE if it answered one of its entries
+ */
+zos_bool_t subs_acknowledged(mqtt_msgid_t msgid);
+
+/** @brief Forget the per-connection state, call on disconnect
+ */
+void subs_disconnected(void);
+
+/** @brief Get the index'th entry, ZOS_ERROR past the end of the table
+ */
+zos_result_t subs_get_entry(uint8_t index, subs_entry_info_t *info);
+
+/** @brief When the first SUBACK still outstanding times out, ZOS_FALSE if none is
+ */
+zos_bool_t subs_next_deadline(uint32_t *due_ms);
+
+/** @brief Milliseconds from the last restore to its last SUBACK, 0 while still waiting
+ */
+uint32_t subs_ready_time(void);
+
+#endif
@@ -0,0 +1,173 @@
+/** @file This file contains the code for uploading mesh sensor readings
+ *
+ * Copyright Ambient Sensors 2017
+ */
+
+#include "zos.h"
+#include "common.h"
+#include "publish.h"
+#include "scheduler.h"
+#include "gateway.h"
+#include "aggregate.h"
+#include "telemetry.h"
+
+typedef struct
+{
+    zos_bool_t busy;
+    char data[TELEMETRY_PASS_SIZE];
+} telemetry_pass_t;
+
+static agg_t agg;
+/// published straight from here, so busy until the publish completes
+static char summary[AGG_SUMMARY_SIZE];
+static zos_bool_t summary_busy;
+static telemetry_pass_t pass_slots[TELEMETRY_PASS_SLOTS];
+static uint16_t window_s;
+static uint32_t window_start_ms;
+static telemetry_stats_t stats;
+
+
+static zos_result_t telemetry_save_thresholds(void)
+{
+    zos_file_t file_info;
+    uint32_t handle;
+    zos_result_t result;
+
+    memset(&file_info, 0, sizeof(file_info));
+    strcpy(file_info.name, TELEMETRY_FILE_NAME);
+    file_info.size = sizeof(agg.thresholds);
+    file_info.type = FILE_TYPE_MISC_FIX_LEN;
+
+    zn_file_delete(TELEMETRY_FILE_NAME);
+    if (zn_file_create(&file_info, &handle) != ZOS_SUCCESS)
+    {
+        ZOS_LOG("ERROR, failed to create %s", TELEMETRY_FILE_NAME);
+        return ZOS_ERROR;
+    }
+    result = zn_file_write(handle, agg.thresholds, sizeof(agg.thresholds));
+    zn_file_close(handle);
+    return result;
+}
+
+static void telemetry_summary_sent(void *context, zos_result_t result)
+{
+    summary_busy = ZOS_FALSE;
+}
+
+static void telemetry_pass_sent(void *context, zos_result_t result)
+{
+    ((telemetry_pass_t*)context)->busy = ZOS_FALSE;
+}
+
+static void telemetry_window_handler(void *arg)
+{
+    mqtt_settings_t *settings;
+    char summary_topic[MAX_TOPIC_STRING_SIZE+1];
+    uint32_t length;
+
+    if (summary_busy)
+    {
+        /// the last summary is still waiting for its ack, keep folding into this window
+        stats.summary_failures += 1;
+        return;
+    }
+    length = agg_format_summary(&agg, (zn_rtos_get_time() - window_start_ms) / 1000, summary, sizeof(summary));
+    if (length > 0)
+    {
+        ZOS_NVM_GET_REF(settings);
+        snprintf(summary_topic, sizeof(summary_topic), "devices/%s/messages/events/", settings->device);
+        summary_busy = ZOS_TRUE;
+        if (publish_buffer(summary_topic, (uint8_t*)summary, length, settings->qos, telemetry_summary_sent, NULL) == 0)
+        {
+            summary_busy = ZOS_FALSE;
+            stats.summary_failures += 1;
+            return;
+        }
+        stats.summaries += 1;
+    }
+
+    agg_next_window(&agg);
+    window_start_ms = zn_rtos_get_time();
+}
+
+void telemetry_init(uint16_t window)
+{
+    uint32_t handle, bytes_read;
+
+    agg_init(&agg);
+    if (zn_file_open(TELEMETRY_FILE_NAME, &handle) == ZOS_SUCCESS)
+    {
+        if (zn_file_read(handle, agg.thresholds, sizeof(agg.thresholds), &bytes_read) != ZOS_SUCCESS ||
+            bytes_read != sizeof(agg.thresholds))
+        {
+            memset(agg.thresholds, 0, sizeof(agg.thresholds));
+        }
+        zn_file_close(handle);
+    }
+    telemetry_start(window);
+}
+
+void telemetry_start(uint16_t window)
+{
+    sched_unregister_periodic(telemetry_window_handler, NULL);
+    window_s = window;
+    window_start_ms = zn_rtos_get_time();
+    if (window_s > 0)
+    {
+        sched_register_periodic("telemetry_window_handler", telemetry_window_handler, NULL, window_s * 1000UL, 0);
+    }
+}
+
+void telemetry_reading(uint8_t board, uint8_t metric, int16_t value)
+{
+    telemetry_pass_t *slot = NULL;
+    uint32_t length;
+    uint8_t i;
+
+    if (window_s == 0 || !agg_add(&agg, board, metric, value))
+    {
+        return;
+    }
+
+    for (i = 0; i < TELEMETRY_PASS_SLOTS; i++)
+    {
+        if (!pass_slots[i].busy)
+        {
+            slot = &pass_slots[i];
+            break;
+        }
+    }
+    if (slot == NULL)
+    {
+        stats.pass_dropped += 1;
+        return;
+    }
+    length = snprintf(slot->data, sizeof(slot->data), "{\"board\":%u,\"metric\":%u,\"value\":%d}",
+                      board, metric, value);
+    slot->busy = ZOS_TRUE;
+    if (gateway_publish_for_board(board, (uint8_t*)slot->data, length, telemetry_pass_sent, slot) == 0)
+    {
+        slot->busy = ZOS_FALSE;
+        stats.pass_dropped += 1;
+        return;
+    }
+    stats.passed_through += 1;
+}
+
+zos_result_t telemetry_set_threshold(uint8_t metric, int16_t low, int16_t high)
+{
+    if (agg_set_threshold(&agg, metric, low, high) != 0)
+    {
+        ZOS_LOG("Failed (all %u thresholds in use)", AGG_MAX_THRESHOLDS);
+        return ZOS_ERROR;
+    }
+    return telemetry_save_thresholds();
+}
+
+void telemetry_get_stats(telemetry_stats_t *out)
+{
+    stats.window_readings = agg.readings;
+    stats.window_dropped = agg.dropped;
+    stats.series = agg.used;
+    *out = stats;
+}
@@ -0,0 +1,48 @@
+/** @file This file contains the api for uploading mesh sensor readings
+ *
+ * Readings decoded from the mesh bridges are aggregated per board and
+ * metric (see aggregate.h) and one summary is published as telemetry every
+ * mqtt.agg_window seconds, instead of a message per reading.  Readings that
+ * cross a threshold set with agg_threshold are also published right away,
+ * under the identity their board is routed to.  The thresholds are kept in
+ * the file TELEMETRY_FILE_NAME.
+ *
+ * Copyright Ambient Sensors 2017
+ */
+#ifndef _TELEMETRY_H_
+#define _TELEMETRY_H_
+
+#define TELEMETRY_FILE_NAME         "agg.bin"
+#define TELEMETRY_PASS_SLOTS        4       /// raw readings waiting for their publish to complete
+#define TELEMETRY_PASS_SIZE         64
+
+typedef struct
+{
+    uint32_t summaries;
+    uint32_t summary_failures;  /// couldn't publish, the window was extended
+    uint32_t passed_through;
+    uint32_t pass_dropped;      /// crossed a threshold but no slot or publish failed
+    uint32_t window_readings;
+    uint32_t window_dropped;    /// no free series this window
+    uint8_t series;
+} telemetry_stats_t;
+
+/** @brief Load the thresholds and start the windows, call once at startup
+ */
+void telemetry_init(uint16_t window_s);
+
+/** @brief Publish a summary every window_s seconds (0 stops aggregating, readings are ignored)
+ */
+void telemetry_start(uint16_t window_s);
+
+/** @brief Hand a reading decoded from a mesh frame to the aggregation
+ */
+void telemetry_reading(uint8_t board, uint8_t metric, int16_t value);
+
+/** @brief Pass readings of a metric above high or below low through raw, low > high clears them
+ */
+zos_result_t telemetry_set_threshold(uint8_t metric, int16_t low, int16_t high);
+
+void telemetry_get_stats(telemetry_stats_t *stats);
+
+#endif
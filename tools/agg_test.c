@@ -0,0 +1,182 @@
+/** @file Host test of the windowed aggregation
+ *
+ * Exercises aggregate.c the way telemetry.c drives it: readings folded
+ * into series, windows rolled over, threshold crossings flagged only on
+ * the edge, a full series table and a summary that doesn't fit its buffer.
+ *
+ *   cc -O2 -I.. -o agg_test agg_test.c ../aggregate.c
+ *   ./agg_test
+ *
+ * Prints every failed check and exits non-zero if there was one.
+ *
+ * Copyright Ambient Sensors 2017
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "aggregate.h"
+
+static int checks;
+static int failures;
+
+#define CHECK(condition) test_check((condition), #condition, __LINE__)
+
+
+static void test_check(int ok, const char *text, int line)
+{
+    checks += 1;
+    if (!ok)
+    {
+        failures += 1;
+        printf("FAILED line %d: %s\n", line, text);
+    }
+}
+
+static const agg_series_t *test_series(const agg_t *agg, uint8_t board, uint8_t metric)
+{
+    uint8_t i;
+
+    for (i = 0; i < agg->used; i++)
+    {
+        if (agg->series[i].board == board && agg->series[i].metric == metric)
+        {
+            return &agg->series[i];
+        }
+    }
+    return NULL;
+}
+
+static void test_add(void)
+{
+    static agg_t agg;
+    const agg_series_t *series;
+
+    agg_init(&agg);
+    agg_add(&agg, 1, 2, 10);
+    agg_add(&agg, 1, 2, -5);
+    agg_add(&agg, 1, 2, 40);
+    agg_add(&agg, 3, 2, 7);
+    series = test_series(&agg, 1, 2);
+    CHECK(agg.used == 2);
+    CHECK(agg.readings == 4);
+    CHECK(series != NULL && series->count == 3);
+    CHECK(series != NULL && series->min == -5 && series->max == 40 && series->last == 40);
+    CHECK(series != NULL && series->total == 45);
+}
+
+static void test_next_window(void)
+{
+    static agg_t agg;
+    const agg_series_t *series;
+
+    agg_init(&agg);
+    agg_add(&agg, 1, 0, 5);
+    agg_add(&agg, 2, 0, 6);
+    agg_next_window(&agg);
+    CHECK(agg.used == 2);
+    CHECK(agg.readings == 0 && agg.dropped == 0);
+    series = test_series(&agg, 1, 0);
+    CHECK(series != NULL && series->count == 0 && series->total == 0 && series->carried_over);
+    CHECK(series != NULL && series->last == 5);
+
+    /// only board 1 reports, board 2 is idle for a whole window and gives its slot back
+    agg_add(&agg, 1, 0, 8);
+    agg_next_window(&agg);
+    CHECK(agg.used == 1);
+    CHECK(test_series(&agg, 1, 0) != NULL && test_series(&agg, 2, 0) == NULL);
+}
+
+static void test_threshold(void)
+{
+    static agg_t agg;
+
+    agg_init(&agg);
+    CHECK(agg_set_threshold(&agg, 4, -10, 100) == 0);
+    CHECK(agg_add(&agg, 1, 4, 50) == 0);       /// inside
+    CHECK(agg_add(&agg, 1, 4, 150) == 1);      /// crosses high
+    CHECK(agg_add(&agg, 1, 4, 160) == 0);      /// stays above, no new edge
+    CHECK(agg_add(&agg, 1, 4, 20) == 0);       /// back inside
+    CHECK(agg_add(&agg, 1, 4, -20) == 1);      /// crosses low
+    CHECK(agg_add(&agg, 1, 4, -30) == 0);
+    CHECK(agg_add(&agg, 2, 4, 200) == 1);      /// a new series that starts out above
+    CHECK(agg_add(&agg, 1, 5, 1000) == 0);     /// no threshold for the metric
+
+    /// the last value is carried over, so staying above across a window isn't a new edge
+    agg_next_window(&agg);
+    CHECK(agg_add(&agg, 2, 4, 210) == 0);
+
+    /// low > high clears it
+    CHECK(agg_set_threshold(&agg, 4, 1, 0) == 0);
+    CHECK(agg_add(&agg, 3, 4, 500) == 0);
+}
+
+static void test_full_table(void)
+{
+    static agg_t agg;
+    int crossed = 0;
+    uint16_t board;
+
+    agg_init(&agg);
+    agg_set_threshold(&agg, 1, 0, 10);
+    for (board = 0; board < AGG_MAX_SERIES; board++)
+    {
+        agg_add(&agg, board, 1, 5);
+    }
+    CHECK(agg.used == AGG_MAX_SERIES && agg.dropped == 0);
+
+    /// readings for series that don't fit are counted and never flagged, however far out they are
+    for (board = AGG_MAX_SERIES; board < AGG_MAX_SERIES + 10; board++)
+    {
+        crossed += agg_add(&agg, board, 1, 50);
+        crossed += agg_add(&agg, board, 1, 60);
+    }
+    CHECK(crossed == 0);
+    CHECK(agg.dropped == 20);
+    CHECK(agg.readings == AGG_MAX_SERIES + 20);
+
+    /// the tracked series still get their edges
+    CHECK(agg_add(&agg, 0, 1, 50) == 1);
+}
+
+static void test_summary(void)
+{
+    static agg_t agg;
+    static char buffer[AGG_SUMMARY_SIZE];
+    char small[64];
+    uint32_t length;
+    uint16_t board;
+
+    agg_init(&agg);
+    CHECK(agg_format_summary(&agg, 60, buffer, sizeof(buffer)) == 0);   /// nothing read
+
+    agg_add(&agg, 1, 2, 10);
+    agg_add(&agg, 1, 2, 20);
+    length = agg_format_summary(&agg, 60, buffer, sizeof(buffer));
+    CHECK(length == strlen(buffer));
+    CHECK(strcmp(buffer, "{\"window_s\":60,\"readings\":2,\"dropped\":0,\"series\":[{\"board\":1,\"metric\":2,"
+                         "\"count\":2,\"min\":10,\"max\":20,\"mean\":15,\"last\":20}]}") == 0);
+
+    /// a full table at the widest values still fits AGG_SUMMARY_SIZE
+    agg_init(&agg);
+    for (board = 0; board < AGG_MAX_SERIES; board++)
+    {
+        agg_add(&agg, 200 + board % 50, 255 - board, -32768);
+        agg_add(&agg, 200 + board % 50, 255 - board, -32767);
+    }
+    length = agg_format_summary(&agg, 4294967295U, buffer, sizeof(buffer));
+    CHECK(length > 0 && length == strlen(buffer) && length < sizeof(buffer));
+
+    /// truncated output is refused rather than handed back cut off
+    CHECK(agg_format_summary(&agg, 60, small, sizeof(small)) == 0);
+}
+
+int main(void)
+{
+    test_add();
+    test_next_window();
+    test_threshold();
+    test_full_table();
+    test_summary();
+    printf("%d checks, %d failed\n", checks, failures);
+    return (failures > 0) ? 1 : 0;
+}
@@ -0,0 +1,215 @@
+/** @file Host benchmark for the telemetry compressor
+ *
+ * Runs lz_compress() over recorded mesh traffic and reports, for a range of
+ * publish sizes, the compression ratio and the cost in cycles per byte, to
+ * pick mqtt.compress_threshold.  Every block is decompressed again and
+ * compared, so a codec bug fails the run.
+ *
+ * The output buffer is what the firmware has: APP_COMPRESS_SIZE less the
+ * hash table, room for the largest publish.  Blocks that don't shrink go
+ * out raw and are counted at their full size, so the ratio is the one the
+ * module will actually get.
+ *
+ * Input is a capture made with trace_start (the UART_IN records, i.e. what the
+ * mesh reports, are concatenated in order) or any other file taken as is.
+ *
+ *   cc -O2 -I.. -o lz_bench lz_bench.c ../lz_compress.c
+ *   ./lz_bench mesh.trc [uart_in|uart_out|mqtt_in]
+ *
+ * Cycles are read from the TSC on x86 hosts and are only a relative guide for
+ * the module's MCU, wall time per byte is reported alongside.
+ *
+ * Copyright Ambient Sensors 2017
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_HAVE_TSC
+#endif
+
+/// traffic_trace.h only needs these from zos.h
+typedef int zos_result_t;
+typedef int zos_bool_t;
+#include "traffic_trace.h"
+#include "lz_compress.h"
+
+#define BENCH_MIN_ROUNDS    64
+#define BENCH_OUT_SIZE      (16*1024)   /// APP_COMPRESS_SIZE in app_memory.h less the hash table
+
+
+static uint64_t bench_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t bench_cycles(void)
+{
+#ifdef BENCH_HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static uint8_t *load_file(const char *name, uint32_t *size)
+{
+    FILE *f = fopen(name, "rb");
+    uint8_t *data;
+    long length;
+
+    if (f == NULL)
+    {
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    length = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data = malloc(length > 0 ? length : 1);
+    if (data != NULL && fread(data, 1, length, f) != (size_t)length)
+    {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    *size = length;
+    return data;
+}
+
+/// pull the payloads of one record type out of a trace, in place, returns the new length
+static uint32_t extract_trace(uint8_t *data, uint32_t size, uint8_t type)
+{
+    trace_file_header_t header;
+    uint32_t in = sizeof(header), out = 0, records = 0;
+
+    /// payloads are moved down over the headers, so take a copy first
+    memcpy(&header, data, sizeof(header));
+    if (header.record_header_size < sizeof(trace_record_header_t))
+    {
+        return 0;
+    }
+    while (in + header.record_header_size <= size)
+    {
+        trace_record_header_t record;
+        const uint8_t *payload;
+        uint32_t length;
+
+        memcpy(&record, &data[in], sizeof(record));
+        in += header.record_header_size;
+        if (in + record.length > size)
+        {
+            break;
+        }
+        payload = &data[in];
+        length = record.length;
+        in += record.length;
+        if (record.type != type)
+        {
+            continue;
+        }
+        if (type == TRACE_EVENT_MQTT_IN && length >= 2)
+        {
+            /// skip the topic, keep the message
+            uint16_t topic_len = payload[0] | (payload[1] << 8);
+            uint32_t skip = ((uint32_t)topic_len + 2 < length) ? (uint32_t)topic_len + 2 : length;
+
+            payload += skip;
+            length -= skip;
+        }
+        memmove(&data[out], payload, length);
+        out += length;
+        records++;
+    }
+    printf("%u records, %u payload bytes\n", records, out);
+    return out;
+}
+
+int main(int argc, char *argv[])
+{
+    static const uint32_t block_sizes[] = { 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384 };
+    static uint8_t compressed[BENCH_OUT_SIZE], check[16*1024];
+    lz_state_t state;
+    uint8_t *data;
+    uint32_t size, i;
+    uint8_t type = TRACE_EVENT_UART_IN;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s <trace or raw file> [uart_in|uart_out|mqtt_in]\n", argv[0]);
+        return 1;
+    }
+    if (argc > 2)
+    {
+        type = !strcmp(argv[2], "uart_out") ? TRACE_EVENT_UART_OUT :
+               !strcmp(argv[2], "mqtt_in") ? TRACE_EVENT_MQTT_IN : TRACE_EVENT_UART_IN;
+    }
+    data = load_file(argv[1], &size);
+    if (data == NULL)
+    {
+        fprintf(stderr, "can't read %s\n", argv[1]);
+        return 1;
+    }
+    if (size >= sizeof(trace_file_header_t) && ((trace_file_header_t*)data)->magic == TRACE_FILE_MAGIC)
+    {
+        size = extract_trace(data, size, type);
+    }
+    if (size == 0)
+    {
+        fprintf(stderr, "nothing to compress\n");
+        return 1;
+    }
+
+    printf("output buffer %u bytes\n", (uint32_t)BENCH_OUT_SIZE);
+    printf("%8s %8s %8s %10s %8s %8s %10s %10s\n", "block", "blocks", "raw", "in", "out", "ratio", "cyc/byte", "ns/byte");
+    for (i = 0; i < sizeof(block_sizes) / sizeof(block_sizes[0]); i++)
+    {
+        uint32_t block = block_sizes[i], blocks = 0, raw = 0, in_bytes = 0, out_bytes = 0, round, rounds;
+        uint64_t cycles = 0, ns = 0;
+
+        if (block > size)
+        {
+            break;
+        }
+        rounds = 1 + BENCH_MIN_ROUNDS * 4096 / size;
+        for (round = 0; round < rounds; round++)
+        {
+            uint32_t offset;
+
+            for (offset = 0; offset + block <= size; offset += block)
+            {
+                uint64_t start_ns = bench_ns(), start_cycles = bench_cycles();
+                uint32_t length = lz_compress(&data[offset], block, compressed, sizeof(compressed), &state);
+
+                cycles += bench_cycles() - start_cycles;
+                ns += bench_ns() - start_ns;
+                if (round > 0)
+                {
+                    continue;
+                }
+                blocks++;
+                in_bytes += block;
+                /// a block that doesn't shrink is published raw
+                out_bytes += (length > 0) ? length : block;
+                raw += (length == 0);
+                if (length > 0 && (lz_decompress(compressed, length, check, sizeof(check)) != block ||
+                    memcmp(check, &data[offset], block) != 0))
+                {
+                    fprintf(stderr, "round trip FAILED at offset %u, block %u\n", offset, block);
+                    return 2;
+                }
+            }
+        }
+        printf("%8u %8u %8u %10u %8u %7.1f%% %10.1f %10.2f\n", block, blocks, raw, in_bytes, out_bytes,
+               100.0 * out_bytes / in_bytes, (double)cycles / ((double)in_bytes * rounds),
+               (double)ns / ((double)in_bytes * rounds));
+    }
+    free(data);
+    return 0;
+}
@@ -0,0 +1,252 @@
+/** @file Host simulation of the low-power polling policy
+ *
+ * Plays a gateway with two mesh bridges through a busy stretch (sensor
+ * frames every few hundred milliseconds), a sparse one (a frame every few
+ * seconds, so the polls have backed off when it arrives) and an idle one
+ * (nothing on the UARTs), with a keepalive probe and a summary window as
+ * the other deadlines, once with mqtt.power_save off and once on.  For
+ * each phase it reports wakeups per minute, the share of the time spent
+ * idle between the app's handlers, and how long received data waited in
+ * the UART for its poll, on average and at worst.
+ *
+ *   cc -O2 -I.. -o power_sim power_sim.c ../power_policy.c
+ *   ./power_sim [busy_s] [sparse_s] [idle_s]
+ *
+ * Copyright Ambient Sensors 2017
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "power_policy.h"
+
+#define SIM_BRIDGES             2
+#define SIM_HANDLER_MS          2       /// time the app spends awake per wakeup
+#define SIM_KEEPALIVE_MS        120000
+#define SIM_WINDOW_MS           60000
+#define SIM_BUSY_GAP_MS         400     /// mean gap between sensor frames on a busy bridge
+#define SIM_SPARSE_GAP_MS       8000    /// and on one that only reports now and then
+#define SIM_PHASES              3
+
+typedef struct
+{
+    const char *name;
+    uint32_t gap_ms;            /// mean gap between frames, 0 for none
+    uint32_t wakeups;
+    uint32_t idle_ms;
+    uint32_t length_ms;
+    uint32_t frames;
+    uint32_t wait_total_ms;
+    uint32_t wait_max_ms;
+} sim_phase_t;
+
+typedef struct
+{
+    power_poll_t poll;
+    uint32_t poll_due_ms;
+    uint32_t frame_due_ms;      /// next frame the bridge sends, UINT32_MAX for none
+    uint32_t waiting;           /// frames in the UART not yet polled
+    uint32_t waiting_since_ms[64];
+} sim_bridge_t;
+
+static uint32_t rng_state = 1;
+
+
+static uint32_t sim_random(uint32_t range)
+{
+    rng_state = rng_state * 1103515245 + 12345;
+    return (rng_state >> 8) % range;
+}
+
+static uint32_t sim_min(uint32_t a, uint32_t b)
+{
+    return (a < b) ? a : b;
+}
+
+/// the phase now_ms falls in, NULL past the end
+static sim_phase_t *sim_phase(sim_phase_t phases[SIM_PHASES], uint32_t now_ms, uint32_t *start_ms)
+{
+    uint8_t i;
+
+    *start_ms = 0;
+    for (i = 0; i < SIM_PHASES; i++)
+    {
+        if (now_ms - *start_ms < phases[i].length_ms)
+        {
+            return &phases[i];
+        }
+        *start_ms += phases[i].length_ms;
+    }
+    return NULL;
+}
+
+/// when a bridge sends its next frame after from_ms, UINT32_MAX for never
+static uint32_t sim_next_frame(sim_phase_t phases[SIM_PHASES], uint32_t from_ms)
+{
+    sim_phase_t *phase;
+    uint32_t start_ms, due_ms;
+
+    while ((phase = sim_phase(phases, from_ms, &start_ms)) != NULL)
+    {
+        if (phase->gap_ms > 0)
+        {
+            due_ms = from_ms + phase->gap_ms / 2 + sim_random(phase->gap_ms);
+            if (due_ms < start_ms + phase->length_ms)
+            {
+                return due_ms;
+            }
+        }
+        /// nothing more in this phase, carry on from the start of the next
+        from_ms = start_ms + phase->length_ms;
+    }
+    return UINT32_MAX;
+}
+
+/// returns the account over all phases
+static power_account_t sim_run(int backoff, sim_phase_t phases[SIM_PHASES])
+{
+    sim_bridge_t bridges[SIM_BRIDGES];
+    power_account_t account;
+    uint32_t keepalive_due = SIM_KEEPALIVE_MS, window_due = SIM_WINDOW_MS;
+    uint32_t end_ms = 0, now = 0, start_ms;
+    uint8_t i;
+
+    rng_state = 1;
+    power_account_init(&account, 0);
+    for (i = 0; i < SIM_PHASES; i++)
+    {
+        end_ms += phases[i].length_ms;
+    }
+    for (i = 0; i < SIM_BRIDGES; i++)
+    {
+        power_poll_reset(&bridges[i].poll);
+        bridges[i].poll_due_ms = 0;
+        bridges[i].frame_due_ms = sim_next_frame(phases, 0);
+        bridges[i].waiting = 0;
+    }
+
+    while (now < end_ms)
+    {
+        sim_phase_t *phase = sim_phase(phases, now, &start_ms);
+        uint32_t wake;
+
+        /// frames arriving in the UARTs don't wake the app, they wait for a poll
+        for (i = 0; i < SIM_BRIDGES; i++)
+        {
+            sim_bridge_t *bridge = &bridges[i];
+
+            while (bridge->frame_due_ms <= now)
+            {
+                if (bridge->waiting < sizeof(bridge->waiting_since_ms) / sizeof(bridge->waiting_since_ms[0]))
+                {
+                    bridge->waiting_since_ms[bridge->waiting++] = bridge->frame_due_ms;
+                }
+                bridge->frame_due_ms = sim_next_frame(phases, bridge->frame_due_ms);
+            }
+        }
+
+        /// everything due now runs in one wakeup, frames are counted in the phase they are polled in
+        power_account_wake(&account, now);
+        if (keepalive_due <= now)
+        {
+            keepalive_due = now + SIM_KEEPALIVE_MS;
+        }
+        if (window_due <= now)
+        {
+            window_due = now + SIM_WINDOW_MS;
+        }
+        for (i = 0; i < SIM_BRIDGES; i++)
+        {
+            sim_bridge_t *bridge = &bridges[i];
+            uint32_t received = bridge->waiting, deadline, j;
+
+            if (bridge->poll_due_ms > now)
+            {
+                continue;
+            }
+            for (j = 0; j < received; j++)
+            {
+                uint32_t waited = now - bridge->waiting_since_ms[j];
+
+                phase->frames += 1;
+                phase->wait_total_ms += waited;
+                if (waited > phase->wait_max_ms)
+                {
+                    phase->wait_max_ms = waited;
+                }
+            }
+            bridge->waiting = 0;
+            deadline = sim_min(keepalive_due, window_due);
+            deadline = sim_min(deadline, bridges[(i + 1) % SIM_BRIDGES].poll_due_ms);
+            bridge->poll_due_ms = now + power_poll_next(&bridge->poll, received, power_until(now, deadline), backoff);
+        }
+        power_account_sleep(&account, now + SIM_HANDLER_MS);
+
+        wake = sim_min(keepalive_due, window_due);
+        for (i = 0; i < SIM_BRIDGES; i++)
+        {
+            wake = sim_min(wake, bridges[i].poll_due_ms);
+        }
+        if (wake < now + SIM_HANDLER_MS)
+        {
+            wake = now + SIM_HANDLER_MS;
+        }
+        /// the idle time after a wakeup is counted in the phase the wakeup was in
+        phase->wakeups += 1;
+        phase->idle_ms += wake - (now + SIM_HANDLER_MS);
+        now = wake;
+    }
+    power_account_wake(&account, now);
+    return account;
+}
+
+static void sim_print(const char *mode, const sim_phase_t *phase)
+{
+    printf("%-4s %-6s %10.1f %8.1f%% %8u %10.0f %8u\n", mode, phase->name,
+           phase->wakeups * 60000.0 / phase->length_ms, 100.0 * phase->idle_ms / phase->length_ms,
+           phase->frames, phase->frames ? (double)phase->wait_total_ms / phase->frames : 0.0, phase->wait_max_ms);
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *names[SIM_PHASES] = { "busy", "sparse", "idle" };
+    static const uint32_t gaps_ms[SIM_PHASES] = { SIM_BUSY_GAP_MS, SIM_SPARSE_GAP_MS, 0 };
+    static const uint32_t lengths_s[SIM_PHASES] = { 600, 600, 1800 };
+    sim_phase_t off[SIM_PHASES] = { { 0 } }, on[SIM_PHASES];
+    power_account_t total_off, total_on;
+    uint32_t wait_max_off = 0, wait_max_on = 0;
+    uint8_t i;
+
+    for (i = 0; i < SIM_PHASES; i++)
+    {
+        off[i].name = names[i];
+        off[i].gap_ms = gaps_ms[i];
+        off[i].length_ms = ((argc > i + 1) ? strtoul(argv[i + 1], NULL, 10) : lengths_s[i]) * 1000;
+        if (off[i].length_ms == 0)
+        {
+            fprintf(stderr, "usage: %s [busy_s] [sparse_s] [idle_s]\n", argv[0]);
+            return 1;
+        }
+        on[i] = off[i];
+    }
+    total_off = sim_run(0, off);
+    total_on = sim_run(1, on);
+
+    printf("%d bridges, keepalive %us, summary window %us\n", SIM_BRIDGES, SIM_KEEPALIVE_MS / 1000, SIM_WINDOW_MS / 1000);
+    printf("%-4s %-6s %10s %9s %8s %10s %8s\n", "mode", "phase", "wakeup/min", "idle", "frames", "wait avg", "wait max");
+    for (i = 0; i < SIM_PHASES; i++)
+    {
+        sim_print("off", &off[i]);
+        wait_max_off = (off[i].wait_max_ms > wait_max_off) ? off[i].wait_max_ms : wait_max_off;
+    }
+    for (i = 0; i < SIM_PHASES; i++)
+    {
+        sim_print("on", &on[i]);
+        wait_max_on = (on[i].wait_max_ms > wait_max_on) ? on[i].wait_max_ms : wait_max_on;
+    }
+    printf("total: off %u wakeups %u ms idle, on %u wakeups %u ms idle\n",
+           total_off.wakeups, total_off.idle_ms, total_on.wakeups, total_on.idle_ms);
+    printf("worst-case wait for a poll: off %u ms, on %u ms (POWER_POLL_MAX_MS %u)\n",
+           wait_max_off, wait_max_on, POWER_POLL_MAX_MS);
+    return 0;
+}
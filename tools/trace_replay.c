@@ -0,0 +1,284 @@
+/** @file Host replay of captured gateway traffic
+ *
+ * Runs a capture made with trace_start through the app's own protocol
+ * code: every MQTT-in record (a C2D request) is parsed and encoded into
+ * mesh frames with mesh_parse_request(), every UART-in record is
+ * reassembled into frames per bridge with mesh_rx_feed() and the sensor
+ * readings in it are folded into the windowed aggregation.  UART-out
+ * records are what the gateway produced and are only counted.
+ *
+ *   cc -O2 -I.. -o trace_replay trace_replay.c ../mesh_protocol.c ../aggregate.c
+ *   ./trace_replay mesh.trc [speedup]
+ *
+ * speedup 1 replays at the original pace, N replays N times faster and 0
+ * (the default) as fast as possible.  Throughput, the time spent handling
+ * each kind of record and how far the replay fell behind schedule are
+ * reported at the end, so a capture from the field becomes a repeatable
+ * performance test.
+ *
+ * Copyright Ambient Sensors 2017
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+/// traffic_trace.h only needs these from zos.h
+typedef int zos_result_t;
+typedef int zos_bool_t;
+#include "traffic_trace.h"
+#include "mesh_protocol.h"
+#include "aggregate.h"
+
+#define REPLAY_BRIDGES          16      /// the bridge index is a nibble of the record flags
+#define REPLAY_RX_TIMEOUT_MS    400     /// as mesh_control.c, two polls
+
+typedef struct
+{
+    const char *name;
+    uint32_t records;
+    uint32_t bytes;
+    uint32_t errors;
+    uint64_t total_ns;
+    uint64_t max_ns;
+} replay_stats_t;
+
+typedef struct
+{
+    replay_stats_t mqtt_in;
+    replay_stats_t uart_in;
+    replay_stats_t uart_out;
+    uint32_t skipped;
+    uint32_t commands;
+    uint32_t frames_out;
+    uint32_t readings;
+    uint32_t crossed;
+    mesh_rx_t rx[REPLAY_BRIDGES];
+    agg_t agg;
+} replay_t;
+
+
+static uint64_t replay_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint8_t *load_file(const char *name, uint32_t *size)
+{
+    FILE *f = fopen(name, "rb");
+    uint8_t *data;
+    long length;
+
+    if (f == NULL)
+    {
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    length = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data = malloc(length > 0 ? length : 1);
+    if (data != NULL && fread(data, 1, length, f) != (size_t)length)
+    {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    *size = length;
+    return data;
+}
+
+/// mesh_command_cb_t, encode the command like mesh_batch_add() would
+static int replay_command(void *context, uint8_t cmd, uint16_t arg, uint8_t order)
+{
+    replay_t *replay = context;
+    uint8_t frame[MESH_MAX_CMD_LENGTH];
+
+    if (mesh_encode_command(cmd, arg, order, frame) == 0)
+    {
+        return -1;
+    }
+    replay->commands += 1;
+    replay->frames_out += 1;
+    return 0;
+}
+
+/// mesh_frame_cb_t, what telemetry_reading() does with a reading
+static void replay_frame(void *context, const uint8_t *frame, uint8_t length)
+{
+    replay_t *replay = context;
+    uint8_t board, metric;
+    int16_t value;
+
+    if (mesh_decode_sensor(frame, length, &board, &metric, &value) == 0)
+    {
+        replay->readings += 1;
+        replay->crossed += agg_add(&replay->agg, board, metric, value);
+    }
+}
+
+static void replay_account(replay_stats_t *stats, uint32_t length, uint64_t ns)
+{
+    stats->records += 1;
+    stats->bytes += length;
+    stats->total_ns += ns;
+    if (ns > stats->max_ns)
+    {
+        stats->max_ns = ns;
+    }
+}
+
+static void replay_record(replay_t *replay, const trace_record_header_t *record, const uint8_t *payload)
+{
+    uint64_t start = replay_ns();
+    const char *error;
+
+    switch (record->type)
+    {
+        case TRACE_EVENT_MQTT_IN:
+        {
+            uint16_t topic_len = payload[0] | (payload[1] << 8);
+
+            if (record->length < 2 || topic_len + 2 > record->length)
+            {
+                replay->skipped += 1;
+                return;
+            }
+            if (mesh_parse_request((const char*)&payload[2 + topic_len], record->length - topic_len - 2,
+                                   replay_command, replay, &error) < 0)
+            {
+                replay->mqtt_in.errors += 1;
+            }
+            replay_account(&replay->mqtt_in, record->length, replay_ns() - start);
+        }
+            break;
+        case TRACE_EVENT_UART_IN:
+            mesh_rx_feed(&replay->rx[record->flags >> TRACE_FLAG_BRIDGE_SHIFT], payload, record->length,
+                         record->time_ms, REPLAY_RX_TIMEOUT_MS, replay_frame, replay);
+            replay_account(&replay->uart_in, record->length, replay_ns() - start);
+            break;
+        case TRACE_EVENT_UART_OUT:
+            replay_account(&replay->uart_out, record->length, 0);
+            break;
+        default:
+            replay->skipped += 1;
+            break;
+    }
+}
+
+static void replay_print(const replay_stats_t *stats)
+{
+    printf("%-9s %8u %10u %8u %10.0f %10.0f\n", stats->name, stats->records, stats->bytes, stats->errors,
+           stats->records ? (double)stats->total_ns / stats->records : 0.0, (double)stats->max_ns);
+}
+
+int main(int argc, char *argv[])
+{
+    static replay_t replay;
+    static char summary[AGG_SUMMARY_SIZE];
+    trace_file_header_t header;
+    uint8_t *data;
+    uint32_t size, offset, speedup = 0, first_ms = 0, last_ms = 0, events = 0, bytes = 0, rx_errors = 0, i;
+    uint64_t start_ns, elapsed_ns, max_lag_ns = 0;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s <trace> [speedup]\n", argv[0]);
+        return 1;
+    }
+    if (argc > 2)
+    {
+        speedup = strtoul(argv[2], NULL, 10);
+    }
+    data = load_file(argv[1], &size);
+    if (data == NULL)
+    {
+        fprintf(stderr, "can't read %s\n", argv[1]);
+        return 1;
+    }
+    if (size < sizeof(header))
+    {
+        fprintf(stderr, "%s is not a trace file\n", argv[1]);
+        return 1;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != TRACE_FILE_MAGIC || header.version != TRACE_FILE_VERSION ||
+        header.record_header_size < sizeof(trace_record_header_t))
+    {
+        fprintf(stderr, "%s is not a trace file\n", argv[1]);
+        return 1;
+    }
+
+    replay.mqtt_in.name = "mqtt_in";
+    replay.uart_in.name = "uart_in";
+    replay.uart_out.name = "uart_out";
+    agg_init(&replay.agg);
+    start_ns = replay_ns();
+    for (offset = sizeof(header); offset + header.record_header_size <= size; events++)
+    {
+        trace_record_header_t record;
+
+        memcpy(&record, &data[offset], sizeof(record));
+        offset += header.record_header_size;
+        /// unwritten space at the end of the fixed length file reads back as 0x00 or 0xFF
+        if (record.type == 0 || record.length > TRACE_MAX_PAYLOAD || offset + record.length > size)
+        {
+            break;
+        }
+        if (events == 0)
+        {
+            first_ms = record.time_ms;
+        }
+        if (speedup > 0)
+        {
+            uint64_t due_ns = start_ns + (uint64_t)(record.time_ms - first_ms) * 1000000ULL / speedup;
+            uint64_t now_ns = replay_ns();
+
+            if (due_ns > now_ns)
+            {
+                struct timespec ts = { (due_ns - now_ns) / 1000000000ULL, (due_ns - now_ns) % 1000000000ULL };
+
+                nanosleep(&ts, NULL);
+            }
+            else if (now_ns - due_ns > max_lag_ns)
+            {
+                max_lag_ns = now_ns - due_ns;
+            }
+        }
+        last_ms = record.time_ms;
+        replay_record(&replay, &record, &data[offset]);
+        offset += record.length;
+        bytes += record.length;
+    }
+    elapsed_ns = replay_ns() - start_ns;
+    if (elapsed_ns == 0)
+    {
+        elapsed_ns = 1;
+    }
+    for (i = 0; i < REPLAY_BRIDGES; i++)
+    {
+        rx_errors += replay.rx[i].errors;
+    }
+    replay.uart_in.errors = rx_errors;
+
+    printf("%u events (%u skipped), %u bytes in %.1f ms at %ux\n", events, replay.skipped, bytes,
+           elapsed_ns / 1e6, speedup);
+    printf("throughput: %.0f events/s, %.0f bytes/s, max lag behind schedule %.1f ms\n",
+           events * 1e9 / elapsed_ns, bytes * 1e9 / elapsed_ns, max_lag_ns / 1e6);
+    printf("%-9s %8s %10s %8s %10s %10s\n", "record", "count", "bytes", "errors", "avg ns", "max ns");
+    replay_print(&replay.mqtt_in);
+    replay_print(&replay.uart_in);
+    replay_print(&replay.uart_out);
+    printf("%u commands encoded into %u frames, %u readings (%u crossed a threshold)\n",
+           replay.commands, replay.frames_out, replay.readings, replay.crossed);
+    if (agg_format_summary(&replay.agg, (last_ms - first_ms) / 1000, summary, sizeof(summary)) > 0)
+    {
+        printf("%s\n", summary);
+    }
+    free(data);
+    return 0;
+}
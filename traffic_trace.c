@@ -0,0 +1,459 @@
+/** @file This file contains the code for capturing and replaying gateway traffic
+ *
+ * Capture stages records in RAM and writes them to a fixed size file from a
+ * separate event, so the MQTT callback and UART handlers never wait on flash.
+ * Replay reads the file back one record ahead and feeds each MQTT-in record to
+ * the MQTT callback and each UART-in record to the mesh receive path, keeping
+ * the original spacing between records (optionally sped up).
+ *
+ * Copyright Ambient Sensors 2017
+ */
+
+#include "zos.h"
+#include "common.h"
+#include "mesh_control.h"
+#include "traffic_trace.h"
+#include "scheduler.h"
+
+#define TRACE_STAGING_SIZE          1024
+#define TRACE_FLUSH_THRESHOLD       (TRACE_STAGING_SIZE / 2)
+
+typedef struct
+{
+    zos_bool_t active;
+    uint32_t handle;
+    uint32_t start_ms;
+    uint32_t file_bytes;
+    uint32_t staged;
+    uint32_t records;
+    uint32_t dropped;
+    zos_bool_t flush_pending;       /// a flush is queued, don't queue another per record
+    uint8_t staging[TRACE_STAGING_SIZE];
+} trace_capture_t;
+
+typedef struct
+{
+    const uint8_t *data;
+    uint32_t length;
+} trace_part_t;
+
+typedef struct
+{
+    zos_bool_t active;
+    zos_bool_t injecting;           /// inside the MQTT callback with a recorded event
+    uint32_t handle;
+    uint32_t speedup;
+    uintptr_t run;                  /// passed to the handler, one queued for an earlier replay sees it changed
+    uint32_t start_ms;
+    uint32_t first_record_ms;
+    trace_record_header_t next;
+    uint8_t payload[TRACE_MAX_PAYLOAD];
+
+    uint32_t events;
+    uint32_t bytes;
+    uint32_t skipped;
+    uint32_t total_handler_ms;
+    uint32_t max_handler_ms;
+    uint32_t max_lag_ms;
+} trace_replay_t;
+
+static trace_capture_t capture;
+static trace_replay_t replay;
+
+static void trace_replay_handler(void *arg);
+
+
+static void trace_flush_handler(void *arg)
+{
+    uint32_t length = capture.staged;
+
+    capture.flush_pending = ZOS_FALSE;
+    if (length == 0)
+    {
+        return;
+    }
+    if (capture.file_bytes + length > TRACE_FILE_SIZE)
+    {
+        /// the file is full, write the whole records that still fit and stop capturing
+        uint32_t offset = (capture.file_bytes == 0) ? sizeof(trace_file_header_t) : 0;
+        uint32_t fits = 0;
+
+        while (offset + sizeof(trace_record_header_t) <= length)
+        {
+            trace_record_header_t record;
+
+            memcpy(&record, &capture.staging[offset], sizeof(record));
+            offset += sizeof(record) + record.length;
+            if (capture.file_bytes + offset > TRACE_FILE_SIZE)
+            {
+                capture.records -= 1;
+                capture.dropped += 1;
+                continue;
+            }
+            fits = offset;
+        }
+        ZOS_LOG("trace file full after %u records", capture.records);
+        if (fits > 0 && zn_file_write(capture.handle, capture.staging, fits) == ZOS_SUCCESS)
+        {
+            capture.file_bytes += fits;
+        }
+        capture.staged = 0;
+        trace_capture_stop();
+        return;
+    }
+    if (zn_file_write(capture.handle, capture.staging, length) != ZOS_SUCCESS)
+    {
+        ZOS_LOG("ERROR, %s failed to write %u bytes", __func__, length);
+        capture.dropped += 1;
+    }
+    else
+    {
+        capture.file_bytes += length;
+    }
+    capture.staged = 0;
+}
+
+static zos_bool_t trace_stage(const void *data, uint32_t length)
+{
+    if (capture.staged + length > TRACE_STAGING_SIZE)
+    {
+        return ZOS_FALSE;
+    }
+    memcpy(&capture.staging[capture.staged], data, length);
+    capture.staged += length;
+    return ZOS_TRUE;
+}
+
+zos_result_t trace_capture_start(const char *filename)
+{
+    zos_file_t file_info;
+    const trace_file_header_t header =
+    {
+        .magic = TRACE_FILE_MAGIC,
+        .version = TRACE_FILE_VERSION,
+        .record_header_size = sizeof(trace_record_header_t),
+    };
+
+    if (capture.active)
+    {
+        trace_capture_stop();
+    }
+
+    memset(&file_info, 0, sizeof(file_info));
+    strncpy(file_info.name, filename, sizeof(file_info.name) - 1);
+    file_info.size = TRACE_FILE_SIZE;
+    file_info.type = FILE_TYPE_MISC_FIX_LEN;
+
+    zn_file_delete(filename);
+    if (zn_file_create(&file_info, &capture.handle) != ZOS_SUCCESS)
+    {
+        ZOS_LOG("ERROR, failed to create trace file %s", filename);
+        return ZOS_ERROR;
+    }
+
+    capture.start_ms = zn_rtos_get_time();
+    capture.file_bytes = 0;
+    capture.staged = 0;
+    capture.records = 0;
+    capture.dropped = 0;
+    trace_stage(&header, sizeof(header));
+    capture.active = ZOS_TRUE;
+    ZOS_LOG("Capturing traffic into %s", filename);
+    return ZOS_SUCCESS;
+}
+
+void trace_capture_stop(void)
+{
+    if (!capture.active)
+    {
+        return;
+    }
+    trace_flush_handler(NULL);
+    capture.active = ZOS_FALSE;
+    zn_file_close(capture.handle);
+    ZOS_LOG("Trace stopped: %u records, %u bytes, %u dropped", capture.records,
+            capture.file_bytes, capture.dropped);
+}
+
+/// the payload is the parts one after the other, cut from the end if it doesn't fit
+static void trace_record_parts(trace_event_type_t type, uint8_t flags, const trace_part_t *parts, uint8_t count)
+{
+    trace_record_header_t record;
+    uint32_t length = 0, remaining, part_len;
+    uint8_t i;
+
+    if (!capture.active)
+    {
+        return;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        length += parts[i].length;
+    }
+    record.time_ms = zn_rtos_get_time() - capture.start_ms;
+    record.type = type;
+    record.flags = flags;
+    if (length > TRACE_MAX_PAYLOAD)
+    {
+        record.flags |= TRACE_FLAG_TRUNCATED;
+        length = TRACE_MAX_PAYLOAD;
+    }
+    record.length = length;
+
+    if (capture.staged + sizeof(record) + length > TRACE_STAGING_SIZE)
+    {
+        /// the flush event hasn't caught up, drop rather than block the caller
+        capture.dropped += 1;
+        return;
+    }
+    trace_stage(&record, sizeof(record));
+    for (i = 0, remaining = length; i < count && remaining > 0; i++)
+    {
+        part_len = (parts[i].length < remaining) ? parts[i].length : remaining;
+        trace_stage(parts[i].data, part_len);
+        remaining -= part_len;
+    }
+    capture.records += 1;
+
+    if (capture.staged >= TRACE_FLUSH_THRESHOLD && !capture.flush_pending)
+    {
+        /// if the queue is full the next record tries again
+        capture.flush_pending =
+            (SCHED_ISSUE(trace_flush_handler, NULL, SCHED_PRIORITY_LOW, SCHED_NO_DEADLINE) == ZOS_SUCCESS);
+    }
+}
+
+void trace_record(trace_event_type_t type, const uint8_t *data, uint16_t length)
+{
+    const trace_part_t part = { data, length };
+
+    trace_record_parts(type, 0, &part, 1);
+}
+
+void trace_record_uart(trace_event_type_t type, uint8_t bridge, const uint8_t *data, uint16_t length)
+{
+    const trace_part_t part = { data, length };
+
+    trace_record_parts(type, bridge << TRACE_FLAG_BRIDGE_SHIFT, &part, 1);
+}
+
+void trace_record_mqtt_in(const uint8_t *topic, uint16_t topic_len, const uint8_t *data, uint32_t data_len)
+{
+    uint8_t prefix[sizeof(uint16_t)];
+    trace_part_t parts[3];
+
+    if (!capture.active)
+    {
+        return;
+    }
+    /// the length stored is what the record holds of the topic, the data is cut first
+    if (topic_len > TRACE_MAX_PAYLOAD - sizeof(prefix))
+    {
+        topic_len = TRACE_MAX_PAYLOAD - sizeof(prefix);
+    }
+    prefix[0] = topic_len & 0xFF;
+    prefix[1] = (topic_len >> 8) & 0xFF;
+    parts[0].data = prefix;
+    parts[0].length = sizeof(prefix);
+    parts[1].data = topic;
+    parts[1].length = topic_len;
+    parts[2].data = data;
+    parts[2].length = data_len;
+    trace_record_parts(TRACE_EVENT_MQTT_IN, 0, parts, 3);
+}
+
+/*************************************************************************************************/
+static zos_bool_t trace_replay_read_next(void)
+{
+    uint32_t bytes_read;
+
+    if (zn_file_read(replay.handle, &replay.next, sizeof(replay.next), &bytes_read) != ZOS_SUCCESS ||
+        bytes_read != sizeof(replay.next) || replay.next.type == 0 ||
+        replay.next.length > TRACE_MAX_PAYLOAD)
+    {
+        /// unwritten space at the end of the fixed length file reads back as 0x00 or 0xFF
+        return ZOS_FALSE;
+    }
+    if (zn_file_read(replay.handle, replay.payload, replay.next.length, &bytes_read) != ZOS_SUCCESS ||
+        bytes_read != replay.next.length)
+    {
+        return ZOS_FALSE;
+    }
+    return ZOS_TRUE;
+}
+
+static void trace_replay_dispatch(void)
+{
+    switch (replay.next.type)
+    {
+        case TRACE_EVENT_MQTT_IN:
+        {
+            mqtt_event_info_t event;
+            uint16_t topic_len = replay.payload[0] | (replay.payload[1] << 8);
+
+            if (topic_len + 2 > replay.next.length)
+            {
+                replay.skipped += 1;
+                break;
+            }
+            memset(&event, 0, sizeof(event));
+            event.type = MQTT_EVENT_TYPE_PUBLISH_MSG_RECEIVED;
+            event.data.pub_recvd.topic = &replay.payload[2];
+            event.data.pub_recvd.topic_len = topic_len;
+            event.data.pub_recvd.data = &replay.payload[2 + topic_len];
+            event.data.pub_recvd.data_len = replay.next.length - topic_len - 2;
+            replay.injecting = ZOS_TRUE;
+            mqtt_app_inject_event(&event);
+            replay.injecting = ZOS_FALSE;
+        }
+            break;
+        case TRACE_EVENT_UART_IN:
+            mesh_process_rx_data(replay.next.flags >> TRACE_FLAG_BRIDGE_SHIFT, replay.payload, replay.next.length);
+            break;
+        default:
+            /// UART-out records are what the replay itself produces
+            replay.skipped += 1;
+            break;
+    }
+}
+
+static void trace_replay_finish(void)
+{
+    uint32_t elapsed_ms = zn_rtos_get_time() - replay.start_ms;
+    uint32_t handled = replay.events - replay.skipped;
+
+    sched_unregister_periodic(trace_replay_handler, (void*)replay.run);
+    zn_file_close(replay.handle);
+    replay.active = ZOS_FALSE;
+
+    if (elapsed_ms == 0)
+    {
+        elapsed_ms = 1;
+    }
+    ZOS_LOG("Replay done: %u events (%u skipped), %u bytes in %u ms", replay.events,
+            replay.skipped, replay.bytes, elapsed_ms);
+    ZOS_LOG("  throughput  : %u events/s, %u bytes/s", (replay.events * 1000) / elapsed_ms,
+            (replay.bytes * 1000) / elapsed_ms);
+    ZOS_LOG("  handler time: avg %u ms, max %u ms",
+            (handled > 0) ? replay.total_handler_ms / handled : 0, replay.max_handler_ms);
+    ZOS_LOG("  max lag behind schedule: %u ms", replay.max_lag_ms);
+}
+
+static void trace_replay_handler(void *arg)
+{
+    uint32_t now, due, handler_ms, delay;
+
+    if (!replay.active || (uintptr_t)arg != replay.run)
+    {
+        return;
+    }
+
+    now = zn_rtos_get_time();
+    due = replay.start_ms;
+    if (replay.speedup > 0)
+    {
+        due += (replay.next.time_ms - replay.first_record_ms) / replay.speedup;
+        if (now > due && now - due > replay.max_lag_ms)
+        {
+            replay.max_lag_ms = now - due;
+        }
+    }
+
+    trace_replay_dispatch();
+    handler_ms = zn_rtos_get_time() - now;
+    replay.events += 1;
+    replay.bytes += replay.next.length;
+    replay.total_handler_ms += handler_ms;
+    if (handler_ms > replay.max_handler_ms)
+    {
+        replay.max_handler_ms = handler_ms;
+    }
+
+    if (!trace_replay_read_next())
+    {
+        trace_replay_finish();
+        return;
+    }
+
+    delay = 0;
+    if (replay.speedup > 0)
+    {
+        due = replay.start_ms + (replay.next.time_ms - replay.first_record_ms) / replay.speedup;
+        now = zn_rtos_get_time();
+        delay = (due > now) ? due - now : 0;
+    }
+    if (delay > 0)
+    {
+        sched_register_timed("trace_replay_handler", trace_replay_handler, arg, delay);
+    }
+    else
+    {
+        /// a record dropped to a full queue would end the replay early
+        SCHED_ISSUE_RETRY(trace_replay_handler, arg, SCHED_PRIORITY_NORMAL, SCHED_NO_DEADLINE);
+    }
+}
+
+zos_result_t trace_replay_start(const char *filename, uint32_t speedup)
+{
+    trace_file_header_t header;
+    uint32_t bytes_read;
+
+    if (replay.active)
+    {
+        trace_replay_stop();
+    }
+    if (capture.active)
+    {
+        ZOS_LOG("Stop the capture before replaying");
+        return ZOS_ERROR;
+    }
+    if (zn_file_open(filename, &replay.handle) != ZOS_SUCCESS)
+    {
+        ZOS_LOG("ERROR, failed to open trace file %s", filename);
+        return ZOS_ERROR;
+    }
+    if (zn_file_read(replay.handle, &header, sizeof(header), &bytes_read) != ZOS_SUCCESS ||
+        bytes_read != sizeof(header) || header.magic != TRACE_FILE_MAGIC ||
+        header.version != TRACE_FILE_VERSION || header.record_header_size != sizeof(trace_record_header_t))
+    {
+        ZOS_LOG("ERROR, %s is not a trace file", filename);
+        zn_file_close(replay.handle);
+        return ZOS_ERROR;
+    }
+    if (!trace_replay_read_next())
+    {
+        ZOS_LOG("Trace %s is empty", filename);
+        zn_file_close(replay.handle);
+        return ZOS_ERROR;
+    }
+
+    replay.speedup = speedup;
+    replay.first_record_ms = replay.next.time_ms;
+    replay.events = 0;
+    replay.bytes = 0;
+    replay.skipped = 0;
+    replay.total_handler_ms = 0;
+    replay.max_handler_ms = 0;
+    replay.max_lag_ms = 0;
+    replay.start_ms = zn_rtos_get_time();
+    replay.run += 1;
+    replay.active = ZOS_TRUE;
+
+    ZOS_LOG("Replaying %s at %ux", filename, speedup);
+    SCHED_ISSUE_RETRY(trace_replay_handler, (void*)replay.run, SCHED_PRIORITY_NORMAL, SCHED_NO_DEADLINE);
+    return ZOS_SUCCESS;
+}
+
+void trace_replay_stop(void)
+{
+    if (replay.active)
+    {
+        trace_replay_finish();
+    }
+}
+
+zos_bool_t trace_replay_injecting(void)
+{
+    return replay.injecting;
+}
@@ -0,0 +1,95 @@
+/** @file This file contains the api for capturing and replaying gateway traffic
+ *
+ * A trace is a flat binary file on the module's flash file system:
+ *
+ *   trace_file_header_t, then for every event
+ *   trace_record_header_t followed by 'length' bytes of payload
+ *
+ * All fields are little endian.  The payload of a TRACE_EVENT_MQTT_IN record is
+ * a 16 bit topic length, the topic, then the message data.  UART records hold the
+ * raw bytes that crossed the serial port, the bridge they belong to is in the
+ * high nibble of the flags (0 in traces from before multiple bridges).  Payloads longer than TRACE_MAX_PAYLOAD
+ * are truncated (see TRACE_FLAG_TRUNCATED), an MQTT-in record loses its message
+ * data before its topic, so the property bag (iothub-enqueuedtime, $.mid, ...)
+ * is kept.
+ *
+ * Copyright Ambient Sensors 2017
+ */
+#ifndef _TRAFFIC_TRACE_H_
+#define _TRAFFIC_TRACE_H_
+
+#define TRACE_FILE_MAGIC            0x43525441UL /// "ATRC"
+#define TRACE_FILE_VERSION          1
+#define TRACE_FILE_SIZE             (64*1024)
+#define TRACE_MAX_PAYLOAD           512     /// a devicebound topic with its property bag and a full C2D request
+#define TRACE_MAX_FILENAME_SIZE     32
+
+#define TRACE_FLAG_TRUNCATED        0x01
+#define TRACE_FLAG_BRIDGE_SHIFT     4       /// UART records: mesh bridge index in the high nibble
+
+typedef enum
+{
+    TRACE_EVENT_MQTT_IN  = 1,   /// C2D message handed to mqtt_connection_event_cb
+    TRACE_EVENT_UART_OUT = 2,   /// bytes transmitted to the mesh bridge
+    TRACE_EVENT_UART_IN  = 3,   /// bytes received from the mesh bridge
+} trace_event_type_t;
+
+#pragma pack(1)
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_header_size;
+} trace_file_header_t;
+
+typedef struct
+{
+    uint32_t time_ms;           /// milliseconds since the capture was started
+    uint8_t type;               /// trace_event_type_t
+    uint8_t flags;
+    uint16_t length;            /// payload bytes following this header
+} trace_record_header_t;
+#pragma pack()
+
+/** @brief Start capturing traffic into the given file (replaces an existing file)
+ */
+zos_result_t trace_capture_start(const char *filename);
+
+/** @brief Stop capturing, flush what is buffered and log the capture statistics
+ */
+void trace_capture_stop(void);
+
+/** @brief Record one event while a capture is active, no-op otherwise
+ *
+ *  Safe to call from the MQTT callback and the UART handlers, the record is
+ *  staged in RAM and written to flash from a separate event.
+ */
+void trace_record(trace_event_type_t type, const uint8_t *data, uint16_t length);
+
+/** @brief Record bytes that crossed the UART of a mesh bridge while a capture is active
+ */
+void trace_record_uart(trace_event_type_t type, uint8_t bridge, const uint8_t *data, uint16_t length);
+
+/** @brief Record an incoming C2D message (topic and data) while a capture is active
+ */
+void trace_record_mqtt_in(const uint8_t *topic, uint16_t topic_len, const uint8_t *data, uint32_t data_len);
+
+/** @brief Replay a capture through the MQTT callback and the mesh receive path
+ *
+ *  speedup of 1 replays at the original pace, N replays N times faster and
+ *  0 replays as fast as the event loop allows.  A summary with throughput and
+ *  handler latency is logged when the end of the trace is reached.
+ */
+zos_result_t trace_replay_start(const char *filename, uint32_t speedup);
+
+/** @brief Abort a replay in progress
+ */
+void trace_replay_stop(void);
+
+/** @brief ZOS_TRUE while the replay is handing a recorded event to the app
+ *
+ *  Lets the handlers keep replayed events out of the live statistics.
+ */
+zos_bool_t trace_replay_injecting(void);
+
+#endif